@@ -0,0 +1,70 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef COMPRESSION__H
+#define COMPRESSION__H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+struct evbuffer;
+
+namespace Metre {
+    // XEP-0138 stream compression methods available in this build.
+    bool compression_supported(std::string const &method);
+
+    // Pre-shared dictionary of strings common in presence and disco traffic.
+    std::string const &compression_dictionary();
+
+    /**
+     * One direction of a compressed stream. Compressors flush at the end of each call, so
+     * nothing is held back waiting for more; decompressors stop once they've produced
+     * limit octets, and are pending() if they might have more without further input.
+     */
+    class Codec {
+    protected:
+        bool m_full = false; // The last output chunk was filled.
+
+    public:
+        static constexpr std::size_t chunk_size = 4096;
+
+        virtual bool transform(struct evbuffer *src, struct evbuffer *dst, std::size_t limit) = 0;
+
+        bool pending() const {
+            return m_full;
+        }
+
+        virtual ~Codec() = default;
+    };
+
+    // Throw if the method isn't supported by this build.
+    std::unique_ptr<Codec> compressor(std::string const &method, unsigned window, std::string const *dictionary);
+
+    std::unique_ptr<Codec> decompressor(std::string const &method, unsigned window,
+                                        std::shared_ptr<std::string const> const &dictionary);
+}
+
+#endif
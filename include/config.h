@@ -28,14 +28,22 @@ SOFTWARE.
 
 #include <string>
 #include <map>
+#include <array>
+#include <unordered_map>
 #include <unordered_set>
 #include <optional>
 #include <memory>
 #include <list>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
 #include <rapidxml.hpp>
+#include <event2/util.h>
 
 #include "defs.h"
 #include "dns.h"
+#include "domainid.h"
+#include "log.h"
 #include "spdlog/spdlog.h"
 
 /**
@@ -52,6 +60,18 @@ struct x509_store_ctx_st; // X509_STORE_CTX;
 struct ub_ctx;
 struct ub_result;
 
+/**
+ * Libevent.
+ */
+
+struct bufferevent;
+
+namespace spdlog {
+    namespace details {
+        class thread_pool;
+    }
+}
+
 namespace Metre {
     class Config {
     public:
@@ -62,6 +82,28 @@ namespace Metre {
 
         class Domain;
 
+        /**
+         * Kernel socket and bufferevent tuning, for a listener or a domain.
+         * Anything unset is left at the system default.
+         */
+        struct SocketOptions {
+            std::optional<int> rcvbuf;
+            std::optional<int> sndbuf;
+            std::optional<bool> nodelay;
+            std::optional<bool> keepalive;
+            std::optional<int> keepalive_idle; // Seconds.
+            std::optional<int> keepalive_interval; // Seconds.
+            std::optional<int> keepalive_count;
+            std::optional<int> notsent_lowat;
+            std::optional<std::size_t> read_low;
+            std::optional<std::size_t> read_high;
+
+            // Kernel options; buffer sizes want setting before connect or listen.
+            void apply(evutil_socket_t fd) const;
+
+            void watermarks(struct bufferevent *bev) const;
+        };
+
         class Resolver {
         public:
             Resolver(Domain const &);
@@ -76,11 +118,11 @@ namespace Metre {
             tlsa_callback_t &TlsaLookup(short unsigned int port, std::string const &hostname);
 
             /* DNS callbacks */
-            void a_lookup_done(int err, struct ub_result *result);
+            void a_lookup_done(DNS::Answer const &);
 
-            void srv_lookup_done(int err, struct ub_result *result);
+            void srv_lookup_done(DNS::Answer const &);
 
-            void tlsa_lookup_done(int err, struct ub_result *result);
+            void tlsa_lookup_done(DNS::Answer const &);
 
             spdlog::logger &logger() const {
                 return *m_logger;
@@ -94,7 +136,8 @@ namespace Metre {
             std::map<std::string, addr_callback_t> m_a_pending;
             std::map<std::string, tlsa_callback_t> m_tlsa_pending;
             std::shared_ptr<spdlog::logger> m_logger;
-            std::unordered_set<int> m_queries;
+
+            void query(std::string const &record, int rrtype, void (Resolver::*done)(DNS::Answer const &));
         };
 
         class Domain {
@@ -155,6 +198,26 @@ namespace Metre {
                 return m_connect_timeout = connect_timeout;
             }
 
+            // Octets pending to this domain, queued or unsent, at which inbound sessions feeding it
+            // stop reading, and resume; and at which stanzas are bounced (0 for no limit).
+            std::size_t queue_high() const {
+                return m_queue_high;
+            }
+
+            std::size_t queue_low() const {
+                return m_queue_low;
+            }
+
+            std::size_t queue_max() const {
+                return m_queue_max;
+            }
+
+            void queue_limits(std::size_t low, std::size_t high, std::size_t max) {
+                m_queue_low = low;
+                m_queue_high = high;
+                m_queue_max = max;
+            }
+
             bool dnssec_required() const {
                 return m_dnssec_required;
             }
@@ -180,6 +243,42 @@ namespace Metre {
                 return m_cipherlist = c;
             }
 
+            // XEP-0138 methods to use with this domain, in order of preference (empty for none).
+            std::list<std::string> const &compression() const {
+                return m_compression;
+            }
+
+            unsigned compression_window() const {
+                return m_compression_window;
+            }
+
+            // Pre-shared with the peer; null for none.
+            std::shared_ptr<std::string const> const &compression_dictionary() const {
+                return m_compression_dictionary;
+            }
+
+            std::string const &compression_dictionary_source() const {
+                return m_compression_dictionary_source;
+            }
+
+            void compression(std::list<std::string> const &methods, unsigned window, std::string const &dictionary);
+
+            SocketOptions const &socket() const {
+                return m_socket;
+            }
+
+            // Stanzas each priority class sends per round while a route is backlogged:
+            // iq, message, presence.
+            std::array<unsigned, 3> const &priority_weights() const {
+                return m_priority_weights;
+            }
+
+            void priority_weights(std::array<unsigned, 3> const &weights);
+
+            void socket(SocketOptions const &options) {
+                m_socket = options;
+            }
+
             std::optional<std::string> const &auth_secret() const {
                 return m_auth_secret;
             }
@@ -187,7 +286,11 @@ namespace Metre {
             struct ssl_ctx_st *ssl_ctx() const;
 
             /* Loading functions */
-            void x509(std::string const &chain, std::string const &key);
+            void x509(std::string const &chain, std::string const &key, bool ocsp_staple = true);
+
+            bool ocsp_staple() const {
+                return m_ocsp_staple;
+            }
 
             void host(std::string const &hostname, uint32_t inaddr);
 
@@ -213,6 +316,10 @@ namespace Metre {
                 return m_filters;
             }
 
+            bool filtered() const {
+                return !m_filters.empty();
+            }
+
             bool auth_endpoint(std::string const &ip, unsigned short port) const;
 
             bool auth_host() const {
@@ -255,10 +362,20 @@ namespace Metre {
             bool m_dnssec_required = false;
             unsigned m_stanza_timeout = 20;
             unsigned m_connect_timeout = 10;
+            std::size_t m_queue_low = 256 * 1024;
+            std::size_t m_queue_high = 1024 * 1024;
+            std::size_t m_queue_max = 0;
             std::string m_dhparam;
             std::string m_cipherlist;
+            std::list<std::string> m_compression;
+            unsigned m_compression_window = 12;
+            std::shared_ptr<std::string const> m_compression_dictionary;
+            std::string m_compression_dictionary_source;
+            SocketOptions m_socket;
+            std::array<unsigned, 3> m_priority_weights{{4, 2, 1}};
             std::optional<std::string> m_auth_secret;
             struct ssl_ctx_st *m_ssl_ctx = nullptr;
+            bool m_ocsp_staple = true;
             // DNS Overrides:
             std::map<std::string, std::unique_ptr<DNS::Address>> m_host_arecs;
             std::unique_ptr<DNS::Srv> m_srvrec;
@@ -296,10 +413,12 @@ namespace Metre {
 
         void docker_setup();
 
-        void dns_init() const;
+        void dns_init(bool reload = false) const;
 
         Domain const &domain(std::string const &domain) const;
 
+        Domain const &domain(DomainId const &domain) const;
+
         void load(std::string const &filename);
 
         static Config const &config();
@@ -312,14 +431,40 @@ namespace Metre {
 
         std::string dialback_key(std::string const &id, std::string const &local_domain, std::string const &remote_domain) const;
 
-        struct ub_ctx *ub_ctx() const {
-            return m_ub_ctx;
+        // The calling worker thread's resolver context.
+        struct ub_ctx *ub_ctx() const;
+
+        unsigned threads() const {
+            return m_threads;
         }
 
         bool fetch_pkix_status() const {
             return m_fetch_crls;
         }
 
+        // Seconds each session ticket key is used for issuing; 0 disables tickets.
+        unsigned tls_ticket_lifetime() const {
+            return m_tls_ticket_lifetime;
+        }
+
+        // Prometheus exporter; port 0 if disabled.
+        std::string const &metrics_address() const {
+            return m_metrics_address;
+        }
+
+        unsigned short metrics_port() const {
+            return m_metrics_port;
+        }
+
+        // Most a session reads per turn of the event loop before yielding to others; 0 is unlimited.
+        std::size_t read_budget_stanzas() const {
+            return m_read_budget_stanzas;
+        }
+
+        std::size_t read_budget_bytes() const {
+            return m_read_budget_bytes;
+        }
+
         class Listener {
         public:
             SESSION_TYPE session_type;
@@ -328,6 +473,8 @@ namespace Metre {
             std::string const local_domain;
             std::string const remote_domain;
             std::set<std::string> allowed_domains;
+            SocketOptions socket;
+            bool reuseport = false; // Each worker accepts for itself; S2S only.
         private:
             struct sockaddr_storage m_sockaddr;
         public:
@@ -347,8 +494,24 @@ namespace Metre {
             return *m_root_logger;
         }
 
+        // Shares the root logger's sinks and, once log_init() has run, its writer thread.
         std::shared_ptr<spdlog::logger> logger(std::string const &) const;
 
+        std::shared_ptr<spdlog::logger> logger(std::string_view component, Log::Fields fields) const {
+            return logger(Log::name(component, fields));
+        }
+
+        // Applies to every logger, including those already created.
+        void log_level(spdlog::level::level_enum level) const;
+
+        spdlog::level::level_enum log_level() const {
+            return m_log_level;
+        }
+
+        spdlog::level::level_enum configured_log_level() const {
+            return m_configured_log_level;
+        }
+
         std::string const &database() const {
             return m_database;
         }
@@ -363,6 +526,12 @@ namespace Metre {
         void create_domain(std::string const &dom);
 
         bool m_fetch_crls = true;
+        unsigned m_threads = 1;
+        unsigned m_tls_ticket_lifetime = 3600;
+        std::string m_metrics_address = "127.0.0.1";
+        unsigned short m_metrics_port = 0;
+        std::size_t m_read_budget_stanzas = 64;
+        std::size_t m_read_budget_bytes = 256 * 1024;
         std::string m_config_str;
         std::string m_default_domain;
         std::string m_runtime_dir;
@@ -374,10 +543,17 @@ namespace Metre {
         std::string m_boot;
         std::string m_database;
         std::map<std::string, std::unique_ptr<Domain>> m_domains;
-        struct ub_ctx *m_ub_ctx = nullptr;
+        mutable std::mutex m_domains_mutex; // Only for creating domains; lookups go through per-thread caches.
+        std::uint64_t m_generation; // Tells the per-thread caches which Config they hold.
         std::list<Listener> m_listeners;
         std::shared_ptr<spdlog::logger> m_root_logger;
         std::shared_ptr<spdlog::logger> m_logger;
+        std::shared_ptr<spdlog::details::thread_pool> m_log_pool;
+        spdlog::level::level_enum m_configured_log_level = spdlog::level::info;
+        mutable std::atomic<spdlog::level::level_enum> m_log_level{spdlog::level::trace};
+        mutable std::mutex m_loggers_mutex;
+        mutable std::list<std::weak_ptr<spdlog::logger>> m_loggers; // For log_level().
+        mutable std::size_t m_loggers_prune = 64;
     };
 }
 
@@ -8,10 +8,14 @@
 
 #include "defs.h"
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
 
+#include "domainid.h"
+
 struct event_base;
 struct sockaddr;
 
@@ -19,9 +23,9 @@ namespace Metre {
     namespace Router {
         std::shared_ptr<NetSession> session_by_address(std::string const &remote_addr, unsigned short port);
 
-        std::shared_ptr<NetSession> session_by_domain(std::string const &remote_addr);
+        std::shared_ptr<NetSession> session_by_domain(DomainId const &domain);
 
-        void register_session_domain(std::string const &dom, NetSession &);
+        void register_session_domain(DomainId const &dom, NetSession &);
 
         std::shared_ptr<NetSession>
         connect(std::string const &fromd, std::string const &tod, std::string const &hostname, struct sockaddr *addr,
@@ -35,10 +39,21 @@ namespace Metre {
 
         void unregister_stream_id(std::string const &);
 
+        // Calls back on the thread owning the session with this stream id; nullptr if there's none.
+        void with_stream_id(std::string const &stream_id,
+                            std::function<void(std::shared_ptr<NetSession> const &)> &&);
+
         void defer(std::function<void()> &&);
 
         void defer(std::function<void()> &&, std::size_t seconds);
 
+        // Timers, to the millisecond. A zero handle is never issued.
+        typedef std::uint64_t TimerHandle;
+
+        TimerHandle defer(std::function<void()> &&, std::chrono::milliseconds);
+
+        bool cancel(TimerHandle);
+
         void main(std::function<bool()> const &);
 
         void reload();
@@ -46,6 +61,17 @@ namespace Metre {
         void quit();
 
         struct event_base *event_base();
+
+        /*
+         * Worker threads. Each has its own event loop; every session, and every route,
+         * belongs to exactly one of them.
+         */
+        unsigned worker();
+
+        unsigned worker_for(std::string const &domain);
+
+        // Run on the given worker's thread - immediately, if that's this one.
+        void on_worker(unsigned worker, std::function<void()> &&);
     }
 }
 
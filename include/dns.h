@@ -30,6 +30,7 @@ SOFTWARE.
 #include "sigslot.h"
 #include <string>
 #include <vector>
+#include <chrono>
 // For struct sockaddr_storage :
 #ifdef METRE_UNIX
 #include <netinet/in.h>
@@ -58,6 +59,7 @@ namespace Metre {
             bool dnssec = false;
             std::string error;
             bool nxdomain = false;
+            std::chrono::steady_clock::time_point expires = std::chrono::steady_clock::time_point::max(); // Earliest TTL expiry of the answers used.
         };
 
         class Address {
@@ -98,10 +100,29 @@ namespace Metre {
             std::string domain;
             std::string error;
             bool dnssec = false;
+            std::chrono::steady_clock::time_point expires = std::chrono::steady_clock::time_point::max(); // Earliest TTL expiry of the answers used.
 
             std::vector<TlsaRR> rrs;
         };
 
+        /**
+         * The response to a single (qname, qtype) query, as held in the shared cache.
+         * DNSSEC policy is applied by each resolver on the way out.
+         */
+        class Answer {
+        public:
+            std::string qname;
+            int qtype = 0;
+            int err = 0; // Non-zero if libunbound couldn't resolve at all.
+            bool havedata = false;
+            bool nxdomain = false;
+            bool secure = false;
+            bool bogus = false;
+            std::string why_bogus;
+            std::vector<std::string> rdata;
+            std::chrono::steady_clock::time_point expires; // When the shared cache drops it.
+        };
+
     }
 }
 
@@ -0,0 +1,86 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef DOMAINID__H
+#define DOMAINID__H
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <utility>
+
+namespace Metre {
+    /**
+     * Interned domain name. Each distinct name is stored once for the life of
+     * the process, so handles compare and hash by address.
+     */
+    class DomainId {
+        std::string const *m_name;
+
+        static std::string const *intern(std::string_view name);
+
+    public:
+        DomainId();
+
+        explicit DomainId(std::string_view name) : m_name(intern(name)) {}
+
+        std::string const &str() const {
+            return *m_name;
+        }
+
+        bool empty() const {
+            return m_name->empty();
+        }
+
+        bool operator==(DomainId const &other) const {
+            return m_name == other.m_name;
+        }
+
+        bool operator!=(DomainId const &other) const {
+            return m_name != other.m_name;
+        }
+
+        std::size_t hash() const {
+            return std::hash<std::string const *>()(m_name);
+        }
+    };
+
+    struct DomainPairHash {
+        std::size_t operator()(std::pair<DomainId, DomainId> const &p) const {
+            return p.first.hash() * 31 + p.second.hash();
+        }
+    };
+}
+
+namespace std {
+    template<>
+    struct hash<Metre::DomainId> {
+        std::size_t operator()(Metre::DomainId const &d) const {
+            return d.hash();
+        }
+    };
+}
+
+#endif
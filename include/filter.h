@@ -75,6 +75,10 @@ namespace Metre {
         /* Actually do the filter. Tinkering with the stanza is fine. */
         virtual FILTER_RESULT apply(SESSION_DIRECTION dir, Stanza &) = 0;
 
+        std::string const &name() const {
+            return m_description.name;
+        }
+
     protected:
         /* Node will be an element of the filter name. */
         virtual void do_dump_config(rapidxml::xml_document<> &, rapidxml::xml_node<> *) {}
@@ -0,0 +1,89 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef HAPPYEYEBALLS__H
+#define HAPPYEYEBALLS__H
+
+#include "core.h"
+#include <chrono>
+#include <cstddef>
+#include <functional>
+
+namespace Metre {
+    /**
+     * Pacing for Happy Eyeballs (RFC 8305) connection attempts. Candidates, numbered in
+     * the order they're added, each get an attempt in turn, delay after the last, or
+     * straight away if every attempt in flight has failed. What an attempt is, and what
+     * winning means, is up to the owner.
+     */
+    class HappyEyeballs {
+    public:
+        // start(n) begins an attempt on candidate n, returning false if it failed at once.
+        // exhausted() is called once resolved() and every candidate's attempt has failed.
+        HappyEyeballs(std::chrono::milliseconds delay, std::function<bool(std::size_t)> &&start,
+                      std::function<void()> &&exhausted);
+
+        HappyEyeballs(HappyEyeballs const &) = delete;
+
+        HappyEyeballs &operator=(HappyEyeballs const &) = delete;
+
+        ~HappyEyeballs();
+
+        // Another n candidates are available.
+        void add(std::size_t n);
+
+        // No more candidates are coming.
+        void resolved();
+
+        // An attempt in flight has failed.
+        void failed();
+
+        // The race is over, one way or another; nothing more is started.
+        void stop();
+
+        std::size_t in_flight() const {
+            return m_in_flight;
+        }
+
+    private:
+        void arm();
+
+        void attempt();
+
+        void kick();
+
+        std::chrono::milliseconds const m_delay;
+        std::function<bool(std::size_t)> m_start;
+        std::function<void()> m_exhausted;
+        std::size_t m_candidates = 0;
+        std::size_t m_next = 0;
+        std::size_t m_in_flight = 0;
+        Router::TimerHandle m_timer = 0;
+        bool m_resolved = false;
+        bool m_stopped = false;
+    };
+}
+
+#endif
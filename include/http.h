@@ -7,8 +7,11 @@
 
 #include "sigslot.h"
 #include <map>
+#include <set>
+#include <string>
 
 struct evhttp_request;
+struct evhttp_connection;
 struct X509_crl_st;
 
 namespace Metre {
@@ -19,29 +22,47 @@ namespace Metre {
 
     private:
         std::map<std::string, crl_callback_t> m_crl_waiting;
-        std::map<std::string, ocsp_callback_t> m_ocsp_waiting;
-        std::map<std::string, struct X509_crl_st *> m_crl_cache;
-        std::map<std::string, std::string> m_ocsp_cache;
+        std::map<std::string, ocsp_callback_t> m_ocsp_waiting; // By URI and request.
+        std::map<std::uintptr_t, std::string> m_ocsp_requests;
+        std::set<std::string> m_ocsp_pending; // By URI and request, while in flight.
+        // CRL fetching happens on the first worker only; these are its own.
         std::map<std::uintptr_t, std::string> m_requests;
         std::uintptr_t m_req = 0;
+        std::map<std::string, struct evhttp_connection *> m_connections; // By scheme://host:port
 
     public:
         Http() = default;
 
         static crl_callback_t &crl(std::string const &uri);
 
-        static ocsp_callback_t &ocsp(std::string const &uri);
+        // POSTs a DER OCSP request; the callback has the DER response, if any.
+        static ocsp_callback_t &ocsp(std::string const &uri, std::string const &request);
+
+        // Loads persisted CRLs and starts refreshing them in the background. First worker only.
+        static void init();
 
     private:
         static Http & http();
 
+        struct evhttp_connection *connection(std::string const &uri, std::string &target, std::string &host);
+
+        static void s_connection_closed(struct evhttp_connection *, void *arg);
+
         crl_callback_t &do_crl(std::string const &uri);
 
+        void fetch_crl(std::string const &uri);
+
         void done_crl(struct evhttp_request *, std::uintptr_t key);
 
+        void finish_crl(std::string const &uri, int code, struct X509_crl_st *crl);
+
+        void notify_crl(std::string const &uri, int code, struct X509_crl_st *crl);
+
+        void refresh_crls();
+
         static void s_done_crl(struct evhttp_request *, void *arg);
 
-        ocsp_callback_t &do_ocsp(std::string const &uri);
+        ocsp_callback_t &do_ocsp(std::string const &uri, std::string const &request);
 
         void done_ocsp(struct evhttp_request *, std::uintptr_t key);
 
@@ -27,14 +27,17 @@ SOFTWARE.
 #define JID__H
 
 #include <string>
+#include <string_view>
 #include <optional>
 
 #include <spdlog/common.h>
 
+#include "domainid.h"
+
 namespace Metre {
     class Jid {
         std::optional<std::string> m_local;
-        std::string m_domain;
+        DomainId m_domain;
         std::optional<std::string> m_resource;
 
         mutable std::optional<std::string> m_full;
@@ -44,6 +47,14 @@ namespace Metre {
             parse(jid);
         }
 
+        Jid(std::string_view jid) {
+            parse(jid);
+        }
+
+        Jid(const char *jid) {
+            parse(jid);
+        }
+
         Jid(std::string const &local, std::string const &domain)
                 : m_local(local), m_domain(domain) {
         }
@@ -61,11 +72,15 @@ namespace Metre {
         std::string const &bare() const;
 
         std::string const &domain() const {
+            return m_domain.str();
+        }
+
+        DomainId const &domain_id() const {
             return m_domain;
         }
 
     protected:
-        void parse(std::string const &s);
+        void parse(std::string_view s);
     };
 
     inline spdlog::string_view_t to_string_view(const Jid &jid) {
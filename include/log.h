@@ -30,8 +30,19 @@ SOFTWARE.
 #include <sstream>
 #include <memory>
 #include <ctime>
+#include <initializer_list>
+#include <string_view>
+#include <utility>
 #include "spdlog/spdlog.h"
 
+/**
+ * Log sites below this level are compiled out entirely; release builds set it to
+ * SPDLOG_LEVEL_INFO. Above it, the level is checked before any arguments are evaluated.
+ */
+#ifndef METRE_LOG_ACTIVE_LEVEL
+#define METRE_LOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+
 namespace Metre {
     namespace Log {
         typedef enum {
@@ -46,10 +57,50 @@ namespace Metre {
             TRACE
         } LEVEL;
 
+        constexpr spdlog::level::level_enum level(LEVEL l) {
+            switch (l) {
+                case EMERG:
+                case ALERT:
+                case CRIT:
+                    return spdlog::level::critical;
+                case ERR:
+                    return spdlog::level::err;
+                case WARNING:
+                case NOTICE:
+                    return spdlog::level::warn;
+                case INFO:
+                    return spdlog::level::info;
+                case DEBUG:
+                    return spdlog::level::debug;
+                default:
+                    return spdlog::level::trace;
+            }
+        }
+
+        bool enabled(LEVEL l);
+
         void log(Log::LEVEL lvlm, std::string const &filename, int line, std::string const &stuff);
+
+        // Identifying fields for a logger, as in "NetSession serial=[4] dir=[IN]".
+        using Fields = std::initializer_list<std::pair<std::string_view, std::string_view>>;
+
+        std::string name(std::string_view component, Fields fields);
     }
 }
 
-#define METRE_LOG(l, x) {  std::ostringstream ss; ss << x; Metre::Log::log(l, __FILE__, __LINE__, ss.str()); } (void) 0
+#define METRE_LOG(l, x) do { \
+    if constexpr (Metre::Log::level(l) >= METRE_LOG_ACTIVE_LEVEL) { \
+        if (Metre::Log::enabled(l)) { std::ostringstream ss; ss << x; Metre::Log::log(l, __FILE__, __LINE__, ss.str()); } \
+    } } while (0)
+
+// For spdlog loggers: nothing is evaluated unless the logger's level permits.
+#define METRE_LOGGER_CALL(logger, lvl, ...) do { \
+    if constexpr (lvl >= METRE_LOG_ACTIVE_LEVEL) { \
+        auto &metre_logger_ = (logger); \
+        if (metre_logger_.should_log(lvl)) metre_logger_.log(lvl, __VA_ARGS__); \
+    } } while (0)
+
+#define METRE_TRACE(logger, ...) METRE_LOGGER_CALL(logger, spdlog::level::trace, __VA_ARGS__)
+#define METRE_DEBUG(logger, ...) METRE_LOGGER_CALL(logger, spdlog::level::debug, __VA_ARGS__)
 
 #endif
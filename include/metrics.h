@@ -0,0 +1,127 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef METRE_METRICS__H
+#define METRE_METRICS__H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct event_base;
+struct evhttp;
+
+namespace Metre {
+    namespace Metrics {
+        using Labels = std::vector<std::pair<std::string, std::string>>;
+
+        class Metric {
+        public:
+            virtual void render(std::string &out, std::string const &name, std::string const &labels) const = 0;
+
+            virtual ~Metric() = default;
+        };
+
+        /**
+         * Updates are single relaxed atomics, from any thread. Only creating and removing
+         * series touches the registry's lock, so hold onto the reference.
+         */
+        class Counter : public Metric {
+            std::atomic<std::uint64_t> m_value{0};
+        public:
+            void inc(std::uint64_t n = 1) {
+                m_value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            std::uint64_t value() const {
+                return m_value.load(std::memory_order_relaxed);
+            }
+
+            void render(std::string &out, std::string const &name, std::string const &labels) const override;
+        };
+
+        class Gauge : public Metric {
+            std::atomic<std::int64_t> m_value{0};
+        public:
+            void set(std::int64_t v) {
+                m_value.store(v, std::memory_order_relaxed);
+            }
+
+            void add(std::int64_t n = 1) {
+                m_value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            void sub(std::int64_t n = 1) {
+                m_value.fetch_sub(n, std::memory_order_relaxed);
+            }
+
+            std::int64_t value() const {
+                return m_value.load(std::memory_order_relaxed);
+            }
+
+            void render(std::string &out, std::string const &name, std::string const &labels) const override;
+        };
+
+        // Latencies, in seconds.
+        class Histogram : public Metric {
+        public:
+            static constexpr std::array<double, 14> bounds = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                                                              0.5, 1.0, 2.5, 5.0, 10.0, 30.0};
+        private:
+            std::array<std::atomic<std::uint64_t>, bounds.size() + 1> m_buckets{}; // Not cumulative; last is +Inf.
+            std::atomic<std::uint64_t> m_sum_us{0};
+        public:
+            void observe(std::chrono::steady_clock::duration d);
+
+            void observe_since(std::chrono::steady_clock::time_point start) {
+                observe(std::chrono::steady_clock::now() - start);
+            }
+
+            void render(std::string &out, std::string const &name, std::string const &labels) const override;
+        };
+
+        // Finds or creates the series; references stay valid until it's removed.
+        Counter &counter(std::string const &name, std::string const &help, Labels const &labels = {});
+
+        Gauge &gauge(std::string const &name, std::string const &help, Labels const &labels = {});
+
+        Histogram &histogram(std::string const &name, std::string const &help, Labels const &labels = {});
+
+        // For series belonging to something transient, like a session.
+        void remove(std::string const &name, Labels const &labels);
+
+        // Prometheus text exposition format.
+        std::string render();
+
+        // Serves render() at /metrics; free with evhttp_free.
+        struct evhttp *serve(struct event_base *base, std::string const &address, unsigned short port);
+    }
+}
+
+#endif
@@ -0,0 +1,78 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef MPSC__H
+#define MPSC__H
+
+#include <atomic>
+#include <optional>
+
+namespace Metre {
+    /**
+     * Lock-free multiple-producer, single-consumer queue (after Vyukov).
+     * Any thread may push; only the owning thread may pop.
+     */
+    template<typename T>
+    class MPSCQueue {
+        struct Node {
+            std::atomic<Node *> next{nullptr};
+            std::optional<T> value;
+        };
+
+        std::atomic<Node *> m_head; // Producers append here.
+        Node *m_tail; // Consumer's stub node.
+
+    public:
+        MPSCQueue() : m_head(new Node), m_tail(m_head.load()) {}
+
+        MPSCQueue(MPSCQueue const &) = delete;
+
+        MPSCQueue &operator=(MPSCQueue const &) = delete;
+
+        ~MPSCQueue() {
+            while (pop());
+            delete m_tail;
+        }
+
+        void push(T &&value) {
+            auto node = new Node;
+            node->value.emplace(std::move(value));
+            Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        std::optional<T> pop() {
+            Node *next = m_tail->next.load(std::memory_order_acquire);
+            if (!next) return std::nullopt;
+            std::optional<T> value{std::move(next->value)};
+            next->value.reset();
+            delete m_tail;
+            m_tail = next;
+            return value;
+        }
+    };
+}
+
+#endif
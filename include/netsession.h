@@ -26,7 +26,9 @@ SOFTWARE.
 #ifndef NETSESSION__HPP
 #define NETSESSION__HPP
 
+#include <chrono>
 #include <string>
+#include <string_view>
 #include "defs.h"
 #include "rapidxml.hpp"
 #include "sigslot.h"
@@ -34,18 +36,36 @@ SOFTWARE.
 
 // fwd:
 struct bufferevent;
+struct evbuffer;
 
 namespace Metre {
     class XMLStream;
 
     class Server;
 
+    class Stanza;
+
+    namespace Metrics {
+        class Counter;
+    }
+
     class NetSession {
         unsigned long long m_serial;
+        unsigned m_worker; // Worker thread which owns this session.
         struct bufferevent *m_bev;
         std::unique_ptr<XMLStream> m_xml_stream;
         bool m_in_progress = false;
+        bool m_read_scheduled = false; // Out of budget, and queued to carry on next loop iteration.
+        unsigned m_throttled = 0; // Reading is paused while non-zero.
+        std::size_t m_write_low = 0;
+        std::string m_remote_hostname; // Outbound only: the SRV target we connected to.
+        unsigned short m_remote_port = 0;
         std::shared_ptr<spdlog::logger> m_logger;
+        Metrics::Counter *m_bytes_in = nullptr; // On the wire, so after TLS and compression.
+        Metrics::Counter *m_bytes_out = nullptr;
+        Metrics::Counter *m_stanzas_in = nullptr;
+        Metrics::Counter *m_stanzas_out = nullptr;
+        std::chrono::steady_clock::time_point m_handshake_start{};
     public:
         NetSession(unsigned long long serial, struct bufferevent *bev, Config::Listener const *listen); /* Inbound */
         NetSession(unsigned long long serial, struct bufferevent *bev, std::string const &stream_from,
@@ -64,27 +84,78 @@ namespace Metre {
         // Signals:
         mutable sigslot::signal<NetSession &> onClosed;
         mutable sigslot::signal<NetSession &> onConnected;
+        // Output has drained to the write low watermark.
+        mutable sigslot::signal<NetSession &> onWritable;
 
         bool drain();
 
         void send(rapidxml::xml_document<> &d);
 
+        void send(Stanza &s);
+
         void send(std::string const &s);
 
+        void send(std::string_view s);
+
         void send(const char *p);
 
+        void send(struct evbuffer *buf); // Moves the entire contents of buf.
+
         void close();
 
         void read();
 
+        // Carry on reading from the next loop iteration, after other sessions' turns.
+        void read_later();
+
+        // Octets written but not yet sent.
+        std::size_t output_length();
+
+        void write_low_watermark(std::size_t low);
+
+        // Traffic accounting, for metrics.
+        void stanzas_received(std::size_t n = 1);
+
+        void stanzas_sent(std::size_t n = 1);
+
+        // The TLS handshake is timed until the bufferevent reports it's connected.
+        void handshake_started();
+
+        // Socket tuning for the peer's domain, once it's authenticated.
+        void tune(Config::SocketOptions const &options);
+
+        // Pause reading, for backpressure. Calls nest; reading resumes once each is undone.
+        void throttle();
+
+        void unthrottle();
+
         unsigned long long serial() const {
             return m_serial;
         }
 
+        unsigned worker() const {
+            return m_worker;
+        }
+
+        void remote_address(std::string const &hostname, unsigned short port) {
+            m_remote_hostname = hostname;
+            m_remote_port = port;
+        }
+
+        std::string const &remote_hostname() const {
+            return m_remote_hostname;
+        }
+
+        unsigned short remote_port() const {
+            return m_remote_port;
+        }
+
         static void read_cb(struct bufferevent *bev, void *arg);
 
         static void event_cb(struct bufferevent *bev, short flags, void *arg);
 
+        static void write_cb(struct bufferevent *bev, void *arg);
+
         XMLStream &xml_stream() {
             return *m_xml_stream;
         }
@@ -92,6 +163,8 @@ namespace Metre {
         ~NetSession();
 
     private:
+        void count_traffic(struct bufferevent *bev);
+
         void bev_closed();
 
         void bev_connected();
@@ -0,0 +1,100 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef RINGBUFFER__H
+#define RINGBUFFER__H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace Metre {
+    /**
+     * Contiguous FIFO queue. Capacity is a power of two and only ever grows, so a queue
+     * that fills and drains repeatedly stops allocating once it's big enough.
+     * T must be default-constructible; vacated slots are left holding T().
+     */
+    template<typename T>
+    class RingBuffer {
+        std::vector<T> m_slots;
+        std::size_t m_head = 0; // Index of the front element.
+        std::size_t m_size = 0;
+
+        std::size_t slot(std::size_t i) const {
+            return (m_head + i) & (m_slots.size() - 1);
+        }
+
+        void grow() {
+            std::vector<T> slots(m_slots.empty() ? 16 : m_slots.size() * 2);
+            for (std::size_t i = 0; i != m_size; ++i) {
+                slots[i] = std::move(m_slots[slot(i)]);
+            }
+            m_slots.swap(slots);
+            m_head = 0;
+        }
+
+    public:
+        bool empty() const {
+            return m_size == 0;
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        std::size_t capacity() const {
+            return m_slots.size();
+        }
+
+        void push_back(T &&value) {
+            if (m_size == m_slots.size()) grow();
+            m_slots[slot(m_size)] = std::move(value);
+            ++m_size;
+        }
+
+        T &front() {
+            return m_slots[m_head];
+        }
+
+        T pop_front() {
+            T value{std::move(m_slots[m_head])};
+            m_slots[m_head] = T();
+            m_head = slot(1);
+            --m_size;
+            return value;
+        }
+
+        T &operator[](std::size_t i) {
+            return m_slots[slot(i)];
+        }
+
+        void clear() {
+            while (!empty()) pop_front();
+            m_head = 0;
+        }
+    };
+}
+
+#endif
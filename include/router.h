@@ -30,32 +30,83 @@ SOFTWARE.
 #include "jid.h"
 #include "stanza.h"
 #include "core.h"
+#include "ringbuffer.h"
 #include "sigslot.h"
 #include "sigslot/tasklet.h"
 
 #include <string>
+#include <string_view>
+#include <array>
 #include <memory>
+#include <list>
 #include <queue>
 #include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <vector>
 #include <spdlog/logger.h>
 
 namespace Metre {
     class NetSession;
 
-    class Route : public sigslot::has_slots {
+    namespace Metrics {
+        class Gauge;
+
+        class Histogram;
+    }
+
+    class Route : public sigslot::has_slots, public std::enable_shared_from_this<Route> {
+    public:
+        // Classes of stanza queued on a route, highest priority first.
+        typedef enum {
+            IQ,
+            MESSAGE,
+            PRESENCE
+        } PRIORITY;
+
+        static constexpr std::size_t priorities = 3;
+
+        static PRIORITY priority(Stanza const &);
+
     private:
+        struct Queued {
+            std::unique_ptr<Stanza> stanza; // Headers only, kept for bouncing.
+            std::size_t length = 0; // Serialized, in the lane's bytes.
+        };
+
+        struct Lane {
+            RingBuffer<Queued> stanzas;
+            struct evbuffer *bytes = nullptr; // stanzas, serialized, ready to flush.
+            Metrics::Gauge *depth = nullptr;
+        };
+
         std::weak_ptr<NetSession> m_to;
         sigslot::tasklet<bool> m_to_task;
         std::weak_ptr<NetSession> m_vrfy;
         sigslot::tasklet<bool> m_verify_task;
-        std::list<std::unique_ptr<Stanza>> m_stanzas;
-        std::list<std::unique_ptr<DB::Verify>> m_dialback;
+        // Stanzas wait here until there's a session, or while its output is backed up.
+        std::array<Lane, priorities> m_lanes;
+        RingBuffer<std::unique_ptr<DB::Verify>> m_dialback;
+        Router::TimerHandle m_stanza_timer = 0; // Bounces queued stanzas if there's still no session.
+        Router::TimerHandle m_dialback_timer = 0;
         Jid const m_local;
         Jid const m_domain;
+        unsigned m_worker = 0; // Worker thread owning this route and its sessions.
+        std::atomic<bool> m_congested{false};
+        std::mutex m_throttle_mutex; // Guards m_congested changes and m_throttled.
+        std::vector<std::pair<unsigned, unsigned long long>> m_throttled; // Worker and serial of paused sessions.
+        Metrics::Gauge *m_queue_bytes = nullptr; // As pending().
+        Metrics::Gauge *m_queue_stanzas = nullptr;
+        Metrics::Histogram *m_session_setup = nullptr; // init_session_to(), until the session's usable.
         std::shared_ptr<spdlog::logger> m_logger;
     public:
         Route(Jid const &from, Jid const &to);
 
+        Route(Route const &) = delete;
+
+        ~Route();
+
         std::string const &domain() const {
             return m_domain.domain();
         }
@@ -64,6 +115,10 @@ namespace Metre {
             return m_local.domain();
         }
 
+        unsigned worker() const {
+            return m_worker;
+        }
+
         sigslot::tasklet<bool> init_session_vrfy();
 
         sigslot::tasklet<bool> init_session_to();
@@ -74,18 +129,70 @@ namespace Metre {
 
         void transmit(std::unique_ptr<DB::Verify> &&);
 
+        /**
+         * Pass-through: send already-serialized stanza text as-is. Only succeeds if there's
+         * an established session on this worker; otherwise the caller needs to build a
+         * Stanza and transmit that instead.
+         */
+        bool forward(std::string_view text);
+
+        /**
+         * Stanzas written to a session which closed before the peer acknowledged them
+         * (XEP-0198), to be sent again on the next one.
+         */
+        void requeue(NetSession &closed, std::list<std::unique_ptr<Stanza>> &&stanzas);
+
+        void requeue(std::list<std::unique_ptr<Stanza>> &&stanzas);
+
+        /**
+         * A resumable session has dropped with stanzas in hand (XEP-0198); get a new one
+         * going straight away rather than waiting for more traffic.
+         */
+        void resume();
+
+        bool congested() const {
+            return m_congested;
+        }
+
+        /**
+         * Backpressure: if this route is over its high watermark, stop the session feeding
+         * it from reading until the route drains below its low watermark. Any thread.
+         */
+        void throttle(NetSession &source);
+
         // Slots
         void SessionClosed(NetSession &);
 
+        void SessionWritable(NetSession &);
+
     protected:
+        template<typename S>
+        bool handoff(std::unique_ptr<S> &);
+
         void bounce_stanzas(Stanza::Error);
 
         void bounce_dialback(bool timeout);
 
+        // Octets queued here or unsent on the stanza session.
+        std::size_t pending();
+
+        void check_congestion();
+
         void queue(std::unique_ptr<Stanza> &&);
 
         void queue(std::unique_ptr<DB::Verify> &&);
 
+        void enqueue(std::unique_ptr<Stanza> &&);
+
+        bool idle() const; // No stanzas queued.
+
+        std::size_t queued() const;
+
+        // Weighted round robin from the lanes into the session, until its output reaches queue-low.
+        void flush(NetSession &to);
+
+        void start_session_to();
+
         void set_to(std::shared_ptr<NetSession> & to);
 
         void set_vrfy(std::shared_ptr<NetSession> & vrfy);
@@ -93,17 +200,24 @@ namespace Metre {
 
     class RouteTable {
     private:
-        std::map<std::string, std::shared_ptr<Route>> m_routes;
+        std::unordered_map<DomainId, std::shared_ptr<Route>> m_routes;
         std::string m_local_domain;
+        std::mutex m_mutex;
 
     public:
         RouteTable(std::string const &);
 
         std::shared_ptr<Route> &route(Jid const &to);
 
+        std::shared_ptr<Route> &route(std::string const &domain);
+
+        std::shared_ptr<Route> &route(DomainId const &domain);
+
         static RouteTable &routeTable(std::string const &);
 
         static RouteTable &routeTable(Jid const &);
+
+        static RouteTable &routeTable(DomainId const &);
     };
 
 }
@@ -29,9 +29,12 @@ SOFTWARE.
 #include "jid.h"
 #include "xmppexcept.h"
 #include "rapidxml.hpp"
+#include "xmlpool.h"
 
 #include <memory>
 
+struct evbuffer;
+
 namespace Metre {
     class XMLStream;
 
@@ -72,7 +75,7 @@ namespace Metre {
         const char *m_payload = nullptr;
         size_t m_payload_l = 0;
         rapidxml::xml_node<> const *m_node = nullptr;
-        std::unique_ptr<rapidxml::xml_document<>> m_doc;
+        XMLPool::Document m_doc;
     public:
         Stanza(const char *name, rapidxml::xml_node<> const *node);
 
@@ -132,8 +135,19 @@ namespace Metre {
 
         void payload(rapidxml::xml_node<> *node);
 
+        std::size_t payload_size() const {
+            return m_payload_l;
+        }
+
         void render(rapidxml::xml_document<> &d);
 
+        /**
+         * Serialize onto the end of an evbuffer without building a document. A frozen
+         * payload is handed over by reference rather than copied, and the stanza is left
+         * without one.
+         */
+        void render(struct evbuffer *buf);
+
         std::unique_ptr<Stanza> create_bounce(Metre::base::stanza_exception const &e) const;
 
         std::unique_ptr<Stanza> create_bounce(Stanza::Error e) const;
@@ -0,0 +1,106 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef TIMERWHEEL__H
+#define TIMERWHEEL__H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace Metre {
+    /**
+     * Hierarchical timer wheel, at millisecond resolution.
+     *
+     * Four levels of 256 slots each cover 2^32ms; anything further out sits in the top
+     * level and cascades down as time passes. Adding and cancelling a timer are O(1).
+     * Time is whatever the caller says it is - it's only ever moved forward by advance().
+     */
+    class TimerWheel {
+    public:
+        typedef std::uint64_t Handle; // Never 0.
+
+        explicit TimerWheel(std::uint64_t now = 0);
+
+        Handle add(std::uint64_t expiry, std::function<void()> &&fn);
+
+        // False if the timer has already fired, or been cancelled.
+        bool cancel(Handle);
+
+        // Fire everything due up to now, returning the number of timers fired. If a timer
+        // throws, the rest due at the same tick still fire before the exception propagates;
+        // anything later is left for the next call.
+        std::size_t advance(std::uint64_t now);
+
+        // Time by which advance() next needs to be called; nullopt if there's nothing pending.
+        std::optional<std::uint64_t> next_wakeup() const;
+
+        std::uint64_t now() const {
+            return m_now;
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        bool empty() const {
+            return m_size == 0;
+        }
+
+    private:
+        static constexpr unsigned bits = 8;
+        static constexpr unsigned slots = 1U << bits;
+        static constexpr unsigned levels = 4;
+        static constexpr std::uint32_t nil = static_cast<std::uint32_t>(-1);
+
+        struct Timer {
+            std::uint64_t expiry = 0;
+            std::function<void()> fn;
+            std::uint32_t generation = 1;
+            std::uint32_t prev = nil;
+            std::uint32_t next = nil;
+            std::uint32_t slot = nil; // nil when free.
+        };
+
+        void link(std::uint32_t index);
+
+        void unlink(std::uint32_t index);
+
+        void cascade(unsigned level);
+
+        std::uint64_t next_cascade() const;
+
+        std::vector<Timer> m_timers;
+        std::vector<std::uint32_t> m_free;
+        std::array<std::uint32_t, slots * levels> m_slots;
+        std::array<std::size_t, levels> m_counts;
+        std::uint64_t m_now;
+        std::size_t m_size = 0;
+    };
+}
+
+#endif
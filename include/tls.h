@@ -38,6 +38,12 @@ namespace Metre {
     sigslot::tasklet<bool> verify_tls(XMLStream &stream, Route &route);
 
     bool start_tls(XMLStream &stream, bool send_proceed);
+
+    // Session resumption, session tickets, and OCSP stapling (if requested) for a domain's context.
+    void tls_context_setup(SSL_CTX *ctx, bool ocsp_staple);
+
+    // Starts fetching OCSP responses to staple. First worker only.
+    void ocsp_init();
 }
 
 #endif //METRE_TLS_H
@@ -0,0 +1,63 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef XMLPOOL__H
+#define XMLPOOL__H
+
+#include <memory>
+#include "rapidxml.hpp"
+
+namespace Metre {
+    /**
+     * Per-thread pools of rapidxml documents, and of the memory blocks they grow into.
+     *
+     * Released documents are cleared rather than freed, and the blocks they'd grown are
+     * kept for the next document to use. The inline and block sizes are rapidxml's
+     * RAPIDXML_STATIC_POOL_SIZE and RAPIDXML_DYNAMIC_POOL_SIZE, set by the build.
+     */
+    class XMLPool {
+    public:
+        struct Stats {
+            unsigned long long hits = 0;
+            unsigned long long misses = 0;
+        };
+
+        struct Release {
+            void operator()(rapidxml::xml_document<> *) const;
+        };
+
+        typedef std::unique_ptr<rapidxml::xml_document<>, Release> Document;
+
+        static Document document();
+
+        // Have a document grow from the pool. It must not have allocated anything yet.
+        static void attach(rapidxml::xml_document<> &);
+
+        // Totals across all threads.
+        static Stats stats();
+    };
+}
+
+#endif
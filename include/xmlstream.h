@@ -28,14 +28,18 @@ SOFTWARE.
 
 #include "defs.h"
 #include <map>
+#include <unordered_map>
 #include <optional>
 #include <memory>
+#include <string_view>
 #include <vector>
 #include "sigslot.h"
 #include "rapidxml.hpp"
 #include "feature.h"
 #include "xmppexcept.h"
 #include "filter.h"
+#include "xmltokenizer.h"
+#include "domainid.h"
 #include "sigslot/tasklet.h"
 
 struct X509_crl_st;
@@ -49,6 +53,25 @@ namespace Metre {
 
     class Stanza;
 
+    namespace Metrics {
+        class Gauge;
+    }
+
+    /**
+     * Sees every stanza crossing a stream, and takes over writing outbound ones.
+     * Installed by XEP-0198 Stream Management once it's enabled.
+     */
+    class StanzaTracker {
+    public:
+        virtual void sent(Stanza &) = 0;
+
+        virtual void sent(std::string_view stanza) = 0;
+
+        virtual void received() = 0;
+
+        virtual ~StanzaTracker() = default;
+    };
+
     class XMLStream : public sigslot::has_slots {
     public:
         typedef enum {
@@ -62,6 +85,9 @@ namespace Metre {
         SESSION_DIRECTION m_dir;
         SESSION_TYPE m_type;
         std::string m_stream_buf; // Sort-of-temporary buffer //
+        std::string m_stanza_buf; // Reused for each top-level element. //
+        XMLTokenizer m_tokenizer;
+        StanzaTracker *m_tracker = nullptr;
         std::map<std::string, std::unique_ptr<Feature>> m_features;
         std::optional<std::string> m_user;
         std::string m_stream_id;
@@ -72,17 +98,19 @@ namespace Metre {
         bool m_secured = false; // Crypto in place via TLS. //
         bool m_authready = false; // Channel is ready for dialback/SASL //
         bool m_compressed = false; // Channel has compression enabled, by TLS or XEP-0138 //
-        std::map<std::pair<std::string, std::string>, AUTH_STATE> m_auth_pairs_rx;
-        std::map<std::pair<std::string, std::string>, AUTH_STATE> m_auth_pairs_tx;
+        std::unordered_map<std::pair<DomainId, DomainId>, AUTH_STATE, DomainPairHash> m_auth_pairs_rx;
+        std::unordered_map<std::pair<DomainId, DomainId>, AUTH_STATE, DomainPairHash> m_auth_pairs_tx;
         std::list<std::unique_ptr<Filter>> m_filters;
         std::size_t m_num_crls = 0;
         std::map<std::string, struct X509_crl_st *> m_crls;
         bool m_crl_complete = false;
         bool m_x2x_mode = false;
         bool m_bidi = false;
+        bool m_tuned = false; // Socket options set for an authenticated remote domain.
         std::map<std::string, sigslot::signal<Stanza const &>> m_response_callbacks;
         std::list<std::shared_ptr<sigslot::tasklet<bool>>> m_tasks;
         int m_in_flight = 0; // Tasks in flight.
+        Metrics::Gauge *m_tasks_gauge = nullptr;
         std::shared_ptr<spdlog::logger> m_logger;
 
     public:
@@ -97,6 +125,23 @@ namespace Metre {
 
         size_t process(unsigned char *, size_t);
 
+        // Find the end of the next token in newly arrived data; returns octets needed to process it, or 0.
+        size_t scan(char const *, size_t);
+
+        // Octets already scanned without finding a complete token.
+        size_t scanned() const {
+            return m_tokenizer.scanned();
+        }
+
+        size_t pending() const {
+            return m_tokenizer.complete() ? m_tokenizer.length() : 0;
+        }
+
+        void skip_whitespace();
+
+        // For X2X, where the peer never sends a stream open itself.
+        void synthesize_stream_open(std::string const &);
+
         void handle_exception(Metre::base::xmpp_exception &e);
 
         void in_context(std::function<void()> &&, Stanza &s);
@@ -149,6 +194,17 @@ namespace Metre {
 
         void send(std::unique_ptr<Stanza> v);
 
+        // Send a stanza that's already serialized.
+        void forward(std::string_view stanza);
+
+        void tracker(StanzaTracker *t) {
+            m_tracker = t;
+        }
+
+        bool tracking() const {
+            return m_tracker != nullptr;
+        }
+
         void restart();
 
         void set_auth_ready() {
@@ -158,6 +214,8 @@ namespace Metre {
 
         void set_compressed() { m_compressed = true; }
 
+        bool compressed() const { return m_compressed; }
+
         bool secured() const { return m_secured; }
 
         void set_secured() { m_secured = true; }
@@ -174,6 +232,9 @@ namespace Metre {
 
         bool x2x_mode() const { return m_x2x_mode; }
 
+        // Original text of the element being handled; intact until something calls fixup on it.
+        std::string_view stanza_text() const { return m_stanza_buf; }
+
         sigslot::tasklet<bool> tls_auth_ok(Route &domain);
 
         AUTH_STATE s2s_auth_pair(std::string const &local, std::string const &remote, SESSION_DIRECTION) const;
@@ -181,6 +242,10 @@ namespace Metre {
         AUTH_STATE
         s2s_auth_pair(std::string const &local, std::string const &remote, SESSION_DIRECTION, AUTH_STATE auth);
 
+        AUTH_STATE s2s_auth_pair(DomainId const &local, DomainId const &remote, SESSION_DIRECTION) const;
+
+        AUTH_STATE s2s_auth_pair(DomainId const &local, DomainId const &remote, SESSION_DIRECTION, AUTH_STATE auth);
+
         void check_domain_pair(std::string const &from, std::string const &to) const;
 
         std::string const &stream_local() const {
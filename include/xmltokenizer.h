@@ -0,0 +1,125 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#ifndef XMLTOKENIZER__H
+#define XMLTOKENIZER__H
+
+#include <cstddef>
+
+namespace Metre {
+    /**
+     * Finds the boundaries of top-level tokens in an XMPP stream - the stream open, each
+     * top-level element, and the stream close - without building a tree.
+     *
+     * Scan state survives between calls, so data can be fed in however it arrives, and
+     * nothing is ever scanned twice. Offsets are relative to the start of the unconsumed
+     * input; the caller tells us when it has consumed octets.
+     */
+    class XMLTokenizer {
+    public:
+        typedef enum {
+            NONE,
+            STREAM_OPEN,
+            ELEMENT,
+            STREAM_CLOSE
+        } TOKEN;
+
+        /**
+         * Scan more data, which must follow on from everything scanned so far.
+         * Stops at the end of the first complete token, and returns the number
+         * of octets scanned.
+         */
+        std::size_t feed(char const *data, std::size_t len);
+
+        bool complete() const {
+            return m_token != NONE;
+        }
+
+        TOKEN token() const {
+            return m_token;
+        }
+
+        // Whitespace octets preceding the (possibly incomplete) token.
+        std::size_t leading() const {
+            return m_start == npos ? m_scanned : m_start;
+        }
+
+        // Octets up to the end of the complete token, including leading whitespace.
+        std::size_t length() const {
+            return m_end;
+        }
+
+        std::size_t scanned() const {
+            return m_scanned;
+        }
+
+        unsigned depth() const {
+            return m_depth;
+        }
+
+        /**
+         * Discard octets from the front; either leading whitespace, or an entire
+         * complete token.
+         */
+        void consume(std::size_t n);
+
+        void reset(unsigned depth = 0);
+
+    private:
+        typedef enum {
+            CONTENT,
+            TAG_OPEN,
+            START_TAG,
+            QUOTED,
+            END_TAG,
+            PI,
+            BANG,
+            COMMENT_OPEN,
+            COMMENT,
+            CDATA,
+            DECL
+        } STATE;
+
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        std::size_t finish(TOKEN token, std::size_t pos);
+
+        // Index of the next octet at or after i that the current state needs to see.
+        std::size_t skip(char const *data, std::size_t i, std::size_t len);
+
+        STATE m_state = CONTENT;
+        TOKEN m_token = NONE;
+        unsigned m_depth = 0; // Current element depth.
+        unsigned m_top = 0; // Depth at which tokens start; 0 before stream open, 1 after.
+        char m_quote = 0;
+        unsigned m_match = 0; // Run length of terminator characters seen.
+        bool m_empty = false; // Start tag seen '/', so might be empty.
+        std::size_t m_scanned = 0;
+        std::size_t m_start = npos;
+        std::size_t m_end = 0;
+    };
+}
+
+#endif
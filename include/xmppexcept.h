@@ -115,6 +115,9 @@ namespace Metre {
     METRE_STANZA_EXCEPT(remote_server_not_found, "The remote server discovery or connection failed", "cancel",
                         "remote-server-not-found");
 
+    METRE_STANZA_EXCEPT(resource_constraint, "The server is too busy to service this request", "wait",
+                        "resource-constraint");
+
     METRE_STANZA_EXCEPT(bad_format, "Request rejected due to missing parameter etc", "modify", "bad-format");
 
     METRE_STANZA_EXCEPT(policy_violation, "Request rejected due to policy violation", "cancel", "policy-violation");
@@ -66,11 +66,11 @@ namespace {
         }
 
         bool negotiate(rapidxml::xml_node<> *) override {
-            xml_document<> d;
-            auto n = d.allocate_node(node_element, "bidi");
-            n->append_attribute(d.allocate_attribute("xmlns", bidi_ns.c_str()));
-            d.append_node(n);
-            m_stream.send(d);
+            auto d = XMLPool::document();
+            auto n = d->allocate_node(node_element, "bidi");
+            n->append_attribute(d->allocate_attribute("xmlns", bidi_ns.c_str()));
+            d->append_node(n);
+            m_stream.send(*d);
             m_stream.bidi(true);
             return false;
         }
@@ -35,14 +35,14 @@ namespace {
                 auto bounce = iq.create_bounce(Stanza::Error::service_unavailable);
                 m_endpoint.send(std::move(bounce));
             } else {
-                rapidxml::xml_document<> doc;
-                auto response = doc.allocate_node(rapidxml::node_element, "query");
-                response->append_attribute(doc.allocate_attribute("xmlns", "http://jabber.org/protocol/disco#items"));
+                auto doc = XMLPool::document();
+                auto response = doc->allocate_node(rapidxml::node_element, "query");
+                response->append_attribute(doc->allocate_attribute("xmlns", "http://jabber.org/protocol/disco#items"));
                 for (auto const &node : m_endpoint.nodes()) {
-                    auto item = doc.allocate_node(rapidxml::node_element, "item");
-                    item->append_attribute(doc.allocate_attribute("jid", m_endpoint.jid().full().c_str()));
-                    item->append_attribute(doc.allocate_attribute("node", node.second->name().c_str()));
-                    item->append_attribute(doc.allocate_attribute("name", node.second->title().c_str()));
+                    auto item = doc->allocate_node(rapidxml::node_element, "item");
+                    item->append_attribute(doc->allocate_attribute("jid", m_endpoint.jid().full().c_str()));
+                    item->append_attribute(doc->allocate_attribute("node", node.second->name().c_str()));
+                    item->append_attribute(doc->allocate_attribute("name", node.second->title().c_str()));
                     response->append_node(item);
                 }
                 std::unique_ptr<Iq> result{new Iq(iq.to(), iq.from(), Metre::Iq::RESULT, iq.id())};
@@ -61,13 +61,13 @@ namespace {
                 auto bounce = iq.create_bounce(Stanza::Error::service_unavailable);
                 m_endpoint.send(std::move(bounce));
             } else {
-                rapidxml::xml_document<> doc;
-                auto response = doc.allocate_node(rapidxml::node_element, "query");
-                response->append_attribute(doc.allocate_attribute("xmlns", "http://jabber.org/protocol/disco#info"));
+                auto doc = XMLPool::document();
+                auto response = doc->allocate_node(rapidxml::node_element, "query");
+                response->append_attribute(doc->allocate_attribute("xmlns", "http://jabber.org/protocol/disco#info"));
                 for (auto const &cap : m_endpoint.capabilities()) {
                     for (auto const &feature : cap->description().disco()) {
-                        auto feat = doc.allocate_node(rapidxml::node_element, "feature");
-                        feat->append_attribute(doc.allocate_attribute("var", feature.c_str()));
+                        auto feat = doc->allocate_node(rapidxml::node_element, "feature");
+                        feat->append_attribute(doc->allocate_attribute("var", feature.c_str()));
                         response->append_node(feat);
                     }
                 }
@@ -0,0 +1,287 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "compression.h"
+
+#include <event2/buffer.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+using namespace Metre;
+
+namespace {
+    // Most common last; both zlib and zstd favour the end of a dictionary.
+    const std::string builtin_dictionary =
+            "<iq type='get' id=''><query xmlns='http://jabber.org/protocol/disco#items'/></iq>"
+            "<iq type='result' id=''><query xmlns='http://jabber.org/protocol/disco#info' node=''>"
+            "<identity category='client' type='pc' name=''/><identity category='server' type='im'/>"
+            "<feature var='http://jabber.org/protocol/caps'/><feature var='http://jabber.org/protocol/chatstates'/>"
+            "<feature var='http://jabber.org/protocol/muc'/><feature var='http://jabber.org/protocol/ibb'/>"
+            "<feature var='http://jabber.org/protocol/si'/><feature var='jabber:iq:version'/>"
+            "<feature var='urn:xmpp:ping'/><feature var='urn:xmpp:receipts'/><feature var='urn:xmpp:time'/>"
+            "<feature var='urn:xmpp:jingle:1'/><feature var='urn:xmpp:carbons:2'/><feature var='urn:xmpp:mam:2'/>"
+            "<feature var='http://jabber.org/protocol/disco#items'/><feature var='http://jabber.org/protocol/disco#info'/>"
+            "</query></iq><iq type='get' id=''><query xmlns='http://jabber.org/protocol/disco#info' node=''/></iq>"
+            "<message type='chat' id=''><body></body><active xmlns='http://jabber.org/protocol/chatstates'/>"
+            "<request xmlns='urn:xmpp:receipts'/></message><presence type='unavailable'/>"
+            "<presence type='subscribe'/><presence type='unsubscribed'/><show>away</show><show>xa</show>"
+            "<show>dnd</show><show>chat</show><status></status><priority>0</priority>"
+            "<x xmlns='vcard-temp:x:update'><photo></photo></x><delay xmlns='urn:xmpp:delay' stamp=''/>"
+            "<presence from='' to='' id=''><c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='' ver=''/>"
+            "</presence>";
+
+    std::vector<struct evbuffer_iovec> peek(struct evbuffer *src) {
+        int n = evbuffer_peek(src, -1, nullptr, nullptr, 0);
+        std::vector<struct evbuffer_iovec> vec(n > 0 ? n : 0);
+        if (n > 0) evbuffer_peek(src, -1, nullptr, vec.data(), n);
+        return vec;
+    }
+
+    class ZlibDeflate : public Codec {
+        z_stream m_z{};
+
+    public:
+        ZlibDeflate(unsigned window, std::string const *dictionary) {
+            int mem_level = std::clamp(static_cast<int>(window) - 7, 1, 9);
+            if (deflateInit2(&m_z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("Cannot initialize zlib compression");
+            }
+            if (dictionary) {
+                deflateSetDictionary(&m_z, reinterpret_cast<Bytef const *>(dictionary->data()),
+                                     static_cast<uInt>(dictionary->size()));
+            }
+        }
+
+        ~ZlibDeflate() override {
+            deflateEnd(&m_z);
+        }
+
+        bool transform(struct evbuffer *src, struct evbuffer *dst, std::size_t) override {
+            auto vec = peek(src);
+            std::size_t consumed = 0;
+            for (std::size_t i = 0; i != vec.size(); ++i) {
+                m_z.next_in = static_cast<Bytef *>(vec[i].iov_base);
+                m_z.avail_in = static_cast<uInt>(vec[i].iov_len);
+                int flush = (i + 1 == vec.size()) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+                do {
+                    struct evbuffer_iovec out;
+                    if (evbuffer_reserve_space(dst, chunk_size, &out, 1) != 1) return false;
+                    m_z.next_out = static_cast<Bytef *>(out.iov_base);
+                    m_z.avail_out = static_cast<uInt>(out.iov_len);
+                    if (deflate(&m_z, flush) == Z_STREAM_ERROR) return false;
+                    out.iov_len -= m_z.avail_out;
+                    evbuffer_commit_space(dst, &out, 1);
+                } while (m_z.avail_in || m_z.avail_out == 0);
+                consumed += vec[i].iov_len;
+            }
+            evbuffer_drain(src, consumed);
+            return true;
+        }
+    };
+
+    class ZlibInflate : public Codec {
+        z_stream m_z{};
+        std::shared_ptr<std::string const> m_dictionary;
+
+    public:
+        // Accepts any window; the peer's choice isn't negotiated.
+        explicit ZlibInflate(std::shared_ptr<std::string const> const &dictionary) : m_dictionary(dictionary) {
+            if (inflateInit2(&m_z, 15) != Z_OK) throw std::runtime_error("Cannot initialize zlib decompression");
+        }
+
+        ~ZlibInflate() override {
+            inflateEnd(&m_z);
+        }
+
+        bool transform(struct evbuffer *src, struct evbuffer *dst, std::size_t limit) override {
+            auto vec = peek(src);
+            std::size_t consumed = 0;
+            std::size_t produced = 0;
+            for (auto const &in : vec) {
+                m_z.next_in = static_cast<Bytef *>(in.iov_base);
+                m_z.avail_in = static_cast<uInt>(in.iov_len);
+                if (!run(dst, produced, limit)) return false;
+                consumed += in.iov_len - m_z.avail_in;
+                if (m_z.avail_in) break;
+            }
+            if (vec.empty()) {
+                m_z.avail_in = 0; // Just drain what's held.
+                if (!run(dst, produced, limit)) return false;
+            }
+            evbuffer_drain(src, consumed);
+            return true;
+        }
+
+    private:
+        // A full output chunk may leave more inside; keep going until one isn't.
+        bool run(struct evbuffer *dst, std::size_t &produced, std::size_t limit) {
+            while ((m_z.avail_in || m_full) && produced < limit) {
+                struct evbuffer_iovec out;
+                if (evbuffer_reserve_space(dst, chunk_size, &out, 1) != 1) return false;
+                m_z.next_out = static_cast<Bytef *>(out.iov_base);
+                m_z.avail_out = static_cast<uInt>(out.iov_len);
+                int rc = inflate(&m_z, Z_SYNC_FLUSH);
+                if (rc == Z_NEED_DICT) {
+                    if (!m_dictionary) return false;
+                    rc = inflateSetDictionary(&m_z, reinterpret_cast<Bytef const *>(m_dictionary->data()),
+                                              static_cast<uInt>(m_dictionary->size()));
+                }
+                m_full = (m_z.avail_out == 0);
+                out.iov_len -= m_z.avail_out;
+                produced += out.iov_len;
+                evbuffer_commit_space(dst, &out, 1);
+                if (rc != Z_OK && rc != Z_BUF_ERROR) return false; // Including Z_STREAM_END; the stream never ends.
+            }
+            return true;
+        }
+    };
+
+#ifdef HAVE_ZSTD
+    class ZstdCompress : public Codec {
+        ZSTD_CCtx *m_ctx;
+
+    public:
+        ZstdCompress(unsigned window, std::string const *dictionary) : m_ctx(ZSTD_createCCtx()) {
+            if (!m_ctx) throw std::bad_alloc();
+            ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_windowLog, static_cast<int>(window));
+            if (dictionary) ZSTD_CCtx_loadDictionary(m_ctx, dictionary->data(), dictionary->size());
+        }
+
+        ~ZstdCompress() override {
+            ZSTD_freeCCtx(m_ctx);
+        }
+
+        bool transform(struct evbuffer *src, struct evbuffer *dst, std::size_t) override {
+            auto vec = peek(src);
+            std::size_t consumed = 0;
+            for (std::size_t i = 0; i != vec.size(); ++i) {
+                ZSTD_inBuffer in{vec[i].iov_base, vec[i].iov_len, 0};
+                auto mode = (i + 1 == vec.size()) ? ZSTD_e_flush : ZSTD_e_continue;
+                std::size_t remaining;
+                do {
+                    struct evbuffer_iovec out;
+                    if (evbuffer_reserve_space(dst, chunk_size, &out, 1) != 1) return false;
+                    ZSTD_outBuffer zout{out.iov_base, out.iov_len, 0};
+                    remaining = ZSTD_compressStream2(m_ctx, &zout, &in, mode);
+                    if (ZSTD_isError(remaining)) return false;
+                    out.iov_len = zout.pos;
+                    evbuffer_commit_space(dst, &out, 1);
+                } while (in.pos < in.size || (mode == ZSTD_e_flush && remaining));
+                consumed += in.size;
+            }
+            evbuffer_drain(src, consumed);
+            return true;
+        }
+    };
+
+    class ZstdDecompress : public Codec {
+        ZSTD_DCtx *m_ctx;
+
+    public:
+        // Refuses frames needing a larger window than we'd use ourselves.
+        ZstdDecompress(unsigned window, std::string const *dictionary) : m_ctx(ZSTD_createDCtx()) {
+            if (!m_ctx) throw std::bad_alloc();
+            ZSTD_DCtx_setParameter(m_ctx, ZSTD_d_windowLogMax, static_cast<int>(window));
+            if (dictionary) ZSTD_DCtx_loadDictionary(m_ctx, dictionary->data(), dictionary->size());
+        }
+
+        ~ZstdDecompress() override {
+            ZSTD_freeDCtx(m_ctx);
+        }
+
+        bool transform(struct evbuffer *src, struct evbuffer *dst, std::size_t limit) override {
+            auto vec = peek(src);
+            std::size_t consumed = 0;
+            std::size_t produced = 0;
+            for (auto const &chunk : vec) {
+                ZSTD_inBuffer in{chunk.iov_base, chunk.iov_len, 0};
+                if (!run(in, dst, produced, limit)) return false;
+                consumed += in.pos;
+                if (in.pos < in.size) break;
+            }
+            if (vec.empty()) {
+                ZSTD_inBuffer in{nullptr, 0, 0}; // Just drain what's held.
+                if (!run(in, dst, produced, limit)) return false;
+            }
+            evbuffer_drain(src, consumed);
+            return true;
+        }
+
+    private:
+        // A full output chunk may leave more inside; keep going until one isn't.
+        bool run(ZSTD_inBuffer &in, struct evbuffer *dst, std::size_t &produced, std::size_t limit) {
+            while ((in.pos < in.size || m_full) && produced < limit) {
+                struct evbuffer_iovec out;
+                if (evbuffer_reserve_space(dst, chunk_size, &out, 1) != 1) return false;
+                ZSTD_outBuffer zout{out.iov_base, out.iov_len, 0};
+                auto rc = ZSTD_decompressStream(m_ctx, &zout, &in);
+                if (ZSTD_isError(rc)) return false;
+                m_full = (zout.pos == zout.size);
+                out.iov_len = zout.pos;
+                produced += zout.pos;
+                evbuffer_commit_space(dst, &out, 1);
+            }
+            return true;
+        }
+    };
+#endif
+}
+
+namespace Metre {
+    bool compression_supported(std::string const &method) {
+#ifdef HAVE_ZSTD
+        if (method == "zstd") return true;
+#endif
+        return method == "zlib";
+    }
+
+    std::string const &compression_dictionary() {
+        return builtin_dictionary;
+    }
+
+    std::unique_ptr<Codec> compressor(std::string const &method, unsigned window, std::string const *dictionary) {
+        if (method == "zlib") return std::make_unique<ZlibDeflate>(window, dictionary);
+#ifdef HAVE_ZSTD
+        if (method == "zstd") return std::make_unique<ZstdCompress>(window, dictionary);
+#endif
+        throw std::runtime_error("Unsupported compression method " + method);
+    }
+
+    std::unique_ptr<Codec> decompressor(std::string const &method, unsigned window,
+                                        std::shared_ptr<std::string const> const &dictionary) {
+        if (method == "zlib") return std::make_unique<ZlibInflate>(dictionary);
+#ifdef HAVE_ZSTD
+        if (method == "zstd") return std::make_unique<ZstdDecompress>(window, dictionary.get());
+#endif
+        throw std::runtime_error("Unsupported compression method " + method);
+    }
+}
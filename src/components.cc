@@ -71,11 +71,11 @@ namespace {
 
         void send_handshake(XMLStream &s) {
             std::string hexoutput(handshake_content());
-            xml_document<> d;
-            auto node = d.allocate_node(node_element, "handshake");
+            auto d = XMLPool::document();
+            auto node = d->allocate_node(node_element, "handshake");
             node->value(hexoutput.c_str(), hexoutput.length());
-            d.append_node(node);
-            m_stream.send(d);
+            d->append_node(node);
+            m_stream.send(*d);
         }
 
         bool negotiate(rapidxml::xml_node<> *) override {
@@ -105,11 +105,11 @@ namespace {
 
                 m_stream.user(m_stream.local_domain());
                 METRE_LOG(Metre::Log::DEBUG, "Component registering session domain: domain=[" << m_stream.local_domain() << "] session=[" << m_stream.session().serial() << "]");
-                Router::register_session_domain(m_stream.local_domain(), m_stream.session());
-                xml_document<> d;
-                auto handshake = d.allocate_node(node_element, "handshake");
-                d.append_node(handshake);
-                m_stream.send(d);
+                Router::register_session_domain(DomainId(m_stream.local_domain()), m_stream.session());
+                auto d = XMLPool::document();
+                auto handshake = d->allocate_node(node_element, "handshake");
+                d->append_node(handshake);
+                m_stream.send(*d);
                 co_return true;
             } else {
                 throw Metre::unsupported_stanza_type(stanza);
@@ -119,13 +119,14 @@ namespace {
                     Jid const &from = s->from();
                     Jid const &to = s->to();
                     // Check auth state.
-                    if (m_stream.s2s_auth_pair(to.domain(), from.domain(), INBOUND) != XMLStream::AUTHORIZED) {
+                    if (m_stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND) != XMLStream::AUTHORIZED) {
                         throw not_authorized();
                     }
                     // Forward everything.
                     METRE_LOG(Metre::Log::DEBUG, "Component creating route: from=[" << from.domain() << "] to=[" << to.domain() << "]");
                     std::shared_ptr<Route> route = RouteTable::routeTable(from).route(to);
                     route->transmit(std::move(s));
+                    route->throttle(m_stream.session());
                 } catch (Metre::base::xmpp_exception &) {
                     throw;
                 } catch (Metre::base::stanza_exception &) {
@@ -0,0 +1,238 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "compression.h"
+#include "feature.h"
+#include "netsession.h"
+#include "config.h"
+#include "log.h"
+#include "xmlpool.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+using namespace Metre;
+using namespace rapidxml;
+
+namespace {
+    const std::string compress_feat_ns = "http://jabber.org/features/compress";
+    const std::string compress_ns = "http://jabber.org/protocol/compress";
+
+    constexpr std::size_t default_limit = 64 * 1024;
+
+    struct Codecs {
+        std::unique_ptr<Codec> input;
+        std::unique_ptr<Codec> output;
+    };
+
+    enum bufferevent_filter_result filter(Codec &codec, struct evbuffer *src, struct evbuffer *dst,
+                                          ev_ssize_t limit) {
+        if (evbuffer_get_length(src) == 0 && !codec.pending()) return BEV_NEED_MORE;
+        if (!codec.transform(src, dst, limit > 0 ? static_cast<std::size_t>(limit) : default_limit)) {
+            return BEV_ERROR;
+        }
+        return BEV_OK;
+    }
+
+    enum bufferevent_filter_result input_filter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t limit,
+                                                enum bufferevent_flush_mode, void *arg) {
+        return filter(*static_cast<Codecs *>(arg)->input, src, dst, limit);
+    }
+
+    enum bufferevent_filter_result output_filter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t limit,
+                                                 enum bufferevent_flush_mode, void *arg) {
+        return filter(*static_cast<Codecs *>(arg)->output, src, dst, limit);
+    }
+
+    /**
+     * Everything already written has gone into the old bufferevent as plain text;
+     * everything from here on is compressed.
+     */
+    void compress(XMLStream &stream, std::string const &method) {
+        auto const &domain = Config::config().domain(stream.remote_domain());
+        auto const &dictionary = domain.compression_dictionary();
+        auto window = domain.compression_window();
+        auto codecs = std::make_unique<Codecs>();
+        codecs->input = decompressor(method, window, dictionary);
+        codecs->output = compressor(method, window, dictionary.get());
+        struct bufferevent *bev = stream.session().bufferevent();
+        struct bufferevent *bev_z = bufferevent_filter_new(bev, input_filter, output_filter, BEV_OPT_CLOSE_ON_FREE,
+                                                           [](void *arg) {
+                                                               delete static_cast<Codecs *>(arg);
+                                                           }, codecs.get());
+        if (!bev_z) throw std::runtime_error("Cannot create compression filter");
+        codecs.release();
+        stream.session().bufferevent(bev_z);
+        stream.set_compressed();
+        stream.logger().info("Compression enabled: method=[{}] window=[{}] dictionary=[{}]", method, window,
+                             dictionary ? "yes" : "no");
+    }
+
+    // Remote domains which have failed to set up compression; we won't ask again.
+    std::mutex s_refused_mutex;
+    std::set<std::string> s_refused;
+
+    // Only once the remote domain is authenticated, as XEP-0170 orders it.
+    bool authenticated(XMLStream &s) {
+        return s.s2s_auth_pair(s.local_domain(), s.remote_domain(), s.direction()) == XMLStream::AUTHORIZED;
+    }
+
+    bool wanted(XMLStream &s) {
+        if (s.compressed() || s.x2x_mode() || !authenticated(s)) return false;
+        auto const &remote = Config::config().domain(s.remote_domain());
+        if (remote.compression().empty()) return false;
+        if (!s.secured() && (remote.require_tls() || Config::config().domain(s.local_domain()).require_tls())) {
+            return false; // TLS first.
+        }
+        std::lock_guard<std::mutex> l(s_refused_mutex);
+        return s_refused.find(s.remote_domain()) == s_refused.end();
+    }
+
+    void send(XMLStream &stream, const char *name, const char *method, const char *condition) {
+        auto d = XMLPool::document();
+        auto element = d->allocate_node(node_element, name);
+        element->append_attribute(d->allocate_attribute("xmlns", compress_ns.c_str()));
+        if (method) element->append_node(d->allocate_node(node_element, "method", method));
+        if (condition) element->append_node(d->allocate_node(node_element, condition));
+        d->append_node(element);
+        stream.send(*d);
+    }
+
+    /**
+     * Offered inbound, and requested outbound, using the first of the remote domain's
+     * configured methods the other end supports. Streams only authenticated by dialback
+     * never get features again afterwards, so aren't compressed. The exchange itself is
+     * in Compress.
+     */
+    class CompressionOffer : public Feature {
+        std::string m_method;
+
+    public:
+        explicit CompressionOffer(XMLStream &s) : Feature(s) {}
+
+        std::string const &method() const {
+            return m_method;
+        }
+
+        class Description : public Feature::Description<CompressionOffer> {
+        public:
+            Description() : Feature::Description<CompressionOffer>(compress_feat_ns, FEAT_COMP) {};
+
+            sigslot::tasklet<bool> offer(xml_node<> *node, XMLStream &s) override {
+                if (!wanted(s)) co_return false;
+                xml_document<> *d = node->document();
+                auto feature = d->allocate_node(node_element, "compression");
+                feature->append_attribute(d->allocate_attribute("xmlns", compress_feat_ns.c_str()));
+                for (auto const &method : Config::config().domain(s.remote_domain()).compression()) {
+                    feature->append_node(d->allocate_node(node_element, "method", method.c_str()));
+                }
+                node->append_node(feature);
+                co_return true;
+            }
+
+            Feature::Type type(XMLStream &s) override {
+                return authenticated(s) ? FEAT_COMP : FEAT_NONE;
+            }
+        };
+
+        sigslot::tasklet<bool> handle(rapidxml::xml_node<> *) override {
+            co_return false;
+        }
+
+        bool negotiate(rapidxml::xml_node<> *offer) override {
+            if (!offer || !wanted(m_stream)) return false;
+            for (auto const &method : Config::config().domain(m_stream.remote_domain()).compression()) {
+                for (auto m = offer->first_node("method"); m; m = m->next_sibling("method")) {
+                    if (std::string_view(m->value(), m->value_size()) != method) continue;
+                    m_method = method;
+                    send(m_stream, "compress", m_method.c_str(), nullptr);
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    class Compress : public Feature {
+    public:
+        explicit Compress(XMLStream &s) : Feature(s) {}
+
+        class Description : public Feature::Description<Compress> {
+        public:
+            Description() : Feature::Description<Compress>(compress_ns, FEAT_COMP) {};
+
+            Feature::Type type(XMLStream &) override {
+                return FEAT_NONE; // Never advertised; only handles the exchange.
+            }
+        };
+
+        sigslot::tasklet<bool> handle(rapidxml::xml_node<> *node) override {
+            xml_document<> *d = node->document();
+            d->fixup<parse_default>(node, true);
+            std::string_view name(node->name(), node->name_size());
+            if (name == "compress" && m_stream.direction() == INBOUND) {
+                std::string method;
+                auto m = node->first_node("method");
+                if (m) method.assign(m->value(), m->value_size());
+                if (!wanted(m_stream)) {
+                    send(m_stream, "failure", nullptr, "setup-failed");
+                    co_return true;
+                }
+                auto const &methods = Config::config().domain(m_stream.remote_domain()).compression();
+                if (!compression_supported(method) || std::find(methods.begin(), methods.end(), method) == methods.end()) {
+                    send(m_stream, "failure", nullptr, "unsupported-method");
+                    co_return true;
+                }
+                send(m_stream, "compressed", nullptr, nullptr);
+                compress(m_stream, method);
+                m_stream.restart();
+                co_return true;
+            } else if (name == "compressed" && m_stream.direction() == OUTBOUND) {
+                auto &offer = dynamic_cast<CompressionOffer &>(m_stream.feature(compress_feat_ns));
+                compress(m_stream, offer.method());
+                m_stream.restart();
+                co_return true;
+            } else if (name == "failure" && m_stream.direction() == OUTBOUND) {
+                // We've stopped processing features, so there's no carrying on without it.
+                m_stream.logger().warn("Compression refused; not asking again");
+                {
+                    std::lock_guard<std::mutex> l(s_refused_mutex);
+                    s_refused.insert(m_stream.remote_domain());
+                }
+                m_stream.session().close();
+                co_return true;
+            }
+            co_return false;
+        }
+    };
+
+    DECLARE_FEATURE(CompressionOffer, S2S);
+
+    DECLARE_FEATURE(Compress, S2S);
+}
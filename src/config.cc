@@ -25,6 +25,7 @@ SOFTWARE.
 
 #include "config.h"
 
+#include "spdlog/async.h"
 #include "spdlog/sinks/daily_file_sink.h"
 #include "spdlog/sinks/stdout_sinks.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
@@ -32,6 +33,8 @@ SOFTWARE.
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <chrono>
+#include <functional>
 
 #include <rapidxml.hpp>
 #include <openssl/ssl.h>
@@ -40,6 +43,7 @@ SOFTWARE.
 #include <openssl/x509v3.h>
 #ifdef METRE_UNIX
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #else
 #include <WinSock2.h>
@@ -55,13 +59,18 @@ SOFTWARE.
 #include "log.h"
 #include <rapidxml_print.hpp>
 #include <http.h>
+#include <tls.h>
 #include <iomanip>
 #if defined(HAVE_ICU) || defined(HAVE_ICU2)
 #include <unicode/uidna.h>
 #endif
 #include <filter.h>
+#include <compression.h>
+#include <metrics.h>
 #include <cstring>
 #include <unbound-event.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
 
 using namespace Metre;
 using namespace rapidxml;
@@ -183,6 +192,52 @@ namespace {
         return attr->value();
     }
 
+    // Attributes present override whatever's already there, so domains can refine the <any> settings.
+    void parse_socket(xml_node<> const *node, Config::SocketOptions &options) {
+        if (!node) return;
+        auto number = [node](const char *name, auto &field) {
+            auto attr = node->first_attribute(name);
+            if (attr) field = attrval<typename std::decay_t<decltype(field)>::value_type>(attr);
+        };
+        auto flag = [node](const char *name, std::optional<bool> &field) {
+            auto attr = node->first_attribute(name);
+            if (attr) field = xmlbool(attr);
+        };
+        number("rcvbuf", options.rcvbuf);
+        number("sndbuf", options.sndbuf);
+        flag("nodelay", options.nodelay);
+        flag("keepalive", options.keepalive);
+        number("keepalive-idle", options.keepalive_idle);
+        number("keepalive-interval", options.keepalive_interval);
+        number("keepalive-count", options.keepalive_count);
+        number("notsent-lowat", options.notsent_lowat);
+        number("read-low", options.read_low);
+        number("read-high", options.read_high);
+    }
+
+    xml_node<> *socket_xml(xml_document<> &doc, Config::SocketOptions const &options) {
+        auto node = doc.allocate_node(node_element, "socket");
+        auto number = [&doc, node](const char *name, auto const &field) {
+            if (field) {
+                node->append_attribute(doc.allocate_attribute(name, doc.allocate_string(std::to_string(*field).c_str())));
+            }
+        };
+        auto flag = [&doc, node](const char *name, std::optional<bool> const &field) {
+            if (field) node->append_attribute(doc.allocate_attribute(name, *field ? "true" : "false"));
+        };
+        number("rcvbuf", options.rcvbuf);
+        number("sndbuf", options.sndbuf);
+        flag("nodelay", options.nodelay);
+        flag("keepalive", options.keepalive);
+        number("keepalive-idle", options.keepalive_idle);
+        number("keepalive-interval", options.keepalive_interval);
+        number("keepalive-count", options.keepalive_count);
+        number("notsent-lowat", options.notsent_lowat);
+        number("read-low", options.read_low);
+        number("read-high", options.read_high);
+        return node;
+    }
+
     std::unique_ptr<Config::Domain> parse_domain(Config::Domain const *any, xml_node<> *domain, SESSION_TYPE def) {
         std::string name;
         bool forward = (def == INTERNAL || def == COMP);
@@ -196,8 +251,16 @@ namespace {
         bool auth_host = false;
         int stanza_timeout = 20;
         int connect_timeout = 10;
+        std::size_t queue_low = 256 * 1024;
+        std::size_t queue_high = 1024 * 1024;
+        std::size_t queue_max = 0;
         std::string dhparam = "4096";
         std::string cipherlist = "HIGH:!3DES:!eNULL:!aNULL:@STRENGTH"; // Apparently 3DES qualifies for HIGH, but is 112 bits, which the IM Observatory marks down for.
+        std::list<std::string> compression;
+        unsigned compression_window = 12;
+        std::string compression_dictionary;
+        Config::SocketOptions socket;
+        std::array<unsigned, 3> priority_weights{{4, 2, 1}};
         std::optional<std::string> auth_secret;
         if (any) {
             auth_pkix = any->auth_pkix();
@@ -209,6 +272,14 @@ namespace {
             auth_pkix_crls = any->auth_pkix_status();
             stanza_timeout = any->stanza_timeout();
             connect_timeout = any->connect_timeout();
+            queue_low = any->queue_low();
+            queue_high = any->queue_high();
+            queue_max = any->queue_max();
+            compression = any->compression();
+            compression_window = any->compression_window();
+            compression_dictionary = any->compression_dictionary_source();
+            socket = any->socket();
+            priority_weights = any->priority_weights();
         }
         if (any_element == domain->name()) {
             name = "";
@@ -250,6 +321,9 @@ namespace {
             }
             stanza_timeout = attrval<int>(domain->first_attribute("stanza-timeout"), stanza_timeout);
             connect_timeout = attrval<int>(domain->first_attribute("connect-timeout"), connect_timeout);
+            queue_low = attrval<std::size_t>(domain->first_attribute("queue-low"), queue_low);
+            queue_high = attrval<std::size_t>(domain->first_attribute("queue-high"), queue_high);
+            queue_max = attrval<std::size_t>(domain->first_attribute("queue-max"), queue_max);
             auto forward_a = domain->first_attribute("forward");
             if (forward_a) {
                 forward = xmlbool(forward_a->value());
@@ -290,6 +364,8 @@ namespace {
         dom->auth_pkix_status(auth_pkix_crls);
         dom->stanza_timeout(stanza_timeout);
         dom->connect_timeout(connect_timeout);
+        if (queue_low > queue_high) throw std::runtime_error("queue-low must not exceed queue-high");
+        dom->queue_limits(queue_low, queue_high, queue_max);
         auto x509t = domain->first_node("x509");
         if (x509t) {
             auto chain_a = x509t->first_attribute("chain");
@@ -298,7 +374,8 @@ namespace {
                 auto pkey_a = x509t->first_attribute("pkey");
                 if (pkey_a) {
                     std::string pkey = pkey_a->value();
-                    dom->x509(chain, pkey);
+                    auto staple_a = x509t->first_attribute("ocsp-staple");
+                    dom->x509(chain, pkey, staple_a ? xmlbool(staple_a) : true);
                 } else {
                     throw std::runtime_error("Missing pkey for x509");
                 }
@@ -317,6 +394,35 @@ namespace {
             if (ciphersa->value()) cipherlist = ciphersa->value();
         }
         dom->cipherlist(cipherlist);
+        auto compressiont = domain->first_node("compression");
+        if (compressiont) {
+            auto methodsa = compressiont->first_attribute("methods");
+            if (methodsa) {
+                compression.clear();
+                std::istringstream ss(methodsa->value());
+                for (std::string method; ss >> method;) {
+                    if (!compression_supported(method)) {
+                        throw std::runtime_error("Unsupported compression method " + method);
+                    }
+                    compression.push_back(method);
+                }
+            }
+            compression_window = attrval<unsigned>(compressiont->first_attribute("window"), compression_window);
+            auto dictionarya = compressiont->first_attribute("dictionary");
+            if (dictionarya) compression_dictionary = dictionarya->value();
+        }
+        dom->compression(compression, compression_window, compression_dictionary);
+        parse_socket(domain->first_node("socket"), socket);
+        dom->socket(socket);
+        auto priorityt = domain->first_node("priority");
+        if (priorityt) {
+            std::size_t i = 0;
+            for (auto name : {"iq", "message", "presence"}) {
+                priority_weights[i] = attrval<unsigned>(priorityt->first_attribute(name), priority_weights[i]);
+                ++i;
+            }
+        }
+        dom->priority_weights(priority_weights);
         auto dnst = domain->first_node("dns");
         if (dnst) {
             auto dnssec = dnst->first_attribute("dnssec");
@@ -421,26 +527,61 @@ Config::Domain::Domain(std::string const &domain, SESSION_TYPE transport_type, b
         : m_domain(domain), m_type(transport_type), m_forward(forward), m_require_tls(require_tls), m_block(block),
           m_auth_pkix(auth_pkix), m_auth_dialback(auth_dialback), m_auth_host(auth_host), m_auth_secret(auth_secret),
           m_ssl_ctx(nullptr) {
-    m_logger = Config::config().logger("domain <" + m_domain + ">");
+    m_logger = Config::config().logger("Domain", {{"domain", m_domain}});
 }
 
 Config::Domain::Domain(Config::Domain const &any, std::string const &domain)
         : m_domain(domain), m_type(any.m_type), m_forward(any.m_forward), m_require_tls(any.m_require_tls),
           m_block(any.m_block), m_auth_pkix(any.m_auth_pkix), m_auth_crls(any.m_auth_crls),
           m_auth_dialback(any.m_auth_dialback), m_auth_host(any.m_auth_host), m_dnssec_required(any.m_dnssec_required),
-          m_stanza_timeout(any.m_stanza_timeout), m_dhparam(any.m_dhparam), m_cipherlist(any.m_cipherlist),
-          m_ssl_ctx(nullptr), m_parent(&any) {
-    m_logger = Config::config().logger("domain <" + m_domain + ">");
+          m_stanza_timeout(any.m_stanza_timeout), m_queue_low(any.m_queue_low), m_queue_high(any.m_queue_high),
+          m_queue_max(any.m_queue_max), m_dhparam(any.m_dhparam), m_cipherlist(any.m_cipherlist),
+          m_compression(any.m_compression), m_compression_window(any.m_compression_window),
+          m_compression_dictionary(any.m_compression_dictionary),
+          m_compression_dictionary_source(any.m_compression_dictionary_source), m_socket(any.m_socket),
+          m_priority_weights(any.m_priority_weights), m_ssl_ctx(nullptr), m_parent(&any) {
+    m_logger = Config::config().logger("Domain", {{"domain", m_domain}});
+}
+
+void Config::Domain::priority_weights(std::array<unsigned, 3> const &weights) {
+    for (auto weight : weights) {
+        if (weight == 0) throw std::runtime_error("Priority weights must be at least 1");
+    }
+    m_priority_weights = weights;
+}
+
+void Config::Domain::compression(std::list<std::string> const &methods, unsigned window,
+                                 std::string const &dictionary) {
+    if (window < 10 || window > 15) throw std::runtime_error("Compression window must be between 10 and 15");
+    m_compression = methods;
+    m_compression_window = window;
+    m_compression_dictionary_source = dictionary;
+    if (dictionary.empty()) {
+        m_compression_dictionary.reset();
+    } else if (dictionary == "builtin") {
+        m_compression_dictionary = std::make_shared<std::string const>(Metre::compression_dictionary());
+    } else {
+        std::ifstream f(dictionary, std::ios::binary);
+        if (!f) throw std::runtime_error("Cannot read compression dictionary " + dictionary);
+        std::ostringstream ss;
+        ss << f.rdbuf();
+        m_compression_dictionary = std::make_shared<std::string const>(ss.str());
+    }
 }
 
 FILTER_RESULT Config::Domain::filter(SESSION_DIRECTION dir, Stanza &s) const {
+    if (m_filters.empty()) return PASS; // Don't materialize the node for nothing.
     rapidxml::xml_node<> const *node = s.node();
     if (!node) {
         // Synthetic Stanza. Probably a bounce, or similar.
         return PASS;
     }
     for (auto &filter : m_filters) {
-        if (filter->apply(dir, s) == DROP) return DROP;
+        if (filter->apply(dir, s) == DROP) {
+            Metrics::counter("metre_filter_dropped_total", "Stanzas dropped, per domain and filter.",
+                             {{"domain", m_domain}, {"filter", filter->name()}}).inc();
+            return DROP;
+        }
     }
     return PASS;
 }
@@ -485,7 +626,7 @@ int Config::verify_callback_cb(int preverify_ok, struct x509_store_ctx_st *st) {
         X509_NAME_oneline(X509_get_subject_name(X509_STORE_CTX_get_current_cert(st)),
                           const_cast<char *>(cert_name.data()), name_sz);
         cert_name.resize(cert_name.find('\0'));
-        Config::config().m_logger->debug("Cert passed basic verification: {}", cert_name);
+        METRE_DEBUG(*Config::config().m_logger, "Cert passed basic verification: {}", cert_name);
         if (Config::config().m_fetch_crls) {
             auto cert = X509_STORE_CTX_get_current_cert(st);
             std::unique_ptr<STACK_OF(DIST_POINT),std::function<void(STACK_OF(DIST_POINT) *)>> crldp_ptr{(STACK_OF(DIST_POINT)*)X509_get_ext_d2i(cert, NID_crl_distribution_points, NULL, NULL),[](STACK_OF(DIST_POINT) * crldp){ sk_DIST_POINT_pop_free(crldp, DIST_POINT_free); }};
@@ -518,14 +659,14 @@ namespace {
         const char *servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
         if (!servername) return SSL_TLSEXT_ERR_OK;
         SSL_CTX *old_ctx = SSL_get_SSL_CTX(ssl);
-        SSL_CTX *new_ctx = Config::config().domain(Jid(servername).domain()).ssl_ctx();
+        SSL_CTX *new_ctx = Config::config().domain(Jid(servername).domain_id()).ssl_ctx();
         if (!new_ctx) new_ctx = Config::config().domain("").ssl_ctx();
         if (new_ctx != old_ctx) SSL_set_SSL_CTX(ssl, new_ctx);
         return SSL_TLSEXT_ERR_OK;
     }
 }
 
-void Config::Domain::x509(std::string const &chain, std::string const &pkey) {
+void Config::Domain::x509(std::string const &chain, std::string const &pkey, bool ocsp_staple) {
     if (!openssl_init) {
         SSL_library_init();
         ERR_load_crypto_strings();
@@ -567,6 +708,8 @@ void Config::Domain::x509(std::string const &chain, std::string const &pkey) {
     std::string ctx = "Metre::" + m_domain;
     SSL_CTX_set_session_id_context(m_ssl_ctx, reinterpret_cast<const unsigned char *>(ctx.c_str()),
                                    static_cast<unsigned int>(ctx.size()));
+    m_ocsp_staple = ocsp_staple;
+    tls_context_setup(m_ssl_ctx, ocsp_staple);
 }
 
 SSL_CTX *Config::Domain::ssl_ctx() const {
@@ -580,21 +723,37 @@ SSL_CTX *Config::Domain::ssl_ctx() const {
     return ctx;
 }
 
-Config::Config(std::string const &filename) : m_config_str(), m_dialback_secret(random_identifier()) {
+namespace {
+    // Each worker thread runs its own resolver, so results arrive on the thread that asked.
+    thread_local struct ub_ctx *s_ub_ctx = nullptr;
+
+    // Domains are never removed from a Config, so each thread can keep what it's looked up.
+    struct DomainCache {
+        std::uint64_t generation = 0;
+        std::unordered_map<DomainId, Config::Domain const *> domains;
+    };
+    thread_local DomainCache s_domain_cache;
+    std::atomic<std::uint64_t> s_generations{0};
+
+    void clear_dns_cache();
+}
+
+Config::Config(std::string const &filename) : m_config_str(), m_dialback_secret(random_identifier()),
+                                               m_generation(++s_generations) {
     s_config = this;
     // Spin up a temporary error logger.
     m_root_logger = spdlog::stderr_color_st("console");
     spdlog::set_level(spdlog::level::trace);
     //spdlog::set_sync_mode();
     load(filename);
-    m_ub_ctx = ub_ctx_create();
-    if (!m_ub_ctx) {
+    s_ub_ctx = ub_ctx_create();
+    if (!s_ub_ctx) {
         throw std::runtime_error("DNS context creation failure.");
     }
 }
 
 Config::~Config() {
-    // TODO: Should really do this, but need to shut it down first: ub_ctx_delete(m_ub_ctx);
+    // TODO: Should really do this, but need to shut it down first: ub_ctx_delete(s_ub_ctx);
 }
 
 void Config::write_runtime_config() const {
@@ -649,6 +808,31 @@ void Config::load(std::string const &filename) {
         if (crls && crls->value()) {
             m_fetch_crls = xmlbool(crls->value());
         }
+        auto threads = globals->first_node("threads");
+        if (threads && threads->value()) {
+            m_threads = std::max(1UL, std::stoul(threads->value()));
+        }
+        auto tickets = globals->first_node("tls-ticket-lifetime");
+        if (tickets && tickets->value()) {
+            m_tls_ticket_lifetime = std::stoul(tickets->value());
+        }
+        auto log_level = globals->first_node("log-level");
+        if (log_level && log_level->value()) {
+            m_configured_log_level = spdlog::level::from_str(log_level->value());
+            if (m_configured_log_level == spdlog::level::off && std::string(log_level->value()) != "off") {
+                throw std::runtime_error("Unknown log level " + std::string(log_level->value()));
+            }
+        }
+        auto metrics = globals->first_node("metrics");
+        if (metrics) {
+            m_metrics_address = attrval<const char *>(metrics->first_attribute("address"), m_metrics_address.c_str());
+            m_metrics_port = attrval<unsigned short>(metrics->first_attribute("port"), m_metrics_port);
+        }
+        auto read_budget = globals->first_node("read-budget");
+        if (read_budget) {
+            m_read_budget_stanzas = attrval<std::size_t>(read_budget->first_attribute("stanzas"), m_read_budget_stanzas);
+            m_read_budget_bytes = attrval<std::size_t>(read_budget->first_attribute("bytes"), m_read_budget_bytes);
+        }
         auto filters = globals->first_node("filter");
         if (filters) {
             for (auto filter = filters->first_node(); filter; filter = filter->next_sibling()) {
@@ -726,6 +910,11 @@ void Config::load(std::string const &filename) {
             auto name = attrval<const char *>(listener->first_attribute("name"), ss.str().c_str());
             m_listeners.emplace_back(local_domain, remote_domain, name, address, port, tls, stype);
             if (remote_domain[0]) m_listeners.rbegin()->allowed_domains.emplace(remote_domain);
+            parse_socket(listener->first_node("socket"), m_listeners.rbegin()->socket);
+            m_listeners.rbegin()->reuseport = xmlbool(listener->first_attribute("reuseport"));
+            if (m_listeners.rbegin()->reuseport && stype != S2S) {
+                throw std::runtime_error("reuseport is only supported for s2s listeners");
+            }
             for (auto allowed = listener->first_node("allowed-domain"); allowed; allowed = allowed->next_sibling(
                     "allowed-domain")) {
                 if (!allowed->value()) throw std::runtime_error("Empty allowed-domain");
@@ -772,10 +961,15 @@ rapidxml::xml_node<> *Config::Domain::to_xml(rapidxml::xml_document<> &doc) cons
         d->append_attribute(doc.allocate_attribute("name", domain().c_str()));
         d->append_attribute(doc.allocate_attribute("forward", forward() ? "true" : "false"));
         d->append_attribute(doc.allocate_attribute("stanza-timeout", alloc_short(stanza_timeout())));
+        d->append_attribute(doc.allocate_attribute("queue-low", alloc_short(static_cast<long>(queue_low()))));
+        d->append_attribute(doc.allocate_attribute("queue-high", alloc_short(static_cast<long>(queue_high()))));
+        d->append_attribute(doc.allocate_attribute("queue-max", alloc_short(static_cast<long>(queue_max()))));
         d->append_node(doc.allocate_node(node_comment, nullptr,
                                          "A remote domain. Forwarded domains are proxied through to non-forwarded domains."));
         d->append_node(doc.allocate_node(node_comment, nullptr,
                                          "A 'sec' attribute set to true mandates a secured connection (usually TLS)."));
+        d->append_node(doc.allocate_node(node_comment, nullptr,
+                                         "Once queue-high octets are pending to the domain, inbound sessions feeding it stop reading until it's down to queue-low. Beyond queue-max (if not 0), stanzas are bounced."));
     }
     {
         auto transport = doc.allocate_node(node_element, "transport");
@@ -968,12 +1162,13 @@ rapidxml::xml_node<> *Config::Domain::to_xml(rapidxml::xml_document<> &doc) cons
                 x509->append_attribute(doc.allocate_attribute("pkey", doc.allocate_string(keyfile.c_str())));
                 key_okay = true;
             }
+            x509->append_attribute(doc.allocate_attribute("ocsp-staple", ocsp_staple() ? "true" : "false"));
             if (key_okay || chain) {
                 d->append_node(x509);
             }
         }
         d->append_node(doc.allocate_node(node_comment, nullptr,
-                                         "The x509 element provides a chainfile and private key to use as the local identity when acting as this domain."));
+                                         "The x509 element provides a chainfile and private key to use as the local identity when acting as this domain.\nIf ocsp-staple is true, OCSP responses for the certificate are fetched and stapled."));
     }
     {
         auto dhp = doc.allocate_node(node_element, "dhparam");
@@ -984,6 +1179,37 @@ rapidxml::xml_node<> *Config::Domain::to_xml(rapidxml::xml_document<> &doc) cons
     }
     d->append_node(doc.allocate_node(node_element, "ciphers", cipherlist().c_str()));
     d->append_node(doc.allocate_node(node_comment, nullptr, "This is a normal OpenSSL cipher string."));
+    {
+        auto comp = doc.allocate_node(node_element, "compression");
+        std::string methods;
+        for (auto const &method : compression()) {
+            if (!methods.empty()) methods += ' ';
+            methods += method;
+        }
+        comp->append_attribute(doc.allocate_attribute("methods", doc.allocate_string(methods.c_str())));
+        comp->append_attribute(doc.allocate_attribute("window", alloc_short(compression_window())));
+        if (!compression_dictionary_source().empty()) {
+            comp->append_attribute(doc.allocate_attribute("dictionary", compression_dictionary_source().c_str()));
+        }
+        d->append_node(comp);
+        d->append_node(doc.allocate_node(node_comment, nullptr,
+                                         "XEP-0138 stream compression, once TLS and SASL are done: methods (zlib, and zstd if built with it) in order of preference, window as log2 octets (10-15) for what we send, and the largest zstd window we'll accept.\nA dictionary - 'builtin' or a file - must be configured identically at both ends."));
+    }
+    {
+        d->append_node(socket_xml(doc, socket()));
+        d->append_node(doc.allocate_node(node_comment, nullptr,
+                                         "Socket tuning for sessions with this domain: rcvbuf, sndbuf, nodelay, keepalive, keepalive-idle, keepalive-interval, keepalive-count, notsent-lowat, and read-low and read-high bufferevent watermarks.\nUnset means the system default."));
+    }
+    {
+        auto priority = doc.allocate_node(node_element, "priority");
+        std::size_t i = 0;
+        for (auto name : {"iq", "message", "presence"}) {
+            priority->append_attribute(doc.allocate_attribute(name, alloc_short(priority_weights()[i++])));
+        }
+        d->append_node(priority);
+        d->append_node(doc.allocate_node(node_comment, nullptr,
+                                         "Once output to this domain is backed up past queue-low, stanzas wait in a queue per class, and each round sends this many of each."));
+    }
     {
         auto filter_in = doc.allocate_node(node_element, "filter-in");
         filter_in->append_node(doc.allocate_node(node_comment, nullptr,
@@ -1032,11 +1258,36 @@ std::string Config::asString() const {
         global("rundir", m_runtime_dir, "Runtime directory, used to store pid file.");
         global("datadir", m_data_dir, "Data directory, used only for the running config.");
         global("logfile", m_logfile, "Logfile path.");
+        global("log-level", std::string(spdlog::level::to_string_view(m_configured_log_level).data()),
+               "Log level - trace, debug, info, warning, error, critical or off. SIGUSR1 switches to trace, and SIGUSR2 back.");
         global("dnssec", m_dns_keys, "DNSSEC root keys file.");
         global("boot_method", m_boot, "Boot method - none, fork, or systemd");
         global("fetch-crls", m_fetch_crls ? "true" : "false",
                "Controls if CRLs are fetched - MUST be on for status checking!");
+        global("threads", std::to_string(m_threads), "Number of worker threads, each with its own event loop.");
+        global("tls-ticket-lifetime", std::to_string(m_tls_ticket_lifetime),
+               "Seconds before the TLS session ticket key is rotated; 0 disables session tickets.");
         global("dnssec", m_dns_keys, "DNS key file - obtain this from IANA");
+        {
+            auto metrics = doc.allocate_node(node_element, "metrics");
+            metrics->append_attribute(doc.allocate_attribute("address", m_metrics_address.c_str()));
+            metrics->append_attribute(doc.allocate_attribute("port", alloc_short(m_metrics_port)));
+            globals->append_node(metrics);
+            globals->append_node(doc.allocate_node(node_comment, nullptr,
+                                                   "Serves Prometheus metrics over HTTP at /metrics, if port isn't 0. Unauthenticated, so keep it local."));
+            globals->append_node(doc.allocate_node(node_data, nullptr, "\n"));
+        }
+        {
+            auto read_budget = doc.allocate_node(node_element, "read-budget");
+            read_budget->append_attribute(doc.allocate_attribute("stanzas", doc.allocate_string(
+                    std::to_string(m_read_budget_stanzas).c_str())));
+            read_budget->append_attribute(doc.allocate_attribute("bytes", doc.allocate_string(
+                    std::to_string(m_read_budget_bytes).c_str())));
+            globals->append_node(read_budget);
+            globals->append_node(doc.allocate_node(node_comment, nullptr,
+                                                   "Stanzas and bytes a session handles before other sessions get a turn; 0 is unlimited."));
+            globals->append_node(doc.allocate_node(node_data, nullptr, "\n"));
+        }
 
         xml_node<> *filters = doc.allocate_node(node_element, "filter");
         filters->append_node(
@@ -1099,6 +1350,8 @@ std::string Config::asString() const {
                 listener->append_attribute(doc.allocate_attribute("type", stype));
                 listener->append_attribute(
                         doc.allocate_attribute("tls", listen.tls_mode == IMMEDIATE ? "true" : "false"));
+                if (listen.reuseport) listener->append_attribute(doc.allocate_attribute("reuseport", "true"));
+                listener->append_node(socket_xml(doc, listen.socket));
                 listeners->append_node(listener);
             }
             root->append_node(listeners);
@@ -1121,17 +1374,56 @@ void Config::log_init(bool systemd) {
     if (!systemd && m_logfile.empty()) {
         m_logfile = "/var/log/metre/metre.log";
     }
-    // Initialize logging.
+    // Initialize logging. Formatting and writing happen on a single writer thread, fed by a
+    // bounded queue; if it can't keep up, the oldest messages are dropped rather than blocking.
+    spdlog::sink_ptr sink;
     if (!m_logfile.empty()) {
-        m_root_logger = spdlog::daily_logger_st("global", m_logfile);
+        sink = std::make_shared<spdlog::sinks::daily_file_sink_mt>(m_logfile, 0, 0);
     } else {
-        m_root_logger = spdlog::stderr_logger_st("global");
-    }
-    m_root_logger->flush_on(spdlog::level::trace);
-    m_root_logger->set_level(spdlog::level::trace);
+        sink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    }
+    m_log_pool = std::make_shared<spdlog::details::thread_pool>(8192, 1);
+    spdlog::drop("global");
+    m_root_logger = std::make_shared<spdlog::async_logger>("global", sink, m_log_pool,
+                                                           spdlog::async_overflow_policy::overrun_oldest);
+    spdlog::register_logger(m_root_logger);
+    spdlog::flush_every(std::chrono::seconds(1));
+    log_level(m_configured_log_level);
     m_logger = logger("config");
 }
 
+void Config::SocketOptions::apply(evutil_socket_t fd) const {
+    if (fd == -1) return;
+    auto set = [fd](int level, int name, int value, const char *what) {
+        if (setsockopt(fd, level, name, reinterpret_cast<const char *>(&value), sizeof(value)) != 0) {
+            Config::config().logger().warn("Cannot set {} to {}: {}", what, value,
+                                           evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        }
+    };
+    if (rcvbuf) set(SOL_SOCKET, SO_RCVBUF, *rcvbuf, "SO_RCVBUF");
+    if (sndbuf) set(SOL_SOCKET, SO_SNDBUF, *sndbuf, "SO_SNDBUF");
+    if (nodelay) set(IPPROTO_TCP, TCP_NODELAY, *nodelay, "TCP_NODELAY");
+    if (keepalive) set(SOL_SOCKET, SO_KEEPALIVE, *keepalive, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+    if (keepalive_idle) set(IPPROTO_TCP, TCP_KEEPIDLE, *keepalive_idle, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+    if (keepalive_interval) set(IPPROTO_TCP, TCP_KEEPINTVL, *keepalive_interval, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+    if (keepalive_count) set(IPPROTO_TCP, TCP_KEEPCNT, *keepalive_count, "TCP_KEEPCNT");
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    if (notsent_lowat) set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, *notsent_lowat, "TCP_NOTSENT_LOWAT");
+#endif
+}
+
+void Config::SocketOptions::watermarks(struct bufferevent *bev) const {
+    if (read_low || read_high) {
+        bufferevent_setwatermark(bev, EV_READ, read_low.value_or(0), read_high.value_or(0));
+    }
+}
+
 void Config::create_domain(std::string const &dom) {
     std::string search{dom};
     auto it = m_domains.find(dom);
@@ -1153,11 +1445,25 @@ void Config::create_domain(std::string const &dom) {
 }
 
 Config::Domain const &Config::domain(std::string const &dom) const {
+    return domain(DomainId(dom));
+}
+
+Config::Domain const &Config::domain(DomainId const &id) const {
+    auto &cache = s_domain_cache;
+    if (cache.generation != m_generation) {
+        cache.domains.clear();
+        cache.generation = m_generation;
+    }
+    auto cached = cache.domains.find(id);
+    if (cached != cache.domains.end()) return *(*cached).second;
+    std::lock_guard<std::mutex> lock(m_domains_mutex);
+    auto const &dom = id.str();
     auto it = m_domains.find(dom);
     while (it == m_domains.end()) {
         const_cast<Config *>(this)->create_domain(dom);
         it = m_domains.find(dom);
     }
+    cache.domains.emplace(id, (*it).second.get());
     return *(*it).second;
 }
 
@@ -1187,7 +1493,7 @@ std::string Config::dialback_key(std::string const &id, std::string const &local
         hexoutput += ((low < 0x0A) ? '0' : ('a' - 10)) + low;
     }
     assert(hexoutput.length() == 40);
-    m_logger->debug("Dialback key id {} :: {} | {}", id, local_domain, remote_domain);
+    METRE_DEBUG(*m_logger, "Dialback key id {} :: {} | {}", id, local_domain, remote_domain);
     return hexoutput;
 }
 
@@ -1195,37 +1501,68 @@ Config const &Config::config() {
     return *s_config;
 }
 
-void Config::dns_init() const {
+struct ub_ctx *Config::ub_ctx() const {
+    return s_ub_ctx;
+}
+
+void Config::dns_init(bool reload) const {
+    // Trust anchors may have changed. Other workers share the cache, so only on reload.
+    if (reload) clear_dns_cache();
     // Libunbound initialization.
-    const_cast<Config *>(this)->m_ub_ctx = ub_ctx_create();
-    if (!m_ub_ctx) {
+    s_ub_ctx = ub_ctx_create();
+    if (!s_ub_ctx) {
         throw std::runtime_error("Couldn't start resolver");
     }
     int retval;
-    if ((retval = ub_ctx_async(m_ub_ctx, 1)) != 0) {
+    if ((retval = ub_ctx_async(s_ub_ctx, 1)) != 0) {
         throw std::runtime_error(ub_strerror(retval));
     }
-    if ((retval = ub_ctx_resolvconf(m_ub_ctx, NULL)) != 0) {
+    if ((retval = ub_ctx_resolvconf(s_ub_ctx, NULL)) != 0) {
         throw std::runtime_error(ub_strerror(retval));
     }
-    if ((retval = ub_ctx_hosts(m_ub_ctx, NULL)) != 0) {
+    if ((retval = ub_ctx_hosts(s_ub_ctx, NULL)) != 0) {
         throw std::runtime_error(ub_strerror(retval));
     }
     if (!m_dns_keys.empty()) {
-        if ((retval = ub_ctx_add_ta_file(m_ub_ctx, const_cast<char *>(m_dns_keys.c_str()))) != 0) {
+        if ((retval = ub_ctx_add_ta_file(s_ub_ctx, const_cast<char *>(m_dns_keys.c_str()))) != 0) {
             throw std::runtime_error(ub_strerror(retval));
         }
     }
 }
 
 std::shared_ptr<spdlog::logger> Config::logger(std::string const & logger_name) const {
-    auto sinks = m_root_logger->sinks();
-    auto logger = std::make_shared<spdlog::logger>(logger_name, begin(sinks), end(sinks));
-    logger->flush_on(spdlog::level::trace);
-    logger->set_level(spdlog::level::trace);
+    auto const &sinks = m_root_logger->sinks();
+    std::shared_ptr<spdlog::logger> logger;
+    if (m_log_pool) {
+        logger = std::make_shared<spdlog::async_logger>(logger_name, begin(sinks), end(sinks), m_log_pool,
+                                                        spdlog::async_overflow_policy::overrun_oldest);
+    } else {
+        logger = std::make_shared<spdlog::logger>(logger_name, begin(sinks), end(sinks)); // Still loading.
+    }
+    logger->flush_on(spdlog::level::err);
+    logger->set_level(m_log_level);
+    std::lock_guard<std::mutex> l(m_loggers_mutex);
+    m_loggers.emplace_back(logger);
+    if (m_loggers.size() >= m_loggers_prune) {
+        m_loggers.remove_if([](auto const &weak) { return weak.expired(); });
+        m_loggers_prune = std::max<std::size_t>(64, 2 * m_loggers.size());
+    }
     return logger;
 }
 
+void Config::log_level(spdlog::level::level_enum level) const {
+    std::lock_guard<std::mutex> l(m_loggers_mutex);
+    m_log_level = level;
+    m_root_logger->set_level(level);
+    m_loggers.remove_if([level](auto const &weak) {
+        auto logger = weak.lock();
+        if (!logger) return true;
+        logger->set_level(level);
+        return false;
+    });
+    m_loggers_prune = std::max<std::size_t>(64, 2 * m_loggers.size());
+}
+
 /*
  * DNS resolver functions.
  */
@@ -1234,7 +1571,7 @@ namespace {
     // This holds a set of live resolver pointers.
     // If a result comes in for an old one, we can therefore ignore it.
     // Yeah, this is a bit weird.
-    std::unordered_set<Config::Resolver const *> s_resolvers;
+    thread_local std::unordered_set<Config::Resolver const *> s_resolvers;
 
     class UBResult {
         /* Quick guard class. */
@@ -1246,28 +1583,155 @@ namespace {
         ~UBResult() { ub_resolve_free(result); }
     };
 
-    void srv_lookup_done_cb(void *x, int err, struct ub_result *result) {
-        UBResult r{result};
-        METRE_LOG(Log::DEBUG, "DNS result for resolver " << x);
-        auto resolver = reinterpret_cast<Config::Resolver *>(x);
-        if (s_resolvers.find(resolver) == s_resolvers.end()) return;
-        resolver->srv_lookup_done(err, result);
+    /**
+     * Answers are shared by every resolver, on every worker, until their TTL runs out.
+     * Identical queries in flight at the same time are only sent once.
+     */
+    class AnswerCache {
+    public:
+        typedef std::pair<std::string, int> Key;
+        typedef std::function<void(std::shared_ptr<DNS::Answer const> const &)> Callback;
+
+        static AnswerCache &cache() {
+            static AnswerCache s_cache;
+            return s_cache;
+        }
+
+        // Returns true if the caller needs to send the query.
+        bool lookup(Key const &key, Callback &&cb) {
+            std::shared_ptr<DNS::Answer const> answer;
+            {
+                std::lock_guard<std::mutex> l(m_mutex);
+                auto it = m_answers.find(key);
+                if (it != m_answers.end() && it->second.expires > std::chrono::steady_clock::now()) {
+                    answer = it->second.answer;
+                } else {
+                    auto &waiters = m_in_flight[key];
+                    waiters.push_back({Router::worker(), std::move(cb)});
+                    return waiters.size() == 1;
+                }
+            }
+            // Still asynchronous, like a real lookup.
+            Router::defer([answer, cb = std::move(cb)]() {
+                cb(answer);
+            });
+            return false;
+        }
+
+        void complete(Key const &key, std::shared_ptr<DNS::Answer const> const &answer, unsigned ttl) {
+            std::vector<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> l(m_mutex);
+                auto now = std::chrono::steady_clock::now();
+                if (ttl) {
+                    if (m_answers.size() >= max_answers) expire(now);
+                    m_answers[key] = Entry{answer, now + std::chrono::seconds(ttl)};
+                }
+                auto it = m_in_flight.find(key);
+                if (it != m_in_flight.end()) {
+                    waiters = std::move(it->second);
+                    m_in_flight.erase(it);
+                }
+            }
+            for (auto &waiter : waiters) {
+                Router::on_worker(waiter.worker, [answer, cb = std::move(waiter.cb)]() {
+                    cb(answer);
+                });
+            }
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_answers.clear();
+        }
+
+    private:
+        static constexpr std::size_t max_answers = 100000;
+
+        struct Entry {
+            std::shared_ptr<DNS::Answer const> answer;
+            std::chrono::steady_clock::time_point expires;
+        };
+        struct Waiter {
+            unsigned worker;
+            Callback cb;
+        };
+
+        void expire(std::chrono::steady_clock::time_point now) {
+            for (auto it = m_answers.begin(); it != m_answers.end();) {
+                if (it->second.expires <= now) {
+                    it = m_answers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        std::mutex m_mutex;
+        std::map<Key, Entry> m_answers;
+        std::map<Key, std::vector<Waiter>> m_in_flight;
+    };
+
+    // How long to keep an answer; 0 to not cache it at all.
+    unsigned answer_ttl(int err, struct ub_result const *result) {
+        if (err != 0 || result->rcode == 2 /* SERVFAIL */) return 0; // Let the next lookup retry.
+        if (result->bogus) return 60;
+        unsigned ttl = result->ttl > 0 ? static_cast<unsigned>(result->ttl) : 0;
+        if (!result->havedata) return std::min(ttl, 900U); // Negative answers.
+        return std::min(ttl, 86400U);
     }
 
-    void a_lookup_done_cb(void *x, int err, struct ub_result *result) {
-        UBResult r{result};
-        METRE_LOG(Log::DEBUG, "DNS result for resolver " << x);
-        auto resolver = reinterpret_cast<Config::Resolver *>(x);
-        if (s_resolvers.find(resolver) == s_resolvers.end()) return;
-        resolver->a_lookup_done(err, result);
+    struct Lookup {
+        AnswerCache::Key key;
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    };
+
+    std::string rrtype_name(int rrtype) {
+        switch (rrtype) {
+            case 1:
+                return "A";
+            case 28:
+                return "AAAA";
+            case 33:
+                return "SRV";
+            case 52:
+                return "TLSA";
+            default:
+                return std::to_string(rrtype);
+        }
+    }
+
+    void lookup_done_cb(void *x, int err, struct ub_result *result) {
+        std::unique_ptr<Lookup> lookup{reinterpret_cast<Lookup *>(x)};
+        auto key = &lookup->key;
+        METRE_LOG(Log::DEBUG, "DNS result for " << key->first << "/" << key->second);
+        Metrics::histogram("metre_dns_lookup_seconds", "Time taken by DNS lookups, per query type.",
+                           {{"type", rrtype_name(key->second)}}).observe_since(lookup->started);
+        auto answer = std::make_shared<DNS::Answer>();
+        answer->qname = key->first;
+        answer->qtype = key->second;
+        answer->err = err;
+        unsigned ttl = 0;
+        if (result) {
+            UBResult r{result};
+            answer->havedata = !!result->havedata;
+            answer->nxdomain = !!result->nxdomain;
+            answer->secure = !!result->secure;
+            answer->bogus = !!result->bogus;
+            if (result->why_bogus) answer->why_bogus = result->why_bogus;
+            if (result->havedata) {
+                for (int i = 0; result->data[i]; ++i) {
+                    answer->rdata.emplace_back(result->data[i], result->len[i]);
+                }
+            }
+            ttl = answer_ttl(err, result);
+        }
+        answer->expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+        AnswerCache::cache().complete(*key, answer, ttl);
     }
 
-    void tlsa_lookup_done_cb(void *x, int err, struct ub_result *result) {
-        UBResult r{result};
-        METRE_LOG(Log::DEBUG, "DNS result for resolver " << x);
-        auto resolver = reinterpret_cast<Config::Resolver *>(x);
-        if (s_resolvers.find(resolver) == s_resolvers.end()) return;
-        resolver->tlsa_lookup_done(err, result);
+    void clear_dns_cache() {
+        AnswerCache::cache().clear();
     }
 }
 
@@ -1340,34 +1804,37 @@ void Config::Domain::tlsa(std::string const &ahostname, unsigned short port, DNS
 }
 
 Config::Resolver::Resolver(Domain const &d) : m_domain(d) {
-    m_logger = Config::config().logger("resolver <" + d.domain() + ">");
+    m_logger = Config::config().logger("Resolver", {{"domain", d.domain()}});
     METRE_LOG(Log::DEBUG, "New resolver " << this);
     s_resolvers.insert(this);
 }
 
-void Config::Resolver::tlsa_lookup_done(int err, struct ub_result *result) {
+void Config::Resolver::tlsa_lookup_done(DNS::Answer const &result) {
     std::string error;
-    logger().debug("TLSA Response for {}", result->qname);
-    if (err != 0) {
-        error = ub_strerror(err);
-    } else if (!result->havedata) {
+    METRE_DEBUG(logger(), "TLSA Response for {}", result.qname);
+    if (result.err != 0) {
+        error = ub_strerror(result.err);
+    } else if (!result.havedata) {
         error = "No TLSA records present";
-    } else if (result->bogus) {
-        error = std::string("Bogus: ") + result->why_bogus;
-    } else if (!result->secure && m_domain.dnssec_required()) {
+    } else if (result.bogus) {
+        error = std::string("Bogus: ") + result.why_bogus;
+    } else if (!result.secure && m_domain.dnssec_required()) {
         error = "DNSSEC required but unsigned";
     } else {
         DNS::Tlsa tlsa;
-        tlsa.dnssec = !!result->secure;
-        tlsa.domain = result->qname;
-        for (int i = 0; result->data[i]; ++i) {
+        tlsa.dnssec = result.secure;
+        tlsa.domain = result.qname;
+        tlsa.expires = result.expires;
+        for (std::size_t i = 0; i != result.rdata.size(); ++i) {
+            auto const &data = result.rdata[i];
+            if (data.length() < 3) continue;
             DNS::TlsaRR rr;
-            rr.certUsage = static_cast<DNS::TlsaRR::CertUsage>(result->data[i][0]);
-            rr.selector = static_cast<DNS::TlsaRR::Selector>(result->data[i][1]);
-            rr.matchType = static_cast<DNS::TlsaRR::MatchType>(result->data[i][2]);
-            rr.matchData.assign(result->data[i] + 3, result->len[i] - 3);
+            rr.certUsage = static_cast<DNS::TlsaRR::CertUsage>(data[0]);
+            rr.selector = static_cast<DNS::TlsaRR::Selector>(data[1]);
+            rr.matchType = static_cast<DNS::TlsaRR::MatchType>(data[2]);
+            rr.matchData.assign(data, 3);
             tlsa.rrs.push_back(rr);
-            logger().debug("Data[{}]: ({} bytes) {}:{}:{}::{}", i, result->len[i], rr.certUsage, rr.selector,
+            METRE_DEBUG(logger(), "Data[{}]: ({} bytes) {}:{}:{}::{}", i, data.length(), rr.certUsage, rr.selector,
                            rr.matchType, rr.matchData);
         }
         m_tlsa_pending[tlsa.domain].emit(tlsa);
@@ -1376,7 +1843,8 @@ void Config::Resolver::tlsa_lookup_done(int err, struct ub_result *result) {
     logger().info("DNS Error: {}", error);
     DNS::Tlsa tlsa;
     tlsa.error = error;
-    tlsa.domain = result->qname;
+    tlsa.domain = result.qname;
+    tlsa.expires = result.expires;
     m_tlsa_pending[tlsa.domain].emit(tlsa);
 }
 
@@ -1440,20 +1908,21 @@ Config::Domain::srv(std::string const &hostname, unsigned short priority, unsign
     m_srvrec->rrs.push_back(rr);
 }
 
-void Config::Resolver::srv_lookup_done(int err, struct ub_result *result) {
+void Config::Resolver::srv_lookup_done(DNS::Answer const &result) {
     std::string error;
-    if (err != 0) {
-        error = ub_strerror(err);
-    } else if (!result->havedata) {
+    m_current_srv.expires = std::min(m_current_srv.expires, result.expires);
+    if (result.err != 0) {
+        error = ub_strerror(result.err);
+    } else if (!result.havedata) {
         error = "No SRV records present";
-    } else if (result->bogus) {
-        error = std::string("Bogus: ") + result->why_bogus;
-    } else if (!result->secure && m_domain.dnssec_required()) {
+    } else if (result.bogus) {
+        error = std::string("Bogus: ") + result.why_bogus;
+    } else if (!result.secure && m_domain.dnssec_required()) {
         error = "DNSSEC required but unsigned";
     } else {
         bool xmpps = false;
-        m_current_srv.dnssec = m_current_srv.dnssec && !!result->secure;
-        m_current_srv.domain = result->qname;
+        m_current_srv.dnssec = m_current_srv.dnssec && result.secure;
+        m_current_srv.domain = result.qname;
         if (m_current_srv.domain.find("_xmpps") == 0) {
             xmpps = true;
             m_current_srv.xmpps = true;
@@ -1461,18 +1930,25 @@ void Config::Resolver::srv_lookup_done(int err, struct ub_result *result) {
         } else {
             m_current_srv.xmpp = true;
         }
-        for (int i = 0; result->data[i]; ++i) {
+        for (std::size_t i = 0; i != result.rdata.size(); ++i) {
+            auto const &data = result.rdata[i];
+            if (data.length() < 7) continue;
+            auto field = [&data](std::size_t off) {
+                unsigned short v;
+                std::memcpy(&v, data.data() + off, sizeof(v));
+                return ntohs(v);
+            };
             DNS::SrvRR rr;
-            rr.priority = ntohs(*reinterpret_cast<unsigned short *>(result->data[i]));
-            rr.weight = ntohs(*reinterpret_cast<unsigned short *>(result->data[i] + 2));
-            rr.port = ntohs(*reinterpret_cast<unsigned short *>(result->data[i] + 4));
+            rr.priority = field(0);
+            rr.weight = field(2);
+            rr.port = field(4);
             rr.tls = xmpps;
-            for (int x = 6; result->data[i][x]; x += result->data[i][x] + 1) {
-                rr.hostname.append(result->data[i] + x + 1, result->data[i][x]);
+            for (std::size_t x = 6; x < data.length() && data[x]; x += data[x] + 1) {
+                rr.hostname.append(data, x + 1, static_cast<unsigned char>(data[x]));
                 rr.hostname += ".";
             }
             m_current_srv.rrs.push_back(rr);
-            logger().debug("Data[{}]: ({} bytes) [{}:{}:{}::{}]", i, result->len[i], rr.priority, rr.weight,
+            METRE_DEBUG(logger(), "Data[{}]: ({} bytes) [{}:{}:{}::{}]", i, data.length(), rr.priority, rr.weight,
                            rr.port, rr.hostname);
         }
         if (m_current_srv.xmpp && m_current_srv.xmpps) {
@@ -1481,8 +1957,8 @@ void Config::Resolver::srv_lookup_done(int err, struct ub_result *result) {
         }
         return;
     }
-    m_current_srv.domain = result->qname;
-    if (err == 0 && !result->havedata) {
+    m_current_srv.domain = result.qname;
+    if (result.err == 0 && !result.havedata) {
         if (m_current_srv.xmpps || m_current_srv.xmpp) {
             // We have done (precisely) one, so set this flag.
             m_current_srv.nxdomain = true;
@@ -1500,7 +1976,7 @@ void Config::Resolver::srv_lookup_done(int err, struct ub_result *result) {
         if (m_current_srv.rrs.empty()) {
             if (m_current_srv.nxdomain) {
                 // Synthesize an SRV.
-                logger().debug("Synthetic SRV for domain=[{}] error=[{}]", m_current_srv.domain, m_current_srv.error);
+                METRE_DEBUG(logger(), "Synthetic SRV for domain=[{}] error=[{}]", m_current_srv.domain, m_current_srv.error);
                 DNS::SrvRR rr;
                 rr.port = 5269;
                 rr.hostname =
@@ -1512,59 +1988,58 @@ void Config::Resolver::srv_lookup_done(int err, struct ub_result *result) {
         if (m_current_srv.rrs.empty()) {
             DNS::Srv srv;
             srv.error = error;
-            srv.domain = result->qname;
-            srv.dnssec = srv.dnssec && !!result->secure;
+            srv.domain = result.qname;
+            srv.dnssec = srv.dnssec && result.secure;
+            srv.expires = m_current_srv.expires;
             m_srv_pending.emit(srv);
         } else {
             srv_sort(m_current_srv);
-            m_current_srv.dnssec = m_current_srv.dnssec && !!result->secure;
+            m_current_srv.dnssec = m_current_srv.dnssec && result.secure;
             m_srv_pending.emit(m_current_srv);
         }
     }
 }
 
-void Config::Resolver::a_lookup_done(int err, struct ub_result *result) {
-    logger().info("Lookup for [{}] complete.", result->qname);
+void Config::Resolver::a_lookup_done(DNS::Answer const &result) {
+    logger().info("Lookup for [{}] complete.", result.qname);
     std::string error;
-    if (err != 0) {
-        error = ub_strerror(err);
-    } else if (!result->havedata) {
+    if (result.err != 0) {
+        error = ub_strerror(result.err);
+    } else if (!result.havedata) {
         error = "No A records present";
-    } else if (result->bogus) {
-        error = std::string("Bogus: ") + result->why_bogus;
-    } else if (!result->secure && m_domain.dnssec_required()) {
+    } else if (result.bogus) {
+        error = std::string("Bogus: ") + result.why_bogus;
+    } else if (!result.secure && m_domain.dnssec_required()) {
         error = "DNSSEC required but unsigned";
     } else {
-        if (m_current_arec.hostname != result->qname) {
+        if (m_current_arec.hostname != result.qname) {
             m_current_arec.error = "";
-            m_current_arec.dnssec = !!result->secure;
-            m_current_arec.hostname = result->qname;
+            m_current_arec.dnssec = result.secure;
+            m_current_arec.hostname = result.qname;
             m_current_arec.addr.clear();
             m_current_arec.ipv4 = m_current_arec.ipv6 = false;
         } else {
-            m_current_arec.dnssec = m_current_arec.dnssec && !!result->secure;
+            m_current_arec.dnssec = m_current_arec.dnssec && result.secure;
             m_current_arec.error = "";
         }
-        logger().debug("... Success for {}", result->qtype);
-        if (result->qtype == 1) {
+        METRE_DEBUG(logger(), "... Success for {}", result.qtype);
+        if (result.qtype == 1) {
             m_current_arec.ipv4 = true;
-            for (int i = 0; result->data[i]; ++i) {
+            for (auto const &data : result.rdata) {
+                if (data.length() != 4) continue;
                 auto& a = m_current_arec.addr.emplace_back();
                 struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&a);
                 sin->sin_family = AF_INET;
-#ifdef METRE_WINDOWS
-                sin->sin_addr = *reinterpret_cast<struct in_addr *>(result->data[i]);
-#else
-                sin->sin_addr.s_addr = *reinterpret_cast<in_addr_t *>(result->data[i]);
-#endif
+                std::memcpy(&sin->sin_addr, data.data(), 4);
             }
-        } else if (result->qtype == 28) {
+        } else if (result.qtype == 28) {
             m_current_arec.ipv6 = true;
-            for (int i = 0; result->data[i]; ++i) {
+            for (auto const &data : result.rdata) {
+                if (data.length() != 16) continue;
                 auto it = m_current_arec.addr.emplace(m_current_arec.addr.begin());
                 struct sockaddr_in6 *sin = reinterpret_cast<struct sockaddr_in6 *>(&*it);
                 sin->sin6_family = AF_INET6;
-                memcpy(sin->sin6_addr.s6_addr, result->data[i], 16);
+                memcpy(sin->sin6_addr.s6_addr, data.data(), 16);
             }
         }
         if (m_current_arec.ipv4 && m_current_arec.ipv6) {
@@ -1572,15 +2047,15 @@ void Config::Resolver::a_lookup_done(int err, struct ub_result *result) {
         }
         return;
     }
-    logger().error("... Failure for [{}] with [{}]", result->qtype, error);
-    if (m_current_arec.hostname != result->qname) {
+    logger().error("... Failure for [{}] with [{}]", result.qtype, error);
+    if (m_current_arec.hostname != result.qname) {
         m_current_arec.error = error;
-        m_current_arec.dnssec = !!result->secure;
-        m_current_arec.hostname = result->qname;
+        m_current_arec.dnssec = result.secure;
+        m_current_arec.hostname = result.qname;
         m_current_arec.addr.clear();
         m_current_arec.ipv4 = m_current_arec.ipv6 = false;
     }
-    switch (result->qtype) {
+    switch (result.qtype) {
         case 1:
             m_current_arec.ipv4 = true;
             break;
@@ -1596,16 +2071,27 @@ void Config::Resolver::a_lookup_done(int err, struct ub_result *result) {
     }
 }
 
-namespace {
-    int resolve_async(Config::Resolver const *resolver, std::string const &record, int rrtype, ub_callback_type cb) {
-        int retval;
-        int async_id;
-        if ((retval = ub_resolve_async(Config::config().ub_ctx(), const_cast<char *>(record.c_str()), rrtype, 1,
-                                       const_cast<void *>(reinterpret_cast<const void *>(resolver)), cb, &async_id)) <
-            0) {
-            throw std::runtime_error(std::string("While resolving ") + record + ": " + ub_strerror(retval));
-        }
-        return async_id;
+void Config::Resolver::query(std::string const &record, int rrtype, void (Resolver::*done)(DNS::Answer const &)) {
+    AnswerCache::Key key{record, rrtype};
+    bool send = AnswerCache::cache().lookup(key, [this, done](std::shared_ptr<DNS::Answer const> const &answer) {
+        // We may have gone away while waiting.
+        if (s_resolvers.find(this) == s_resolvers.end()) return;
+        (this->*done)(*answer);
+    });
+    if (!send) {
+        METRE_DEBUG(logger(), "DNS query {}/{} answered from cache, or already in flight", record, rrtype);
+        return;
+    }
+    // Not cancelled if we go away; other resolvers may be waiting on it, and the answer's worth caching anyway.
+    auto arg = new Lookup{key};
+    int retval;
+    int async_id;
+    if ((retval = ub_resolve_async(Config::config().ub_ctx(), const_cast<char *>(record.c_str()), rrtype, 1,
+                                   arg, lookup_done_cb, &async_id)) < 0) {
+        // Fail anyone waiting, rather than leave them hanging.
+        Router::defer([arg, retval]() {
+            lookup_done_cb(arg, retval, nullptr);
+        });
     }
 }
 
@@ -1614,14 +2100,14 @@ Config::addr_callback_t &Config::Resolver::AddressLookup(std::string const &ihos
     logger().info("A/AAAA lookup for {}", hostname);
     for (Domain const *override = &m_domain; override; override = override->parent()) {
         if (!override->address_overrides().empty()) {
-            logger().debug("Found overrides at {}", override->domain());
+            METRE_DEBUG(logger(), "Found overrides at {}", override->domain());
             auto it = override->address_overrides().find(hostname);
             if (it != override->address_overrides().end()) {
                 auto addr = it->second.get();
                 Router::defer([addr, this]() {
                     m_a_pending[addr->hostname].emit(*addr);
                 });
-                logger().debug("Using override at {}", override->domain());
+                METRE_DEBUG(logger(), "Using override at {}", override->domain());
                 return m_a_pending[hostname];
             }
         }
@@ -1629,22 +2115,22 @@ Config::addr_callback_t &Config::Resolver::AddressLookup(std::string const &ihos
     m_current_arec.hostname = "";
     m_current_arec.addr.clear();
     m_current_arec.ipv6 = m_current_arec.ipv4 = false;
-    m_queries.insert(resolve_async(this, hostname, 28, a_lookup_done_cb));
-    m_queries.insert(resolve_async(this, hostname, 1, a_lookup_done_cb));
+    query(hostname, 28, &Resolver::a_lookup_done);
+    query(hostname, 1, &Resolver::a_lookup_done);
     return m_a_pending[hostname];
 }
 
 Config::srv_callback_t &Config::Resolver::SrvLookup(std::string const &base_domain) {
     std::string domain = toASCII("_xmpp-server._tcp." + base_domain + ".");
     std::string domains = toASCII("_xmpps-server._tcp." + base_domain + ".");
-    m_logger->debug("SRV lookup: domain=[{}]", base_domain);
+    METRE_DEBUG(*m_logger, "SRV lookup: domain=[{}]", base_domain);
     for (Domain const *override = &m_domain; override; override = override->parent()) {
         if (override->srv_override()) {
-            logger().debug("Found override at {}", override->domain());
+            METRE_DEBUG(logger(), "Found override at {}", override->domain());
             Router::defer([override, this]() {
                 m_srv_pending.emit(*override->srv_override());
             });
-            logger().debug("Using override at {}", override->domain());
+            METRE_DEBUG(logger(), "Using override at {}", override->domain());
             return m_srv_pending;
         }
     }
@@ -1665,8 +2151,9 @@ Config::srv_callback_t &Config::Resolver::SrvLookup(std::string const &base_doma
         m_current_srv.rrs.clear();
         m_current_srv.dnssec = true;
         m_current_srv.error.clear();
-        m_queries.insert(resolve_async(this, domain, 33, srv_lookup_done_cb));
-        m_queries.insert(resolve_async(this, domains, 33, srv_lookup_done_cb));
+        m_current_srv.expires = std::chrono::steady_clock::time_point::max();
+        query(domain, 33, &Resolver::srv_lookup_done);
+        query(domains, 33, &Resolver::srv_lookup_done);
     }
     return m_srv_pending;
 }
@@ -1678,14 +2165,14 @@ Config::tlsa_callback_t &Config::Resolver::TlsaLookup(unsigned short port, std::
     logger().info("TLSA lookup for domain=[{}]", domain);
     for (Domain const *override = &m_domain; override; override = override->parent()) {
         if (!override->tlsa_overrides().empty()) {
-            logger().debug("Found overrides at {}", override->domain());
+            METRE_DEBUG(logger(), "Found overrides at {}", override->domain());
             auto it = override->tlsa_overrides().find(domain);
             if (it != override->tlsa_overrides().end()) {
                 auto addr = it->second.get();
                 Router::defer([addr, this]() {
                     m_tlsa_pending[addr->domain].emit(*addr);
                 });
-                logger().debug("Using override at [{}]", override->domain());
+                METRE_DEBUG(logger(), "Using override at [{}]", override->domain());
                 return m_tlsa_pending[domain];
             }
         }
@@ -1698,17 +2185,14 @@ Config::tlsa_callback_t &Config::Resolver::TlsaLookup(unsigned short port, std::
             cb.emit(r);
         });
     } else {
-        m_queries.insert(resolve_async(this, domain, 52, tlsa_lookup_done_cb));
+        query(domain, 52, &Resolver::tlsa_lookup_done);
     }
     return m_tlsa_pending[domain];
 }
 
 Config::Resolver::~Resolver() {
-    logger().debug("Shutting down...");
-    for (auto async_id : m_queries) {
-        ub_cancel(Config::config().ub_ctx(), async_id);
-    }
+    METRE_DEBUG(logger(), "Shutting down...");
     s_resolvers.erase(this);
-    logger().debug("Done.");
+    METRE_DEBUG(logger(), "Done.");
     METRE_LOG(Log::DEBUG, "Deleted resolver " << this);
 }
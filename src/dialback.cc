@@ -103,7 +103,7 @@ namespace {
             /*
              * This is a request to authenticate, using the current key.
              */
-            Config::Domain const &from_domain = Config::config().domain(result.from().domain());
+            Config::Domain const &from_domain = Config::config().domain(result.from().domain_id());
             if (from_domain.transport_type() == INTERNAL || from_domain.transport_type() == COMP) {
                 std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(result.from(), result.to(),
                                                                          Stanza::not_acceptable);
@@ -111,7 +111,7 @@ namespace {
                 co_return true;
             }
             m_stream.check_domain_pair(result.from().domain(), result.to().domain());
-            if (!m_stream.secured() && Config::config().domain(result.to().domain()).require_tls()) {
+            if (!m_stream.secured() && Config::config().domain(result.to().domain_id()).require_tls()) {
                 std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(result.from(), result.to(),
                                                                          Stanza::policy_violation);
                 m_stream.send(std::move(d));
@@ -142,68 +142,89 @@ namespace {
         }
 
         void result_valid(DB::Result const &result) {
-            if (m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND) >=
+            if (m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND) >=
                 XMLStream::REQUESTED) {
-                m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND, XMLStream::AUTHORIZED);
+                m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND, XMLStream::AUTHORIZED);
             }
         }
 
         void result_invalid(DB::Result const &result) {
-            if (m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND) ==
+            if (m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND) ==
                 XMLStream::REQUESTED) {
-                m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND, XMLStream::NONE);
+                m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND, XMLStream::NONE);
             }
             // Risky, here - the remote server might close the stream on us.
         }
 
         void result_error(DB::Result const &result) {
-            if (m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND) ==
+            if (m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND) ==
                 XMLStream::REQUESTED) {
-                m_stream.s2s_auth_pair(result.to().domain(), result.from().domain(), OUTBOUND, XMLStream::NONE);
+                m_stream.s2s_auth_pair(result.to().domain_id(), result.from().domain_id(), OUTBOUND, XMLStream::NONE);
             }
         }
 
+        /*
+         * The sessions named by stream id may belong to another worker thread, so
+         * these look at them from there.
+         */
         void verify(DB::Verify const &v) {
-            std::shared_ptr<NetSession> session = Router::session_by_stream_id(*v.id());
-            DB::Type validity = DB::INVALID;
-            m_stream.logger().debug("Handling db:verify");
-            if (session) {
-                m_stream.logger().debug("Verify [NS{}] session found.", session->serial());
-                if (session->xml_stream().s2s_auth_pair(v.to().domain(), v.from().domain(), OUTBOUND) >=
-                    XMLStream::REQUESTED) {
-                    m_stream.logger().debug("Verify [NS{}] Auth State is correct.", session->serial());
-                    std::string expected = Config::config().dialback_key(*v.id(), v.to().domain(), v.from().domain());
-                    if (v.key() == expected) validity = DB::VALID;
+            METRE_DEBUG(m_stream.logger(), "Handling db:verify");
+            Jid from{v.from()};
+            Jid to{v.to()};
+            std::string id{*v.id()};
+            std::string key{v.key()};
+            auto worker = m_stream.session().worker();
+            auto serial = m_stream.session().serial();
+            Router::with_stream_id(id, [=](std::shared_ptr<NetSession> const &session) {
+                DB::Type validity = DB::INVALID;
+                if (session) {
+                    METRE_DEBUG(session->xml_stream().logger(), "Verify [NS{}] session found.", session->serial());
+                    if (session->xml_stream().s2s_auth_pair(to.domain_id(), from.domain_id(), OUTBOUND) >=
+                        XMLStream::REQUESTED) {
+                        METRE_DEBUG(session->xml_stream().logger(), "Verify [NS{}] Auth State is correct.", session->serial());
+                        std::string expected = Config::config().dialback_key(id, to.domain(), from.domain());
+                        if (key == expected) validity = DB::VALID;
+                    }
                 }
-            }
-            std::unique_ptr<Stanza> d = std::make_unique<DB::Verify>(v.from(), v.to(), *v.id(), validity);
-            m_stream.send(std::move(d));
+                Router::on_worker(worker, [=]() {
+                    auto self = Router::session_by_serial(serial);
+                    if (!self) return;
+                    std::unique_ptr<Stanza> d = std::make_unique<DB::Verify>(from, to, id, validity);
+                    self->xml_stream().send(std::move(d));
+                });
+            });
         }
 
         void verify_valid(DB::Verify const &v) {
             if (m_stream.direction() != OUTBOUND)
                 throw Metre::unsupported_stanza_type("db:verify response on inbound stream");
-            std::shared_ptr<NetSession> session = Router::session_by_stream_id(*v.id());
-            if (!session) return; // Silently ignore this.
-            XMLStream &stream = session->xml_stream();
-            if (stream.s2s_auth_pair(v.to().domain(), v.from().domain(), INBOUND) == XMLStream::REQUESTED) {
-                std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(v.from(), v.to(), DB::VALID);
-                stream.send(std::move(d));
-                stream.s2s_auth_pair(v.to().domain(), v.from().domain(), INBOUND, XMLStream::AUTHORIZED);
-            }
+            Jid from{v.from()};
+            Jid to{v.to()};
+            Router::with_stream_id(*v.id(), [=](std::shared_ptr<NetSession> const &session) {
+                if (!session) return; // Silently ignore this.
+                XMLStream &stream = session->xml_stream();
+                if (stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND) == XMLStream::REQUESTED) {
+                    std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(from, to, DB::VALID);
+                    stream.send(std::move(d));
+                    stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND, XMLStream::AUTHORIZED);
+                }
+            });
         }
 
         void verify_invalid(DB::Verify const &v) {
             if (m_stream.direction() != OUTBOUND)
                 throw Metre::unsupported_stanza_type("db:verify response on inbound stream");
-            std::shared_ptr<NetSession> session = Router::session_by_stream_id(*v.id());
-            if (!session) return; // Silently ignore this.
-            XMLStream &stream = session->xml_stream();
-            if (stream.s2s_auth_pair(v.to().domain(), v.from().domain(), INBOUND) == XMLStream::REQUESTED) {
-                std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(v.from(), v.to(), Stanza::forbidden);
-                stream.send(std::move(d));
-                stream.s2s_auth_pair(v.to().domain(), v.from().domain(), INBOUND, XMLStream::NONE);
-            }
+            Jid from{v.from()};
+            Jid to{v.to()};
+            Router::with_stream_id(*v.id(), [=](std::shared_ptr<NetSession> const &session) {
+                if (!session) return; // Silently ignore this.
+                XMLStream &stream = session->xml_stream();
+                if (stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND) == XMLStream::REQUESTED) {
+                    std::unique_ptr<Stanza> d = std::make_unique<DB::Result>(from, to, Stanza::forbidden);
+                    stream.send(std::move(d));
+                    stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND, XMLStream::NONE);
+                }
+            });
         }
 
         sigslot::tasklet<bool> handle(rapidxml::xml_node<> *node) override {
@@ -0,0 +1,67 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "domainid.h"
+#include <deque>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+
+using namespace Metre;
+
+namespace {
+    // Entries are never removed, and a deque doesn't move its elements on growth,
+    // so the index can hold views of the stored names.
+    struct Names {
+        std::shared_mutex mutex;
+        std::deque<std::string> storage;
+        std::unordered_map<std::string_view, std::string const *> index;
+    };
+
+    Names &names() {
+        static Names n;
+        return n;
+    }
+}
+
+std::string const *DomainId::intern(std::string_view name) {
+    auto &n = names();
+    {
+        std::shared_lock<std::shared_mutex> lock(n.mutex);
+        auto it = n.index.find(name);
+        if (it != n.index.end()) return (*it).second;
+    }
+    std::unique_lock<std::shared_mutex> lock(n.mutex);
+    auto it = n.index.find(name);
+    if (it != n.index.end()) return (*it).second;
+    auto const &stored = n.storage.emplace_back(name);
+    n.index.emplace(stored, &stored);
+    return &stored;
+}
+
+DomainId::DomainId() {
+    static std::string const *empty = intern("");
+    m_name = empty;
+}
@@ -28,6 +28,7 @@ SOFTWARE.
 #include <rapidxml.hpp>
 #include <router.h>
 #include <log.h>
+#include <mutex>
 
 using namespace Metre;
 using namespace rapidxml;
@@ -54,14 +55,18 @@ namespace {
                     if (disco) { // It's a disco#info request.
                         auto node = disco->first_attribute("node");
                         if (!node) return PASS;
-                        auto it = caps_cache().find(std::string{node->value(), node->value_size()});
-                        if (it != caps_cache().end()) {
-                            std::unique_ptr<Stanza> response(new Iq(iq.to(), iq.from(), Iq::RESULT, iq.id()));
-                            response->payload((*it).second);
-                            auto route = RouteTable::routeTable(iq.from()).route(iq.to());
-                            route->transmit(std::move(response));
-                            return DROP;
+                        std::string cached;
+                        {
+                            std::lock_guard<std::mutex> lock(caps_mutex());
+                            auto it = caps_cache().find(std::string{node->value(), node->value_size()});
+                            if (it == caps_cache().end()) return PASS;
+                            cached = (*it).second;
                         }
+                        std::unique_ptr<Stanza> response(new Iq(iq.to(), iq.from(), Iq::RESULT, iq.id()));
+                        response->payload(cached);
+                        auto route = RouteTable::routeTable(iq.from()).route(iq.to());
+                        route->transmit(std::move(response));
+                        return DROP;
                     }
                 } else if (iq.type() == Iq::SET) {
                     auto disco = iq.node()->first_node("query", "http://jabber.org/protocol/disco#info");
@@ -80,7 +85,10 @@ namespace {
                         }
                         if (client) {
                             std::string nodestr{node->value(), node->value_size()};
-                            caps_cache()[nodestr] = std::string{disco->contents(), disco->contents_size()};
+                            {
+                                std::lock_guard<std::mutex> lock(caps_mutex());
+                                caps_cache()[nodestr] = std::string{disco->contents(), disco->contents_size()};
+                            }
                             METRE_LOG(Log::INFO, "Cached disco#info for " << nodestr);
                         }
                     }
@@ -94,6 +102,11 @@ namespace {
             static std::map<std::string, std::string> s_caps;
             return s_caps;
         }  // For responding to disco requests.
+
+        static std::mutex &caps_mutex() {
+            static std::mutex s_mutex; // Shared by all worker threads.
+            return s_mutex;
+        }
     };
 
     bool something = Filter::declare<DiscoCache>("disco-cache");
@@ -41,7 +41,7 @@ using namespace rapidxml;
 
 namespace {
     UConverter *utf8() {
-        static UConverter *c = 0;
+        thread_local UConverter *c = 0; // Converters aren't thread-safe.
         UErrorCode error = U_ZERO_ERROR;
         if (!c) c = ucnv_open("utf-8", &error);
         return c;
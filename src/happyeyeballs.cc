@@ -0,0 +1,94 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "happyeyeballs.h"
+
+using namespace Metre;
+
+HappyEyeballs::HappyEyeballs(std::chrono::milliseconds delay, std::function<bool(std::size_t)> &&start,
+                             std::function<void()> &&exhausted)
+        : m_delay(delay), m_start(std::move(start)), m_exhausted(std::move(exhausted)) {}
+
+HappyEyeballs::~HappyEyeballs() {
+    stop();
+}
+
+void HappyEyeballs::add(std::size_t n) {
+    m_candidates += n;
+    kick();
+}
+
+void HappyEyeballs::resolved() {
+    m_resolved = true;
+    kick();
+}
+
+void HappyEyeballs::failed() {
+    if (m_in_flight) --m_in_flight;
+    if (!m_stopped && m_in_flight == 0) attempt();
+}
+
+void HappyEyeballs::stop() {
+    m_stopped = true;
+    if (m_timer) {
+        Router::cancel(m_timer);
+        m_timer = 0;
+    }
+}
+
+// New candidates, or the end of them. If the stagger timer has already run out, an
+// attempt still in flight mustn't hold up the next candidate until it times out.
+void HappyEyeballs::kick() {
+    if (m_stopped || m_timer) return;
+    if (m_in_flight == 0) {
+        attempt();
+    } else if (m_next != m_candidates) {
+        arm();
+    }
+}
+
+void HappyEyeballs::arm() {
+    m_timer = Router::defer([this]() {
+        m_timer = 0;
+        attempt();
+    }, m_delay);
+}
+
+void HappyEyeballs::attempt() {
+    if (m_timer) {
+        Router::cancel(m_timer);
+        m_timer = 0;
+    }
+    while (!m_stopped && m_next != m_candidates) {
+        if (!m_start(m_next++)) continue;
+        ++m_in_flight;
+        if (!m_stopped && m_next != m_candidates) arm();
+        return;
+    }
+    if (!m_stopped && m_resolved && m_in_flight == 0) {
+        m_stopped = true;
+        m_exhausted();
+    }
+}
@@ -4,17 +4,171 @@
 
 #include <http.h>
 #include <router.h>
+#include <config.h>
 #include <evhttp.h>
 #include <event2/bufferevent_ssl.h>
 #include <log.h>
 #include <openssl/ossl_typ.h>
 #include <openssl/x509.h>
 #include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
 
 using namespace Metre;
 
 namespace Metre {
-    Http * s_http = 0;
+    thread_local Http * s_http = 0; // One per worker thread, as requests are tied to its event_base.
+}
+
+namespace {
+    const std::chrono::seconds crl_refresh_interval{300};
+    const std::chrono::seconds crl_refresh_margin{3600}; // Refetch this long before nextUpdate.
+
+    /**
+     * CRLs by distribution point URI, shared by every worker. Also indexes the fetches
+     * in flight, along with the workers waiting on each.
+     */
+    class CrlStore {
+    public:
+        ~CrlStore() {
+            for (auto &entry : m_crls) X509_CRL_free(entry.second);
+        }
+
+        // A new reference to the CRL if it's current, or nullptr.
+        X509_CRL *get(std::string const &uri) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_crls.find(uri);
+            if (it == m_crls.end()) return nullptr;
+            auto next = X509_CRL_get0_nextUpdate(it->second);
+            if (next && X509_cmp_current_time(next) <= 0) return nullptr;
+            X509_CRL_up_ref(it->second);
+            return it->second;
+        }
+
+        // Takes ownership.
+        void put(std::string const &uri, X509_CRL *crl) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto &slot = m_crls[uri];
+            if (slot) X509_CRL_free(slot);
+            slot = crl;
+        }
+
+        // Returns true if there was no fetch in flight, and so the caller should start one.
+        bool wait(std::string const &uri, std::optional<unsigned> worker) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_in_flight.find(uri);
+            bool first = (it == m_in_flight.end());
+            if (first) it = m_in_flight.emplace(uri, std::set<unsigned>()).first;
+            if (worker) it->second.insert(*worker);
+            return first;
+        }
+
+        std::set<unsigned> complete(std::string const &uri) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            std::set<unsigned> waiters;
+            auto it = m_in_flight.find(uri);
+            if (it != m_in_flight.end()) {
+                waiters = std::move(it->second);
+                m_in_flight.erase(it);
+            }
+            return waiters;
+        }
+
+        // CRLs with nextUpdate within the margin, or already past.
+        std::vector<std::string> due(std::chrono::seconds margin) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            std::vector<std::string> uris;
+            time_t when = time(nullptr) + margin.count();
+            for (auto const &entry : m_crls) {
+                auto next = X509_CRL_get0_nextUpdate(entry.second);
+                if (next && X509_cmp_time(next, &when) <= 0) uris.push_back(entry.first);
+            }
+            return uris;
+        }
+
+        static CrlStore &store() {
+            static CrlStore s_store;
+            return s_store;
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::map<std::string, X509_CRL *> m_crls;
+        std::map<std::string, std::set<unsigned>> m_in_flight;
+    };
+
+    std::filesystem::path crl_dir() {
+        return std::filesystem::path(Config::config().data_dir()) / "crls";
+    }
+
+    // Files are named by the SHA-256 of the URI; the URI itself is kept alongside.
+    std::filesystem::path crl_path(std::string const &uri) {
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char *>(uri.data()), uri.size(), md);
+        static const char hex[] = "0123456789abcdef";
+        std::string name;
+        for (auto c : md) {
+            name += hex[c >> 4];
+            name += hex[c & 0xF];
+        }
+        return crl_dir() / name;
+    }
+
+    void crl_save(std::string const &uri, const unsigned char *der, std::size_t len) {
+        auto path = crl_path(uri);
+        try {
+            std::filesystem::create_directories(crl_dir());
+            auto tmp = path;
+            tmp += ".tmp";
+            {
+                std::ofstream out(tmp, std::ios_base::binary | std::ios_base::trunc);
+                out.write(reinterpret_cast<const char *>(der), static_cast<std::streamsize>(len));
+                if (!out) throw std::runtime_error("Write failed");
+            }
+            std::filesystem::rename(tmp, path.string() + ".der");
+            std::ofstream(path.string() + ".uri", std::ios_base::trunc) << uri;
+        } catch (std::exception &e) {
+            METRE_LOG(Log::WARNING, "Cannot save CRL for " << uri << ": " << e.what());
+        }
+    }
+
+    void crl_load() {
+        std::error_code ec;
+        for (auto const &entry : std::filesystem::directory_iterator(crl_dir(), ec)) {
+            if (entry.path().extension() != ".uri") continue;
+            std::string uri;
+            std::getline(std::ifstream(entry.path()), uri);
+            auto der_path = entry.path();
+            der_path.replace_extension(".der");
+            std::ifstream in(der_path, std::ios_base::binary);
+            std::string der{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+            auto p = reinterpret_cast<const unsigned char *>(der.data());
+            X509_CRL *crl = d2i_X509_CRL(nullptr, &p, static_cast<long>(der.size()));
+            if (uri.empty() || !crl) {
+                ERR_clear_error();
+                METRE_LOG(Log::WARNING, "Discarding unreadable CRL " << entry.path());
+                continue;
+            }
+            METRE_LOG(Log::INFO, "Loaded CRL for " << uri);
+            CrlStore::store().put(uri, crl);
+        }
+    }
+
+    // For HTTPS distribution points. The CRL is signed, so the transport needn't be authenticated.
+    SSL_CTX *client_ctx() {
+        static SSL_CTX *ctx = nullptr;
+        if (!ctx) {
+            ctx = SSL_CTX_new(TLS_client_method());
+            SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+        }
+        return ctx;
+    }
 }
 
 Http & Http::http() {
@@ -22,6 +176,86 @@ Http & Http::http() {
     return *s_http;
 }
 
+void Http::init() {
+    crl_load();
+    Router::defer([]() {
+        Http::http().refresh_crls();
+    });
+}
+
+void Http::refresh_crls() {
+    for (auto const &uri : CrlStore::store().due(crl_refresh_margin)) {
+        if (CrlStore::store().wait(uri, std::nullopt)) {
+            METRE_LOG(Log::INFO, "Refreshing CRL " << uri);
+            fetch_crl(uri);
+        }
+    }
+    Router::defer([]() {
+        Http::http().refresh_crls();
+    }, crl_refresh_interval);
+}
+
+struct evhttp_connection *Http::connection(std::string const &uri, std::string &target, std::string &host) {
+    std::unique_ptr<struct evhttp_uri, decltype(&evhttp_uri_free)> parsed{evhttp_uri_parse(uri.c_str()), &evhttp_uri_free};
+    if (!parsed) {
+        throw std::runtime_error("Cannot parse URI " + uri);
+    }
+    if (!evhttp_uri_get_scheme(parsed.get())) {
+        throw std::runtime_error("Cannot locate scheme in " + uri);
+    }
+    std::string scheme = evhttp_uri_get_scheme(parsed.get());
+    bool ssl = false;
+    if (scheme == "https") {
+        ssl = true;
+    } else if (scheme != "http") {
+        throw std::runtime_error("Unknown scheme in " + uri);
+    }
+    if (!evhttp_uri_get_host(parsed.get())) throw std::runtime_error("Cannot locate host in " + uri);
+    host = evhttp_uri_get_host(parsed.get());
+    int port = evhttp_uri_get_port(parsed.get());
+    if (port < 0) port = (ssl ? 443 : 80);
+    target = evhttp_uri_get_path(parsed.get()) && *evhttp_uri_get_path(parsed.get()) ? evhttp_uri_get_path(parsed.get()) : "/";
+    if (evhttp_uri_get_query(parsed.get())) {
+        target += "?";
+        target += evhttp_uri_get_query(parsed.get());
+    }
+    std::string key = scheme + "://" + host + ":" + std::to_string(port);
+    auto it = m_connections.find(key);
+    if (it != m_connections.end()) return it->second;
+    struct evhttp_connection *evcon = nullptr;
+    if (ssl) {
+        SSL *s = SSL_new(client_ctx());
+        SSL_set_tlsext_host_name(s, host.c_str());
+        auto bev = bufferevent_openssl_socket_new(Router::event_base(), -1, s, BUFFEREVENT_SSL_CONNECTING,
+                                                  BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+        if (!bev) throw std::runtime_error("Cannot create TLS connection for " + uri);
+        evcon = evhttp_connection_base_bufferevent_new(Router::event_base(), nullptr, bev, host.c_str(),
+                                                       static_cast<unsigned short>(port));
+        // The TLS state can't be reused once the connection drops; make a fresh one next time.
+        if (evcon) evhttp_connection_set_closecb(evcon, Http::s_connection_closed, this);
+    } else {
+        evcon = evhttp_connection_base_new(Router::event_base(), nullptr, host.c_str(), static_cast<unsigned short>(port));
+    }
+    if (!evcon) throw std::runtime_error("Cannot create connection for " + uri);
+    evhttp_connection_set_timeout(evcon, 10); // seconds
+    evhttp_connection_set_retries(evcon, 2);
+    m_connections[key] = evcon;
+    return evcon;
+}
+
+void Http::s_connection_closed(struct evhttp_connection *evcon, void *arg) {
+    auto http = reinterpret_cast<Http *>(arg);
+    for (auto it = http->m_connections.begin(); it != http->m_connections.end(); ++it) {
+        if (it->second == evcon) {
+            http->m_connections.erase(it);
+            Router::defer([evcon]() {
+                evhttp_connection_free(evcon);
+            });
+            break;
+        }
+    }
+}
+
 Http::crl_callback_t &Http::crl(std::string const &uri) {
     return Http::http().do_crl(uri);
 }
@@ -37,100 +271,154 @@ void Http::done_crl(struct evhttp_request *req, std::uintptr_t key) {
         METRE_LOG(Metre::Log::ERR, "Unable to locate request key");
         return;
     }
-    std::string const & uri = iter->second;
+    std::string uri = std::move(iter->second);
+    m_requests.erase(iter);
     int response = (req ? evhttp_request_get_response_code(req) : 500);
     METRE_LOG(Log::INFO, "HTTP GET for " << uri << " returned " << response);
     if ((response / 100) == 2) {
         auto buffer = evhttp_request_get_input_buffer(req);
         auto len = evbuffer_get_length(buffer);
         auto buf = evbuffer_pullup(buffer, len);
-        X509_CRL *data = d2i_X509_CRL(nullptr, const_cast<const unsigned char **>(&buf), len);
+        auto p = const_cast<const unsigned char *>(buf);
+        X509_CRL *data = d2i_X509_CRL(nullptr, &p, len);
+        METRE_LOG(Log::INFO, " - Got " << len << " bytes");
         if (data) {
-            m_crl_cache[uri] = data;
-            m_crl_waiting[uri].emit(uri, 200, data);
-            m_crl_waiting[uri].disconnect_all();
+            crl_save(uri, buf, len);
+            CrlStore::store().put(uri, data);
+            finish_crl(uri, 200, data);
         } else {
             while (unsigned long ssl_err = ERR_get_error()) {
                 char error_buf[1024];
                 METRE_LOG(Metre::Log::DEBUG, " :: " << ERR_error_string(ssl_err, error_buf));
             }
-            m_crl_waiting[uri].emit(uri, 400, nullptr);
-            m_crl_waiting[uri].disconnect_all();
+            finish_crl(uri, 400, nullptr);
         }
-        METRE_LOG(Log::INFO, " - Got " << len << " bytes");
     } else {
-        m_crl_waiting[uri].emit(uri, response, nullptr);
-        m_crl_waiting[uri].disconnect_all();
+        finish_crl(uri, response, nullptr);
     }
-    m_requests.erase(key);
 }
 
-Http::crl_callback_t &Http::do_crl(std::string const &urix) {
-    std::string uri{urix}; // Destructively parsed
-    // Step one: Look in cache.
-    auto iter = m_crl_cache.find(uri);
-    if (iter != m_crl_cache.end() && iter->second) {
-        auto data = iter->second;
-        auto nextupdate = X509_CRL_get0_nextUpdate(data);
-        int day, sec;
-        ASN1_TIME_diff(&day, &sec, nullptr, nextupdate);
-        if (day > 0) {
-            // nextUpdate is today sometime - refetch.,
-            Router::defer([data, uri, this]() {
-                m_crl_waiting[uri].emit(uri, 200, data);
-                m_crl_waiting[uri].disconnect_all();
-            });
-            return m_crl_waiting[uri];
-        }
-    }
-    // Step two: Are we fetching this already?
-    for (auto const &k : m_requests) {
-        if (k.second == uri) {
-            return m_crl_waiting[uri];
-        }
+void Http::finish_crl(std::string const &uri, int code, X509_CRL *crl) {
+    for (auto worker : CrlStore::store().complete(uri)) {
+        if (crl) X509_CRL_up_ref(crl);
+        Router::on_worker(worker, [uri, code, crl]() {
+            Http::http().notify_crl(uri, code, crl);
+            if (crl) X509_CRL_free(crl);
+        });
     }
-    // Step three: Actually issue a new HTTP request:
+}
+
+void Http::notify_crl(std::string const &uri, int code, X509_CRL *crl) {
+    auto it = m_crl_waiting.find(uri);
+    if (it == m_crl_waiting.end()) return;
+    it->second.emit(uri, code, crl);
+    it->second.disconnect_all();
+}
+
+void Http::fetch_crl(std::string const &uri) {
     try {
-        auto parsed = evhttp_uri_parse(uri.c_str());
-        if (!parsed) {
-            throw std::runtime_error("Cannot parse URI " + uri);
-        }
-        if (!evhttp_uri_get_scheme(parsed)) {
-            throw std::runtime_error("Cannot locate scheme in " + uri);
-        }
-        std::string scheme = evhttp_uri_get_scheme(parsed);
-        bool ssl = false;
-        if (scheme == "https") {
-            ssl = true;
-        } else if (scheme != "http") {
-            throw std::runtime_error("Unknown scheme in " + uri);
-        }
-        if (!evhttp_uri_get_host(parsed)) throw std::runtime_error("Cannot locate host in " + uri);
-        std::string host = evhttp_uri_get_host(parsed);
-        int port = evhttp_uri_get_port(parsed);
-        if (port < 0) port = (ssl ? 443 : 80);
-        // TODO https support
-        if (ssl) throw std::runtime_error("Cannot do HTTPS quite yet for " + uri);
-        auto evcon = evhttp_connection_base_new(Router::event_base(), nullptr, host.c_str(), port);
-        // TODO config
-        //evhttp_connection_set_retries(evcon, 3);
-        //evhttp_connection_set_timeout(evcon, 5); // seconds
-        m_requests[++m_req] = uri;
-        auto request = evhttp_request_new(Http::s_done_crl, reinterpret_cast<void *>(m_req));
+        std::string target, host;
+        auto evcon = connection(uri, target, host);
+        auto key = ++m_req;
+        auto request = evhttp_request_new(Http::s_done_crl, reinterpret_cast<void *>(key));
         if (!request) {
             throw std::runtime_error("evhttp couldn't create for " + uri);
         }
-        auto res = evhttp_make_request(evcon, request, EVHTTP_REQ_GET, uri.c_str());
-        if (res != 0) {
+        evhttp_add_header(evhttp_request_get_output_headers(request), "Host", host.c_str());
+        m_requests[key] = uri;
+        if (evhttp_make_request(evcon, request, EVHTTP_REQ_GET, target.c_str()) != 0) {
+            m_requests.erase(key);
             throw std::runtime_error("evhttp failed for " + uri);
         }
         METRE_LOG(Log::INFO, "Performing HTTP GET for " << uri);
-    } catch(std::runtime_error & e) {
+    } catch (std::runtime_error &e) {
         METRE_LOG(Log::INFO, "HTTP GET for " << uri << " failed, " << e.what());
-        Router::defer([uri,this]() {
-            m_crl_waiting[uri].emit(uri, 500, nullptr);
-            m_crl_waiting[uri].disconnect_all();
+        finish_crl(uri, 500, nullptr);
+    }
+}
+
+Http::crl_callback_t &Http::do_crl(std::string const &uri) {
+    auto &waiting = m_crl_waiting[uri];
+    // Step one: Look in cache.
+    X509_CRL *data = CrlStore::store().get(uri);
+    if (data) {
+        Router::defer([data, uri, this]() {
+            notify_crl(uri, 200, data);
+            X509_CRL_free(data);
+        });
+        return waiting;
+    }
+    // Step two: Join any fetch in progress, or start one on the first worker.
+    if (CrlStore::store().wait(uri, Router::worker())) {
+        Router::on_worker(0, [uri]() {
+            Http::http().fetch_crl(uri);
+        });
+    }
+    return waiting;
+}
+
+Http::ocsp_callback_t &Http::ocsp(std::string const &uri, std::string const &request) {
+    return Http::http().do_ocsp(uri, request);
+}
+
+void Http::s_done_ocsp(struct evhttp_request *req, void *arg) {
+    auto key = reinterpret_cast<std::uintptr_t>(arg);
+    Http::http().done_ocsp(req, key);
+}
+
+void Http::done_ocsp(struct evhttp_request *req, std::uintptr_t key) {
+    auto iter = m_ocsp_requests.find(key);
+    if (iter == m_ocsp_requests.end()) {
+        METRE_LOG(Metre::Log::ERR, "Unable to locate request key");
+        return;
+    }
+    std::string waiting_key = std::move(iter->second);
+    m_ocsp_requests.erase(iter);
+    m_ocsp_pending.erase(waiting_key);
+    std::string uri = waiting_key.substr(0, waiting_key.find('\0'));
+    int response = (req ? evhttp_request_get_response_code(req) : 500);
+    METRE_LOG(Log::INFO, "HTTP POST for " << uri << " returned " << response);
+    std::string body;
+    if ((response / 100) == 2) {
+        auto buffer = evhttp_request_get_input_buffer(req);
+        auto len = evbuffer_get_length(buffer);
+        body.assign(reinterpret_cast<char *>(evbuffer_pullup(buffer, len)), len);
+    }
+    auto &waiting = m_ocsp_waiting[waiting_key];
+    waiting.emit(uri, response, body);
+    waiting.disconnect_all();
+}
+
+Http::ocsp_callback_t &Http::do_ocsp(std::string const &uri, std::string const &body) {
+    std::string waiting_key = uri + '\0' + body;
+    auto &waiting = m_ocsp_waiting[waiting_key];
+    if (!m_ocsp_pending.insert(waiting_key).second) return waiting; // Already asked.
+    try {
+        std::string target, host;
+        auto evcon = connection(uri, target, host);
+        auto key = ++m_req;
+        auto request = evhttp_request_new(Http::s_done_ocsp, reinterpret_cast<void *>(key));
+        if (!request) {
+            throw std::runtime_error("evhttp couldn't create for " + uri);
+        }
+        auto headers = evhttp_request_get_output_headers(request);
+        evhttp_add_header(headers, "Host", host.c_str());
+        evhttp_add_header(headers, "Content-Type", "application/ocsp-request");
+        evbuffer_add(evhttp_request_get_output_buffer(request), body.data(), body.size());
+        m_ocsp_requests[key] = waiting_key;
+        if (evhttp_make_request(evcon, request, EVHTTP_REQ_POST, target.c_str()) != 0) {
+            m_ocsp_requests.erase(key);
+            throw std::runtime_error("evhttp failed for " + uri);
+        }
+        METRE_LOG(Log::INFO, "Performing HTTP POST for " << uri);
+    } catch (std::runtime_error &e) {
+        METRE_LOG(Log::INFO, "HTTP POST for " << uri << " failed, " << e.what());
+        m_ocsp_pending.erase(waiting_key);
+        Router::defer([uri, waiting_key, this]() {
+            auto &waiting = m_ocsp_waiting[waiting_key];
+            waiting.emit(uri, 500, std::string());
+            waiting.disconnect_all();
         });
     }
-    return m_crl_waiting[uri];
+    return waiting;
 }
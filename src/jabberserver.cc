@@ -38,6 +38,23 @@ using namespace rapidxml;
 namespace {
     const std::string sasl_ns = "jabber:server";
 
+    /**
+     * Domain part of a raw jid attribute, if it's already in canonical form - so it can
+     * be used without stringprep. Anything else takes the slow path.
+     */
+    std::optional<DomainId> raw_domain(rapidxml::xml_attribute<> const *attr) {
+        if (!attr) return std::nullopt;
+        std::string_view jid{attr->value(), attr->value_size()};
+        jid = jid.substr(0, jid.find('/'));
+        auto at = jid.find('@');
+        if (at != std::string_view::npos) jid.remove_prefix(at + 1);
+        if (jid.empty() || jid.back() == '.') return std::nullopt;
+        for (auto c : jid) {
+            if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '-')) return std::nullopt;
+        }
+        return DomainId(jid);
+    }
+
     class JabberServer : public Feature, public sigslot::has_slots {
     public:
         explicit JabberServer(XMLStream &s) : Feature(s) {}
@@ -47,8 +64,30 @@ namespace {
             Description() : Feature::Description<JabberServer>(sasl_ns, FEAT_POSTAUTH) {};
         };
 
+        /**
+         * Plain S2S relay, with no filters in the way, needn't build a Stanza at all; the
+         * original text goes straight out on an established route.
+         */
+        bool forward(rapidxml::xml_node<> *node) {
+            if (m_stream.x2x_mode()) return false;
+            std::string_view name{node->name(), node->name_size()};
+            if (name != "message" && name != "iq" && name != "presence") return false;
+            auto to = raw_domain(node->first_attribute("to"));
+            if (!to) return false;
+            auto from = raw_domain(node->first_attribute("from"));
+            if (!from) return false;
+            if (m_stream.s2s_auth_pair(*to, *from, INBOUND) != XMLStream::AUTHORIZED) return false;
+            auto const &domain = Config::config().domain(*to);
+            if (domain.transport_type() != S2S || domain.filtered()) return false;
+            auto &route = RouteTable::routeTable(*from).route(*to);
+            if (!route->forward(m_stream.stanza_text())) return false;
+            route->throttle(m_stream.session());
+            return true;
+        }
+
         sigslot::tasklet<bool> handle(rapidxml::xml_node<> *node) override {
             METRE_LOG(Metre::Log::DEBUG, "Handle JabberServer");
+            if (forward(node)) co_return true;
             xml_document<> *d = node->document();
             d->fixup<parse_default>(node, false); // Just terminate the header.
             std::string stanza = node->name();
@@ -73,7 +112,7 @@ namespace {
                     Jid const &to = s->to();
                     Jid const &from = s->from();
                     // Check auth state.
-                    if (m_stream.s2s_auth_pair(to.domain(), from.domain(), INBOUND) != XMLStream::AUTHORIZED) {
+                    if (m_stream.s2s_auth_pair(to.domain_id(), from.domain_id(), INBOUND) != XMLStream::AUTHORIZED) {
                         if (m_stream.x2x_mode()) {
                             if (m_stream.secured()) {
                                 s->freeze();
@@ -81,7 +120,7 @@ namespace {
                                 auto task = m_stream.start_task("jabber::server tls_auth_ok", m_stream.tls_auth_ok(*r));
                                 bool result = co_await *task;
                                 if (result) {
-                                    m_stream.s2s_auth_pair(s->to().domain(), s->from().domain(), INBOUND,
+                                    m_stream.s2s_auth_pair(s->to().domain_id(), s->from().domain_id(), INBOUND,
                                                            XMLStream::AUTHORIZED);
                                 } else {
                                     throw Metre::not_authorized();
@@ -91,15 +130,25 @@ namespace {
                             throw Metre::not_authorized();
                         }
                     }
-                    if (DROP == Config::config().domain(to.domain()).filter(INBOUND, *s)) {
+                    if (DROP == Config::config().domain(to.domain_id()).filter(INBOUND, *s)) {
                         m_stream.logger().info("Stanza discarded by filters");
                         co_return true;
                     }
-                    if (Config::config().domain(to.domain()).transport_type() == INTERNAL) {
-                        Endpoint::endpoint(to).process(std::move(s));
+                    if (Config::config().domain(to.domain_id()).transport_type() == INTERNAL) {
+                        if (Router::worker() == 0) {
+                            Endpoint::endpoint(to).process(std::move(s));
+                        } else {
+                            // Internal endpoints all live on the first worker.
+                            s->freeze();
+                            auto holder = std::make_shared<std::unique_ptr<Stanza>>(std::move(s));
+                            Router::on_worker(0, [holder]() {
+                                Endpoint::endpoint((*holder)->to()).process(std::move(*holder));
+                            });
+                        }
                     } else {
                         std::shared_ptr<Route> route = RouteTable::routeTable(from).route(to);
                         route->transmit(std::move(s));
+                        route->throttle(m_stream.session());
                     }
                     // Lookup endpoint.
                 } catch (Metre::base::xmpp_exception &) {
@@ -30,6 +30,11 @@ SOFTWARE.
 #endif
 #include <memory>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include "log.h"
 #include "defs.h"
 
@@ -47,19 +52,13 @@ namespace {
     }
 
     UConverter *utf8() {
-        static UConverter *c = 0;
+        thread_local UConverter *c = 0; // Converters aren't thread-safe.
         UErrorCode error = U_ZERO_ERROR;
         if (!c) c = ucnv_open("utf-8", &error);
         return c;
     }
 
     std::string stringprep(UStringPrepProfile *p, std::string const &input) {
-        if (std::find_if(input.begin(), input.end(), [](const char c) { return c & (1 << 7); }) == input.end()) {
-            std::string ret = input;
-            std::transform(ret.begin(), ret.end(), ret.begin(),
-                           [](const char c) { return static_cast<char>(tolower(c)); });
-            return ret;
-        }
         auto output = std::make_unique<UChar[]>(input.size() + 1);
         UChar *ptr = output.get();
         const char *data = input.data();
@@ -84,55 +83,102 @@ namespace {
         return nullptr;
     }
 
-    std::string stringprep(void *, std::string const &input) {
-        if (std::find_if(input.begin(), input.end(), [](const char c) { return c & (1 << 7); }) == input.end()) {
-            std::string ret = input;
-            std::transform(ret.begin(), ret.end(), ret.begin(),
-                           [](const char c) { return static_cast<char>(tolower(c)); });
-            return ret;
-        }
+    std::string stringprep(void *, std::string const &) {
         throw std::runtime_error("IDNA encountered without unicode support");
     }
 
 #endif
-}
 
-void Jid::parse(std::string const &s) {
-    ssize_t at_pos{-1};
-    ssize_t slash_pos{-1};
-    for (size_t c{0}; c != s.length(); ++c) {
-        switch (s[c]) {
-            case '@':
-                if (at_pos < 0) {
-                    at_pos = c;
-                }
-                break;
-            case '/':
-                slash_pos = c;
-                goto loop_exit;
+    enum class Case {
+        CANONICAL, UPPER, NON_ASCII
+    };
+
+    // Classifies eight octets at a time: any high bit means non-ASCII, otherwise look for A-Z.
+    Case ascii_case(std::string_view s) {
+        constexpr std::uint64_t ones = 0x0101010101010101ULL;
+        constexpr std::uint64_t highs = 0x8080808080808080ULL;
+        std::uint64_t high = 0;
+        std::uint64_t upper = 0;
+        for (std::size_t i = 0; i < s.size(); i += 8) {
+            std::uint64_t w = 0; // Zero padding is neither high nor upper.
+            std::memcpy(&w, s.data() + i, std::min<std::size_t>(8, s.size() - i));
+            high |= w;
+            std::uint64_t h = w & ~highs;
+            upper |= (h + (0x80 - 'A') * ones) & ~(h + (0x80 - 'Z' - 1) * ones);
         }
+        if (high & highs) return Case::NON_ASCII;
+        if (upper & highs) return Case::UPPER;
+        return Case::CANONICAL;
     }
-    loop_exit:
-    if (at_pos >= 0) {
-        m_local.emplace(s.data(), at_pos);
-    }
-    if (slash_pos >= 0) {
-        m_resource.emplace(s.data() + slash_pos + 1, s.length() - slash_pos - 1);
+
+    // IDNs are rare but repeat, so keep the most recently prepped ones.
+    class NameprepCache {
+        static constexpr std::size_t capacity = 1024;
+        std::mutex m_mutex;
+        std::list<std::pair<std::string, DomainId>> m_entries; // Most recent first.
+        std::unordered_map<std::string_view, decltype(m_entries)::iterator> m_index;
+
+        std::optional<DomainId> find(std::string_view raw) {
+            auto it = m_index.find(raw);
+            if (it == m_index.end()) return std::nullopt;
+            m_entries.splice(m_entries.begin(), m_entries, (*it).second);
+            return (*it).second->second;
+        }
+
+    public:
+        DomainId lookup(std::string_view raw) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (auto id = find(raw)) return *id;
+            }
+            DomainId id{stringprep(nameprep(), std::string{raw})};
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (auto existing = find(raw)) return *existing;
+            m_entries.emplace_front(std::string{raw}, id);
+            m_index.emplace(m_entries.front().first, m_entries.begin());
+            if (m_entries.size() > capacity) {
+                m_index.erase(m_entries.back().first);
+                m_entries.pop_back();
+            }
+            return id;
+        }
+    };
+
+    DomainId canonical_domain(std::string_view domain) {
+        switch (ascii_case(domain)) {
+            case Case::CANONICAL:
+                return DomainId(domain);
+            case Case::UPPER: {
+                auto lower = [](char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c; };
+                char buf[256];
+                if (domain.size() <= sizeof(buf)) {
+                    std::transform(domain.begin(), domain.end(), buf, lower);
+                    return DomainId(std::string_view{buf, domain.size()});
+                }
+                std::string ret{domain};
+                std::transform(ret.begin(), ret.end(), ret.begin(), lower);
+                return DomainId(ret);
+            }
+            default: {
+                static NameprepCache cache;
+                return cache.lookup(domain);
+            }
+        }
     }
-    if (at_pos < 0) {
-        at_pos = 0;
-    } else {
-        ++at_pos;
+}
+
+void Jid::parse(std::string_view s) {
+    auto slash_pos = s.find('/');
+    auto bare = s.substr(0, slash_pos);
+    auto at_pos = bare.find('@');
+    if (at_pos != std::string_view::npos) {
+        m_local.emplace(bare.substr(0, at_pos));
+        bare.remove_prefix(at_pos + 1);
     }
-    if (at_pos == 0 && slash_pos < 0) {
-        m_domain = stringprep(nameprep(), s);
-    } else {
-        if (slash_pos < 0) {
-            slash_pos = s.length();
-        }
-        slash_pos -= at_pos;
-        m_domain.assign(stringprep(nameprep(), std::string{s.data() + at_pos, static_cast<std::size_t>(slash_pos)}));
+    if (slash_pos != std::string_view::npos) {
+        m_resource.emplace(s.substr(slash_pos + 1));
     }
+    m_domain = canonical_domain(bare);
 }
 
 std::string const &Jid::full() const {
@@ -145,7 +191,7 @@ std::string const &Jid::full() const {
             *m_full += *m_local;
             *m_full += "@";
         }
-        *m_full += m_domain;
+        *m_full += m_domain.str();
         if (m_resource) {
             *m_full += "/";
             *m_full += *m_resource;
@@ -161,7 +207,7 @@ std::string const &Jid::bare() const {
             *m_bare += *m_local;
             *m_bare += "@";
         }
-        *m_bare += m_domain;
+        *m_bare += m_domain.str();
     }
     return *m_bare;
 }
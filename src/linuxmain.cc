@@ -71,17 +71,6 @@ namespace {
 
     std::unique_ptr<BootConfig> bc;
     std::unique_ptr<Metre::Config> config;
-
-    void hup_handler(int s) {
-        //config.reset(new Metre::Config(bc->config_file));
-        //Metre::Router::reload();
-        METRE_LOG(Metre::Log::INFO, "NOT Reloading config.");
-    }
-
-    void term_handler(int s) {
-        METRE_LOG(Metre::Log::INFO, "Shutdown received.");
-        Metre::Router::quit();
-    }
 }
 
 int main(int argc, char *argv[]) {
@@ -129,31 +118,21 @@ int main(int argc, char *argv[]) {
             }
             chdir(config->runtime_dir().c_str());
             signal(SIGPIPE, SIG_IGN);
-            signal(SIGHUP, hup_handler);
-            signal(SIGTERM, term_handler);
             Metre::Router::main([]() { return false; });
         } else if (bc->boot_method == "none") {
             config->log_init();
             config->write_runtime_config();
             signal(SIGPIPE, SIG_IGN);
-            signal(SIGHUP, hup_handler);
-            signal(SIGTERM, term_handler);
-            signal(SIGINT, term_handler);
             Metre::Router::main([]() { return false; });
         } else if (bc->boot_method == "docker") {
             config->docker_setup();
             config->write_runtime_config();
             signal(SIGPIPE, SIG_IGN);
-            signal(SIGHUP, hup_handler);
-            signal(SIGTERM, term_handler);
-            signal(SIGINT, term_handler);
             Metre::Router::main([]() { return false; });
         } else if (bc->boot_method == "systemd") {
             config->log_init(true);
             config->write_runtime_config();
             signal(SIGPIPE, SIG_IGN);
-            signal(SIGHUP, hup_handler);
-            signal(SIGTERM, term_handler);
             Metre::Router::main([]() { return false; });
         } else {
             std::cerr << "I don't know what " << bc->boot_method << " means." << std::endl;
@@ -28,29 +28,22 @@ SOFTWARE.
 #include <fstream>
 #include <iostream>
 
+bool Metre::Log::enabled(Log::LEVEL lvlm) {
+    return Metre::Config::config().logger().should_log(level(lvlm));
+}
+
 void Metre::Log::log(Log::LEVEL lvlm, std::string const &filename, int line, std::string const &stuff) {
-    spdlog::level::level_enum lvl = spdlog::level::trace;
-    switch (lvlm) {
-        case EMERG:
-        case ALERT:
-        case CRIT:
-            lvl = spdlog::level::critical;
-            break;
-        case ERR:
-            lvl = spdlog::level::err;
-            break;
-        case WARNING:
-        case NOTICE:
-            lvl = spdlog::level::warn;
-            break;
-        case INFO:
-            lvl = spdlog::level::info;
-            break;
-        case DEBUG:
-            lvl = spdlog::level::debug;
-            break;
-        case TRACE:
-            lvl = spdlog::level::trace;
+    Metre::Config::config().logger().log(level(lvlm), "{}:{} : {}", filename, line, stuff);
+}
+
+std::string Metre::Log::name(std::string_view component, Fields fields) {
+    std::string out{component};
+    for (auto const &field : fields) {
+        out += ' ';
+        out += field.first;
+        out += "=[";
+        out += field.second;
+        out += ']';
     }
-    Metre::Config::config().logger().log(lvl, "{}:{} : {}", filename, line, stuff);
+    return out;
 }
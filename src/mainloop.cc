@@ -29,12 +29,16 @@ SOFTWARE.
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <csignal>
 
 #else
 #include <ws2tcpip.h>
 #endif
+#include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <sstream>
+#include <string_view>
 #include "rapidxml.hpp"
 #include <optional> // Uses the supplied optional by default.
 #include "xmppexcept.h"
@@ -42,7 +46,10 @@ SOFTWARE.
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
+#include <event2/thread.h>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include "router.h"
 #include <unbound.h>
 #include <cerrno>
@@ -52,32 +59,72 @@ SOFTWARE.
 #include "dns.h"
 #include "config.h"
 #include "log.h"
+#include "mpsc.h"
+#include "timerwheel.h"
+#include "http.h"
+#include "tls.h"
+#include "metrics.h"
+#include <event2/http.h>
+#include <chrono>
 #include <functional>
 #include <vector>
 
 namespace Metre {
     class Mainloop : public sigslot::has_slots {
     private:
+        struct StreamId {
+            unsigned worker;
+            unsigned long long serial;
+            std::weak_ptr<NetSession> session; // Only ever locked by the owning worker.
+        };
+
+        unsigned m_worker;
         struct event_base *m_event_base = nullptr;
         std::map<unsigned long long, std::shared_ptr<NetSession>> m_sessions;
-        std::map<std::string, std::weak_ptr<NetSession>> m_sessions_by_id;
-        std::map<std::string, std::weak_ptr<NetSession>> m_sessions_by_domain;
+        std::unordered_map<DomainId, std::weak_ptr<NetSession>> m_sessions_by_domain;
         std::map<std::pair<std::string, unsigned short>, std::weak_ptr<NetSession>> m_sessions_by_address;
         struct event *m_ub_event = nullptr;
         std::list<struct evconnlistener *> m_listeners;
+        struct evhttp *m_metrics = nullptr;
+        std::list<struct event *> m_signals;
         static std::atomic<unsigned long long> s_serial;
         std::list<std::shared_ptr<NetSession>> m_closed_sessions;
-        std::multimap<time_t, std::function<void()>> m_pending_actions;
-        bool m_shutdown = false;
+        TimerWheel m_timers{now()};
+        struct event *m_timer_event = nullptr;
+        std::uint64_t m_timer_armed = 0; // Deadline the timer event is set for, or 0.
+        std::vector<std::function<void()>> m_run_queue; // Zero-delay work, run once per loop iteration.
+        struct event *m_run_event = nullptr;
+        MPSCQueue<std::function<void()>> m_inbox; // Work handed over from other workers.
+        struct event *m_wakeup = nullptr;
+        std::atomic<bool> m_shutdown{false};
         bool m_shutdown_now = false;
+        Metrics::Histogram *m_lag = nullptr;
+        Metrics::Gauge *m_lag_max = nullptr;
+        std::chrono::steady_clock::duration m_lag_window_max{};
+        unsigned m_lag_probes = 0;
+        // Stream ids are looked up across workers, for dialback.
+        static std::mutex s_sessions_by_id_mutex;
+        static std::map<std::string, StreamId> s_sessions_by_id;
     public:
-        static Mainloop *s_mainloop;
+        static thread_local Mainloop *s_mainloop;
+        static std::vector<Mainloop *> s_workers;
 
-        Mainloop() : m_sessions() {
-            s_mainloop = this;
+        explicit Mainloop(unsigned worker) : m_worker(worker), m_sessions() {
         }
 
         virtual ~Mainloop() {
+            for (auto ev : m_signals) {
+                event_free(ev);
+            }
+            if (m_timer_event) {
+                event_free(m_timer_event);
+            }
+            if (m_run_event) {
+                event_free(m_run_event);
+            }
+            if (m_wakeup) {
+                event_free(m_wakeup);
+            }
             if (m_ub_event) {
                 event_del(m_ub_event);
                 event_free(m_ub_event);
@@ -91,20 +138,55 @@ namespace Metre {
             return m_event_base;
         }
 
+        unsigned worker() const {
+            return m_worker;
+        }
+
         bool init() {
             if (m_event_base) throw std::runtime_error("I'm already initialized!");
             m_event_base = event_base_new();
+            m_wakeup = event_new(m_event_base, -1, 0, wakeup_cb, this);
+            m_timer_event = event_new(m_event_base, -1, EV_PERSIST, timer_cb, this);
+            m_run_event = event_new(m_event_base, -1, 0, run_queue_cb, this);
+            Metrics::Labels labels{{"worker", std::to_string(m_worker)}};
+            m_lag = &Metrics::histogram("metre_loop_lag_seconds", "Delay before a due timer ran on this worker", labels);
+            m_lag_max = &Metrics::gauge("metre_loop_lag_max_microseconds",
+                                        "Longest timer delay on this worker over the last 10 seconds", labels);
+            schedule_lag_probe();
             for (auto &listen : Config::config().listeners()) {
+                // Listeners live on the first worker, unless the kernel is spreading connections for us.
+                if (m_worker != 0 && !listen.reuseport) continue;
+                unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+                if (listen.reuseport) {
+#ifdef LEV_OPT_REUSEABLE_PORT
+                    flags |= LEV_OPT_REUSEABLE_PORT;
+#else
+                    throw std::runtime_error("Listener " + listen.name + " wants reuseport, which isn't available");
+#endif
+                }
                 auto listener = evconnlistener_new_bind(m_event_base, new_session_cb,
-                                                        const_cast<Config::Listener *>(&listen),
-                                                        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+                                                        const_cast<Config::Listener *>(&listen), flags, -1,
                                                         listen.sockaddr(), sizeof(struct sockaddr_storage));
                 if (!listener) {
                     throw std::runtime_error("Cannot bind to " + listen.name + " service port: " + strerror(errno));
                 }
+                listen.socket.apply(evconnlistener_get_fd(listener));
                 m_listeners.push_back(listener);
                 METRE_LOG(Metre::Log::INFO, "Listening to " << listen.name << ".");
             }
+            if (m_worker != 0) return true;
+            if (Config::config().metrics_port()) {
+                m_metrics = Metrics::serve(m_event_base, Config::config().metrics_address(),
+                                           Config::config().metrics_port());
+            }
+#ifdef METRE_UNIX
+            // Handled here rather than in a signal handler, where neither logging nor quit() is safe.
+            for (int sig : {SIGUSR1, SIGUSR2, SIGHUP, SIGTERM, SIGINT}) {
+                auto ev = evsignal_new(m_event_base, sig, signal_cb, nullptr);
+                evsignal_add(ev, nullptr);
+                m_signals.push_back(ev);
+            }
+#endif
             return true;
         }
 
@@ -116,16 +198,16 @@ namespace Metre {
             return nullptr;
         }
 
-        std::shared_ptr<NetSession> session_by_id(std::string const &id) {
-            auto it = m_sessions_by_id.find(id);
-            if (it != m_sessions_by_id.end()) {
-                std::shared_ptr<NetSession> s((*it).second.lock());
-                return s;
+        static std::optional<StreamId> session_by_id(std::string const &id) {
+            std::lock_guard<std::mutex> lock(s_sessions_by_id_mutex);
+            auto it = s_sessions_by_id.find(id);
+            if (it != s_sessions_by_id.end() && !(*it).second.session.expired()) {
+                return (*it).second;
             }
-            return nullptr;
+            return std::nullopt;
         }
 
-        std::shared_ptr<NetSession> session_by_domain(std::string const &id) {
+        std::shared_ptr<NetSession> session_by_domain(DomainId const &id) {
             auto it = m_sessions_by_domain.find(id);
             if (it != m_sessions_by_domain.end()) {
                 std::shared_ptr<NetSession> s((*it).second.lock());
@@ -148,43 +230,94 @@ namespace Metre {
             if (it == m_sessions.end()) {
                 return;
             }
-            auto it2 = m_sessions_by_id.find(id);
-            if (it2 != m_sessions_by_id.end()) {
-                std::shared_ptr<NetSession> old = it2->second.lock();
-                if (!old) {
-                    m_sessions_by_id.erase(it2);
+            std::lock_guard<std::mutex> lock(s_sessions_by_id_mutex);
+            auto it2 = s_sessions_by_id.find(id);
+            if (it2 != s_sessions_by_id.end()) {
+                if (it2->second.session.expired()) {
+                    s_sessions_by_id.erase(it2);
                 } else {
-                    if (old->serial() == serial) return;
+                    if (it2->second.serial == serial) return;
                     throw std::runtime_error("Duplicate session id - loopback?");
                 }
             }
-            m_sessions_by_id.insert(std::make_pair(id, (*it).second));
+            s_sessions_by_id.insert(std::make_pair(id, StreamId{m_worker, serial, (*it).second}));
         }
 
-        void unregister_stream_id(std::string const &id) {
-            auto it2 = m_sessions_by_id.find(id);
-            if (it2 != m_sessions_by_id.end()) {
-                m_sessions_by_id.erase(it2);
+        static void unregister_stream_id(std::string const &id) {
+            std::lock_guard<std::mutex> lock(s_sessions_by_id_mutex);
+            auto it2 = s_sessions_by_id.find(id);
+            if (it2 != s_sessions_by_id.end()) {
+                s_sessions_by_id.erase(it2);
             }
         }
 
-        void register_session_domain(std::string const &dom, unsigned long long serial) {
+        void register_session_domain(DomainId const &dom, unsigned long long serial) {
             auto it = m_sessions.find(serial);
             if (it == m_sessions.end()) {
                 return;
             }
-            auto it2 = m_sessions_by_domain.find(dom);
-            if (it2 != m_sessions_by_domain.end()) {
-                m_sessions_by_domain.erase(it2);
-            }
-            m_sessions_by_domain.insert(std::make_pair(dom, (*it).second));
+            m_sessions_by_domain[dom] = (*it).second;
         }
 
         static void
         new_session_cb(struct evconnlistener *listener, evutil_socket_t newsock, struct sockaddr *addr, int len,
                        void *arg) {
             Config::Listener const *listen = reinterpret_cast<Config::Listener *>(arg);
-            Mainloop::s_mainloop->new_session_inbound(newsock, addr, len, listen);
+            Mainloop *target = listen->reuseport ? s_mainloop : s_workers[worker_for(listen, addr, len)];
+            if (target == s_mainloop) {
+                target->new_session_inbound(newsock, addr, len, listen);
+                return;
+            }
+            struct sockaddr_storage ss;
+            std::memcpy(&ss, addr, std::min(static_cast<size_t>(len), sizeof(ss)));
+            target->post([target, newsock, ss, len, listen]() mutable {
+                target->new_session_inbound(newsock, reinterpret_cast<struct sockaddr *>(&ss), len, listen);
+            });
+        }
+
+        static unsigned shard(std::string_view const &key) {
+            return std::hash<std::string_view>{}(key) % s_workers.size();
+        }
+
+        static unsigned worker_for(Config::Listener const *listen, struct sockaddr *addr, int len) {
+            if (s_workers.size() == 1) return 0;
+            switch (listen->session_type) {
+                case COMP:
+                    return 0; // Components, like internal endpoints, stay on the first worker.
+                case X2X:
+                    return shard(listen->remote_domain);
+                default:
+                    // We won't know the remote domain until the stream opens, so spread by peer.
+                    // Only the address counts; the source port changes with every connection.
+                    switch (addr->sa_family) {
+                        case AF_INET: {
+                            auto in = reinterpret_cast<struct sockaddr_in *>(addr);
+                            return shard(std::string_view(reinterpret_cast<char *>(&in->sin_addr), sizeof(in->sin_addr)));
+                        }
+                        case AF_INET6: {
+                            auto in6 = reinterpret_cast<struct sockaddr_in6 *>(addr);
+                            return shard(std::string_view(reinterpret_cast<char *>(&in6->sin6_addr), sizeof(in6->sin6_addr)));
+                        }
+                        default:
+                            return shard(std::string_view(reinterpret_cast<char *>(addr), len));
+                    }
+            }
+        }
+
+        void post(std::function<void()> &&fn) {
+            m_inbox.push(std::move(fn));
+            event_active(m_wakeup, EV_READ, 0);
+        }
+
+        static void wakeup_cb(evutil_socket_t, short, void *arg) {
+            auto loop = reinterpret_cast<Mainloop *>(arg);
+            while (auto fn = loop->m_inbox.pop()) {
+                try {
+                    (*fn)();
+                } catch (std::exception &e) {
+                    METRE_LOG(Metre::Log::ERR, "Exception from handed-over work: " << e.what());
+                }
+            }
         }
 
         void
@@ -193,7 +326,9 @@ namespace Metre {
                 evutil_closesocket(sock);
                 return;
             }
+            listen->socket.apply(sock);
             struct bufferevent *bev = bufferevent_socket_new(m_event_base, sock, BEV_OPT_CLOSE_ON_FREE);
+            listen->socket.watermarks(bev);
             std::shared_ptr<NetSession> session(
                     new NetSession(std::atomic_fetch_add(&s_serial, 1ull), bev, listen));
             auto it = m_sessions.find(session->serial());
@@ -235,23 +370,30 @@ namespace Metre {
                       "Connecting to " << inet_ntop(addr->sa_family, inx_addr, buf, INET6_ADDRSTRLEN) << ":" << port);
             auto sesh = connect(fromd, tod, hostname, addr,
                                 sizeof(struct sockaddr_storage), port, stype, tls_mode);
+            sesh->remote_address(hostname, port);
             m_sessions_by_address[std::make_pair(hostname, port)] = sesh;
-            auto it = m_sessions_by_domain.find(tod);
-            if (it == m_sessions_by_domain.end() ||
-                (*it).second.expired()) {
-                m_sessions_by_domain[tod] = sesh;
-            }
+            auto &by_domain = m_sessions_by_domain[DomainId(tod)];
+            if (by_domain.expired()) by_domain = sesh;
             return sesh;
         }
 
         std::shared_ptr<NetSession>
         connect(std::string const &fromd, std::string const &tod, std::string const &hostname, struct sockaddr *sin,
                 size_t addrlen, unsigned short port, SESSION_TYPE stype, TLS_MODE tls_mode) {
-            struct bufferevent *bev = bufferevent_socket_new(m_event_base, -1, BEV_OPT_CLOSE_ON_FREE);
+            auto const &socket_options = Config::config().domain(tod).socket();
+            evutil_socket_t fd = ::socket(sin->sa_family, SOCK_STREAM, 0);
+            if (fd == -1) {
+                throw std::runtime_error("Connection failed: cannot create socket");
+            }
+            evutil_make_socket_nonblocking(fd);
+            socket_options.apply(fd);
+            struct bufferevent *bev = bufferevent_socket_new(m_event_base, fd, BEV_OPT_CLOSE_ON_FREE);
             if (!bev) {
                 METRE_LOG(Metre::Log::CRIT, "Error creating BEV");
+                evutil_closesocket(fd);
                 throw std::runtime_error("Connection failed: cannot create BEV");
             }
+            socket_options.watermarks(bev);
             if (0 > bufferevent_socket_connect(bev, sin, static_cast<int>(addrlen))) {
                 METRE_LOG(Metre::Log::ERR, "Error connecting BEV");
                 // TODO Something bad happened.
@@ -276,7 +418,12 @@ namespace Metre {
         }
 
         void run(std::function<bool()> const &check_fn) {
+            s_mainloop = this;
             dns_setup();
+            if (m_worker == 0) {
+                Http::init();
+                ocsp_init();
+            }
             while (true) {
                 event_base_dispatch(m_event_base);
                 if (check_fn()) {
@@ -286,15 +433,6 @@ namespace Metre {
                     return;
                 }
                 m_closed_sessions.clear();
-                time_t now = std::time(nullptr);
-                while (!m_pending_actions.empty()) {
-                    if (m_pending_actions.begin()->first <= now) {
-                        m_pending_actions.begin()->second();
-                        m_pending_actions.erase(m_pending_actions.begin());
-                    } else {
-                        break;
-                    }
-                }
                 if (m_shutdown) {
                     METRE_LOG(Metre::Log::INFO, "Closing sessions.");
                     for (auto listener : m_listeners) {
@@ -302,6 +440,10 @@ namespace Metre {
                         evconnlistener_free(listener);
                     }
                     m_listeners.clear();
+                    if (m_metrics) {
+                        evhttp_free(m_metrics);
+                        m_metrics = nullptr;
+                    }
                     for (auto &it : m_sessions) {
                         it.second->send(
                                 "<stream:error><system-shutdown xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error></stream:close>");
@@ -310,20 +452,97 @@ namespace Metre {
                     m_shutdown_now = true;
                     event_base_loopexit(m_event_base, NULL);
                     METRE_LOG(Metre::Log::INFO, "Closed all sessions.");
-                } else if (!m_pending_actions.empty()) {
-                    struct timeval t = {0, 0};
-                    t.tv_sec = m_pending_actions.begin()->first - now;
-                    event_base_loopexit(m_event_base, &t);
                 }
             }
         }
 
-        void do_later(std::function<void()> &&fn, std::size_t seconds) {
-            time_t now = time(nullptr);
-            m_pending_actions.emplace(now + seconds, std::move(fn));
-            struct timeval t = {0, 0};
-            t.tv_sec = m_pending_actions.begin()->first - now;
-            event_base_loopexit(m_event_base, &t);
+        static std::uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        void run_soon(std::function<void()> &&fn) {
+            m_run_queue.push_back(std::move(fn));
+            if (m_run_queue.size() == 1) {
+                // A zero timeout, not event_active(), which would run again in this pass
+                // if armed from the callback; this waits for the next poll.
+                static const struct timeval zero = {0, 0};
+                event_add(m_run_event, &zero);
+            }
+        }
+
+        static void run_queue_cb(evutil_socket_t, short, void *arg) {
+            auto loop = reinterpret_cast<Mainloop *>(arg);
+            // Anything queued from here on waits for the next iteration.
+            std::vector<std::function<void()>> queue;
+            queue.swap(loop->m_run_queue);
+            for (auto &fn : queue) {
+                try {
+                    fn();
+                } catch (std::exception &e) {
+                    METRE_LOG(Metre::Log::ERR, "Exception from deferred work: " << e.what());
+                }
+            }
+        }
+
+        TimerWheel::Handle do_later(std::function<void()> &&fn, std::chrono::milliseconds delay) {
+            auto t = now();
+            if (m_timers.empty()) m_timers.advance(t); // Catch up idle time without cascading through it.
+            auto handle = m_timers.add(t + delay.count(), std::move(fn));
+            arm_timer();
+            return handle;
+        }
+
+        // A timer runs late by however long the loop was kept busy elsewhere.
+        void schedule_lag_probe() {
+            auto interval = std::chrono::milliseconds(100);
+            auto due = std::chrono::steady_clock::now() + interval;
+            do_later([this, due]() { probe_lag(due); }, interval);
+        }
+
+        void probe_lag(std::chrono::steady_clock::time_point due) {
+            auto lag = std::max(std::chrono::steady_clock::now() - due, std::chrono::steady_clock::duration::zero());
+            m_lag->observe(lag);
+            m_lag_window_max = std::max(m_lag_window_max, lag);
+            if (++m_lag_probes == 100) {
+                m_lag_max->set(std::chrono::duration_cast<std::chrono::microseconds>(m_lag_window_max).count());
+                m_lag_window_max = {};
+                m_lag_probes = 0;
+            }
+            if (!m_shutdown_now) schedule_lag_probe();
+        }
+
+        bool cancel(TimerWheel::Handle handle) {
+            return m_timers.cancel(handle);
+        }
+
+        void arm_timer() {
+            auto wakeup = m_timers.next_wakeup();
+            if (!wakeup) {
+                // Leave it be; an early wakeup is harmless, and cheaper than rearming.
+                return;
+            }
+            if (m_timer_armed != 0 && m_timer_armed <= *wakeup) return;
+            auto t = now();
+            auto delay = *wakeup > t ? *wakeup - t : 0;
+            struct timeval tv = {static_cast<long>(delay / 1000), static_cast<int>((delay % 1000) * 1000)};
+            event_add(m_timer_event, &tv);
+            m_timer_armed = *wakeup;
+        }
+
+        static void timer_cb(evutil_socket_t, short, void *arg) {
+            auto loop = reinterpret_cast<Mainloop *>(arg);
+            loop->m_timer_armed = 0;
+            try {
+                loop->m_timers.advance(now());
+            } catch (std::exception &e) {
+                METRE_LOG(Metre::Log::ERR, "Exception from timer: " << e.what());
+            }
+            if (loop->m_timers.empty()) {
+                event_del(loop->m_timer_event);
+            } else {
+                loop->arm_timer();
+            }
         }
 
         void shutdown() {
@@ -331,14 +550,34 @@ namespace Metre {
             event_base_loopexit(m_event_base, NULL);
         }
 
+#ifdef METRE_UNIX
+        static void signal_cb(evutil_socket_t sig, short, void *) {
+            switch (sig) {
+                case SIGTERM:
+                case SIGINT:
+                    METRE_LOG(Metre::Log::INFO, "Shutdown received.");
+                    Router::quit();
+                    break;
+                case SIGHUP:
+                    METRE_LOG(Metre::Log::INFO, "NOT Reloading config.");
+                    break;
+                default: {
+                    auto level = (sig == SIGUSR1) ? spdlog::level::trace : Config::config().configured_log_level();
+                    Config::config().log_level(level);
+                    METRE_LOG(Metre::Log::WARNING, "Log level now " << spdlog::level::to_string_view(level).data());
+                }
+            }
+        }
+#endif
+
         static void unbound_cb(evutil_socket_t, short, void *arg) {
             while (ub_poll(reinterpret_cast<struct ub_ctx *>(arg))) {
                 ub_process(reinterpret_cast<struct ub_ctx *>(arg));
             }
         }
 
-        void dns_setup() {
-            Config::config().dns_init();
+        void dns_setup(bool reload = false) {
+            Config::config().dns_init(reload);
             if (!m_ub_event) {
                 m_ub_event = event_new(m_event_base, ub_fd(Config::config().ub_ctx()), EV_READ | EV_PERSIST, unbound_cb,
                                        Config::config().ub_ctx());
@@ -352,21 +591,27 @@ namespace Metre {
                 event_free(m_ub_event);
                 m_ub_event = nullptr;
             }
-            dns_setup();
+            dns_setup(true);
         }
 
         void session_closed(NetSession &ns) {
             METRE_LOG(Log::DEBUG, "NS" << ns.serial() << " - Session closed.");
             auto it = m_sessions.find(ns.serial());
             if (it != m_sessions.end()) {
+                if (m_closed_sessions.empty()) {
+                    run_soon([this]() { m_closed_sessions.clear(); });
+                }
                 m_closed_sessions.push_back((*it).second);
-                event_base_loopexit(m_event_base, NULL);
                 m_sessions.erase(it);
+                if (m_shutdown_now) event_base_loopexit(m_event_base, NULL);
             }
         }
     };
 
-    Mainloop *Mainloop::s_mainloop{nullptr};
+    thread_local Mainloop *Mainloop::s_mainloop{nullptr};
+    std::vector<Mainloop *> Mainloop::s_workers;
+    std::mutex Mainloop::s_sessions_by_id_mutex;
+    std::map<std::string, Mainloop::StreamId> Mainloop::s_sessions_by_id;
     std::atomic<unsigned long long> Mainloop::s_serial{0};
 
     namespace Router {
@@ -381,18 +626,33 @@ namespace Metre {
         }
 
         void unregister_stream_id(std::string const &id) {
-            Mainloop::s_mainloop->unregister_stream_id(id);
+            Mainloop::unregister_stream_id(id);
         }
 
-        void register_session_domain(std::string const &domain, NetSession &session) {
+        void register_session_domain(DomainId const &domain, NetSession &session) {
             Mainloop::s_mainloop->register_session_domain(domain, session.serial());
         }
 
         std::shared_ptr<NetSession> session_by_stream_id(std::string const &id) {
-            return Mainloop::s_mainloop->session_by_id(id);
+            auto entry = Mainloop::session_by_id(id);
+            if (!entry || entry->worker != worker()) return nullptr;
+            return entry->session.lock();
         }
 
-        std::shared_ptr<NetSession> session_by_domain(std::string const &id) {
+        void with_stream_id(std::string const &id,
+                            std::function<void(std::shared_ptr<NetSession> const &)> &&fn) {
+            auto entry = Mainloop::session_by_id(id);
+            if (!entry) {
+                fn(nullptr);
+                return;
+            }
+            auto serial = entry->serial;
+            on_worker(entry->worker, [serial, fn = std::move(fn)]() {
+                fn(session_by_serial(serial));
+            });
+        }
+
+        std::shared_ptr<NetSession> session_by_domain(DomainId const &id) {
             return Mainloop::s_mainloop->session_by_domain(id);
         }
 
@@ -405,27 +665,68 @@ namespace Metre {
         }
 
         void defer(std::function<void()> &&fn) {
-            Mainloop::s_mainloop->do_later(std::move(fn), 0);
+            Mainloop::s_mainloop->run_soon(std::move(fn));
         }
 
         void defer(std::function<void()> &&fn, std::size_t seconds) {
-            Mainloop::s_mainloop->do_later(std::move(fn), seconds);
+            if (seconds == 0) {
+                defer(std::move(fn));
+                return;
+            }
+            defer(std::move(fn), std::chrono::seconds(seconds));
+        }
+
+        TimerHandle defer(std::function<void()> &&fn, std::chrono::milliseconds delay) {
+            return Mainloop::s_mainloop->do_later(std::move(fn), delay);
+        }
+
+        bool cancel(TimerHandle timer) {
+            return timer != 0 && Mainloop::s_mainloop->cancel(timer);
         }
 
         void main(std::function<bool()> const &check_fn) {
-            Metre::Mainloop loop;
-            if (!loop.init()) {
-                METRE_LOG(Metre::Log::CRIT, "Loop initialization failure");
-                return;
+#ifdef METRE_UNIX
+            evthread_use_pthreads();
+#else
+            evthread_use_windows_threads();
+#endif
+            std::vector<std::unique_ptr<Mainloop>> loops;
+            for (unsigned i = 0; i != Config::config().threads(); ++i) {
+                loops.emplace_back(std::make_unique<Mainloop>(i));
+                Mainloop::s_workers.push_back(loops.back().get());
+            }
+            for (auto &loop : loops) {
+                if (!loop->init()) {
+                    METRE_LOG(Metre::Log::CRIT, "Loop initialization failure");
+                    Mainloop::s_workers.clear();
+                    return;
+                }
+            }
+            std::vector<std::thread> threads;
+            for (auto it = std::next(loops.begin()); it != loops.end(); ++it) {
+                Mainloop *loop = it->get();
+                threads.emplace_back([loop]() {
+                    loop->run([]() { return false; });
+                });
             }
+            METRE_LOG(Metre::Log::INFO, "Running " << loops.size() << " worker(s)");
             //Config::config().dns_init();
-            loop.run(check_fn);
+            loops.front()->run(check_fn);
+            for (auto &loop : loops) {
+                loop->shutdown();
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            Mainloop::s_workers.clear();
             METRE_LOG(Metre::Log::INFO, "Shutdown complete");
         }
 
         void quit() {
             METRE_LOG(Metre::Log::INFO, "Shutting down...");
-            Mainloop::s_mainloop->shutdown();
+            for (auto loop : Mainloop::s_workers) {
+                loop->shutdown();
+            }
         }
 
         void reload() {
@@ -435,6 +736,29 @@ namespace Metre {
         struct event_base * event_base() {
             return Mainloop::s_mainloop->event_base();
         }
+
+        unsigned worker() {
+            return Mainloop::s_mainloop ? Mainloop::s_mainloop->worker() : 0;
+        }
+
+        unsigned worker_for(std::string const &domain) {
+            if (Mainloop::s_workers.size() <= 1) return 0;
+            switch (Config::config().domain(domain).transport_type()) {
+                case COMP:
+                case INTERNAL:
+                    return 0;
+                default:
+                    return Mainloop::shard(domain);
+            }
+        }
+
+        void on_worker(unsigned w, std::function<void()> &&fn) {
+            if (w == worker() || w >= Mainloop::s_workers.size()) {
+                fn();
+            } else {
+                Mainloop::s_workers[w]->post(std::move(fn));
+            }
+        }
     }
 }
 
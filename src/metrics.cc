@@ -0,0 +1,198 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "metrics.h"
+#include "log.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+using namespace Metre;
+using namespace Metre::Metrics;
+
+namespace {
+    struct Family {
+        std::string help;
+        std::string type;
+        std::map<std::string, std::unique_ptr<Metric>> series; // By rendered labels.
+    };
+
+    std::mutex s_mutex;
+    std::map<std::string, Family> s_families;
+
+    std::string render_labels(Labels const &labels) {
+        std::string out;
+        for (auto const &label : labels) {
+            if (!out.empty()) out += ',';
+            out += label.first;
+            out += "=\"";
+            for (auto c : label.second) {
+                switch (c) {
+                    case '\\':
+                        out += "\\\\";
+                        break;
+                    case '"':
+                        out += "\\\"";
+                        break;
+                    case '\n':
+                        out += "\\n";
+                        break;
+                    default:
+                        out += c;
+                }
+            }
+            out += '"';
+        }
+        return out;
+    }
+
+    void sample(std::string &out, std::string const &name, std::string const &labels, std::string const &value) {
+        out += name;
+        if (!labels.empty()) {
+            out += '{';
+            out += labels;
+            out += '}';
+        }
+        out += ' ';
+        out += value;
+        out += '\n';
+    }
+
+    std::string number(double d) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6g", d);
+        return buf;
+    }
+
+    template<typename M>
+    M &series(std::string const &name, std::string const &help, const char *type, Labels const &labels) {
+        std::lock_guard<std::mutex> l(s_mutex);
+        auto &family = s_families[name];
+        if (family.type.empty()) {
+            family.help = help;
+            family.type = type;
+        } else if (family.type != type) {
+            throw std::runtime_error("Metric " + name + " is a " + family.type + ", not a " + type);
+        }
+        auto &metric = family.series[render_labels(labels)];
+        if (!metric) metric = std::make_unique<M>();
+        return static_cast<M &>(*metric);
+    }
+
+    void metrics_cb(struct evhttp_request *req, void *) {
+        auto text = render();
+        struct evbuffer *buf = evbuffer_new();
+        if (!buf) {
+            evhttp_send_error(req, 500, "Internal Server Error");
+            return;
+        }
+        evbuffer_add(buf, text.data(), text.size());
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+        evhttp_send_reply(req, 200, "OK", buf);
+        evbuffer_free(buf);
+    }
+}
+
+void Counter::render(std::string &out, std::string const &name, std::string const &labels) const {
+    sample(out, name, labels, std::to_string(value()));
+}
+
+void Gauge::render(std::string &out, std::string const &name, std::string const &labels) const {
+    sample(out, name, labels, std::to_string(value()));
+}
+
+void Histogram::observe(std::chrono::steady_clock::duration d) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    if (us < 0) us = 0;
+    double seconds = static_cast<double>(us) / 1e6;
+    std::size_t i = 0;
+    while (i != bounds.size() && seconds > bounds[i]) ++i;
+    m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+    m_sum_us.fetch_add(static_cast<std::uint64_t>(us), std::memory_order_relaxed);
+}
+
+void Histogram::render(std::string &out, std::string const &name, std::string const &labels) const {
+    std::string prefix = labels.empty() ? std::string() : labels + ",";
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i != m_buckets.size(); ++i) {
+        count += m_buckets[i].load(std::memory_order_relaxed);
+        auto le = (i == bounds.size()) ? std::string("+Inf") : number(bounds[i]);
+        sample(out, name + "_bucket", prefix + "le=\"" + le + "\"", std::to_string(count));
+    }
+    sample(out, name + "_sum", labels, number(static_cast<double>(m_sum_us.load(std::memory_order_relaxed)) / 1e6));
+    sample(out, name + "_count", labels, std::to_string(count));
+}
+
+Counter &Metrics::counter(std::string const &name, std::string const &help, Labels const &labels) {
+    return series<Counter>(name, help, "counter", labels);
+}
+
+Gauge &Metrics::gauge(std::string const &name, std::string const &help, Labels const &labels) {
+    return series<Gauge>(name, help, "gauge", labels);
+}
+
+Histogram &Metrics::histogram(std::string const &name, std::string const &help, Labels const &labels) {
+    return series<Histogram>(name, help, "histogram", labels);
+}
+
+void Metrics::remove(std::string const &name, Labels const &labels) {
+    std::lock_guard<std::mutex> l(s_mutex);
+    auto it = s_families.find(name);
+    if (it == s_families.end()) return;
+    it->second.series.erase(render_labels(labels));
+}
+
+std::string Metrics::render() {
+    std::string out;
+    std::lock_guard<std::mutex> l(s_mutex);
+    for (auto const &[name, family] : s_families) {
+        if (family.series.empty()) continue;
+        out += "# HELP " + name + " " + family.help + "\n";
+        out += "# TYPE " + name + " " + family.type + "\n";
+        for (auto const &[labels, metric] : family.series) {
+            metric->render(out, name, labels);
+        }
+    }
+    return out;
+}
+
+struct evhttp *Metrics::serve(struct event_base *base, std::string const &address, unsigned short port) {
+    struct evhttp *http = evhttp_new(base);
+    if (!http) throw std::runtime_error("Cannot create metrics HTTP server");
+    if (!evhttp_bind_socket_with_handle(http, address.c_str(), port)) {
+        evhttp_free(http);
+        throw std::runtime_error("Cannot bind to metrics port " + address + ":" + std::to_string(port));
+    }
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET);
+    evhttp_set_cb(http, "/metrics", metrics_cb, nullptr);
+    METRE_LOG(Metre::Log::INFO, "Serving metrics on " << address << ":" << port << ".");
+    return http;
+}
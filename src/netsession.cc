@@ -28,19 +28,82 @@ SOFTWARE.
 #include "router.h"
 #include "log.h"
 #include "tls.h"
+#include "metrics.h"
+#include "config.h"
 
 #include "rapidxml_print.hpp"
 
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/event.h>
+#include <algorithm>
 #include <cstring>
 
 using namespace Metre;
 
+namespace {
+    // Lets rapidxml::print write straight into space reserved in an evbuffer.
+    class EvbufferWriter {
+        struct evbuffer *m_buf;
+        struct evbuffer_iovec m_vec = {nullptr, 0};
+        char *m_pos = nullptr;
+        char *m_end = nullptr;
+        static constexpr std::size_t reserve_size = 4096;
+
+    public:
+        explicit EvbufferWriter(struct evbuffer *buf) : m_buf(buf) {}
+
+        ~EvbufferWriter() {
+            commit();
+        }
+
+        void put(char c) {
+            if (m_pos == m_end) {
+                commit();
+                if (evbuffer_reserve_space(m_buf, reserve_size, &m_vec, 1) != 1) throw std::bad_alloc();
+                m_pos = static_cast<char *>(m_vec.iov_base);
+                m_end = m_pos + m_vec.iov_len;
+            }
+            *m_pos++ = c;
+        }
+
+        void commit() {
+            if (!m_vec.iov_base) return;
+            m_vec.iov_len = m_pos - static_cast<char *>(m_vec.iov_base);
+            evbuffer_commit_space(m_buf, &m_vec, 1);
+            m_vec.iov_base = nullptr;
+            m_pos = m_end = nullptr;
+        }
+
+        class iterator {
+            EvbufferWriter *m_writer;
+        public:
+            explicit iterator(EvbufferWriter *writer) : m_writer(writer) {}
+
+            iterator &operator*() {
+                return *this;
+            }
+
+            iterator &operator=(char c) {
+                m_writer->put(c);
+                return *this;
+            }
+
+            iterator &operator++() {
+                return *this;
+            }
+
+            iterator operator++(int) {
+                return *this;
+            }
+        };
+    };
+}
+
 NetSession::NetSession(long long unsigned serial, struct bufferevent *bev, Config::Listener const *listen)
-        : m_serial(serial), m_bev(nullptr),
+        : m_serial(serial), m_worker(Router::worker()), m_bev(nullptr),
           m_xml_stream(std::make_unique<XMLStream>(this, INBOUND, listen->session_type)) {
+    count_traffic(bev);
     bufferevent(bev);
     if (listen->session_type == X2X) {
         m_xml_stream->remote_domain(listen->remote_domain);
@@ -56,27 +119,28 @@ NetSession::NetSession(long long unsigned serial, struct bufferevent *bev, Confi
         stream_buf += "' from='";
         stream_buf += listen->remote_domain;
         stream_buf += "'>";
-        m_xml_stream->process(reinterpret_cast<unsigned char *>(const_cast<char *>(stream_buf.data())),
-                              stream_buf.size());
+        m_xml_stream->synthesize_stream_open(stream_buf);
         m_xml_stream->set_auth_ready();
     }
-    std::ostringstream ss;
-    ss << "NetSession serial=[" << serial << "] IN type=[" << listen->name << "] from=[" << m_xml_stream->local_domain() << "] to=[" << m_xml_stream->remote_domain() << "]";
-    m_logger = Config::config().logger(ss.str());
+    m_logger = Config::config().logger("NetSession", {{"serial", std::to_string(serial)}, {"dir", "IN"},
+                                                      {"listener", listen->name},
+                                                      {"from", m_xml_stream->local_domain()},
+                                                      {"to", m_xml_stream->remote_domain()}});
     m_logger->info("New INBOUND");
 }
 
 NetSession::NetSession(long long unsigned serial, struct bufferevent *bev, std::string const &stream_from,
                        std::string const &stream_to, SESSION_TYPE stype, TLS_MODE tls_mode)
-        : m_serial(serial), m_bev(nullptr),
+        : m_serial(serial), m_worker(Router::worker()), m_bev(nullptr),
           m_xml_stream(std::make_unique<XMLStream>(this, OUTBOUND, stype, stream_from, stream_to)) {
+    count_traffic(bev);
     bufferevent(bev);
     if (tls_mode == IMMEDIATE) {
         start_tls(*m_xml_stream, false);
     }
-    std::ostringstream ss;
-    ss << "NetSession serial=" << serial << " OUT from=" << m_xml_stream->local_domain() << " to=" << m_xml_stream->remote_domain();
-    m_logger = Config::config().logger(ss.str());
+    m_logger = Config::config().logger("NetSession", {{"serial", std::to_string(serial)}, {"dir", "OUT"},
+                                                      {"from", m_xml_stream->local_domain()},
+                                                      {"to", m_xml_stream->remote_domain()}});
     m_logger->info("New OUTBOUND");
 }
 
@@ -85,13 +149,59 @@ void NetSession::bufferevent(struct bufferevent *bev) {
         m_bev = nullptr;
         return;
     }
-    bufferevent_setcb(bev, NetSession::read_cb, NULL, NetSession::event_cb, this);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    bufferevent_setcb(bev, NetSession::read_cb, NetSession::write_cb, NetSession::event_cb, this);
+    bufferevent_setwatermark(bev, EV_WRITE, m_write_low, 0);
+    bufferevent_enable(bev, m_throttled ? EV_WRITE : EV_READ | EV_WRITE);
     m_bev = bev;
 }
 
+namespace {
+    const std::string bytes_in_name = "metre_session_received_bytes_total";
+    const std::string bytes_out_name = "metre_session_sent_bytes_total";
+    const std::string stanzas_in_name = "metre_session_received_stanzas_total";
+    const std::string stanzas_out_name = "metre_session_sent_stanzas_total";
+
+    void read_bytes_cb(struct evbuffer *, const struct evbuffer_cb_info *info, void *arg) {
+        if (info->n_added) static_cast<Metrics::Counter *>(arg)->inc(info->n_added);
+    }
+
+    void written_bytes_cb(struct evbuffer *, const struct evbuffer_cb_info *info, void *arg) {
+        if (info->n_deleted) static_cast<Metrics::Counter *>(arg)->inc(info->n_deleted);
+    }
+}
+
+/**
+ * Counts on the socket's own bufferevent, which stays at the bottom of the stack
+ * as TLS and compression filters go on top: octets added to its input were read,
+ * and octets drained from its output were written.
+ */
+void NetSession::count_traffic(struct bufferevent *bev) {
+    Metrics::Labels labels{{"session", std::to_string(m_serial)}};
+    m_bytes_in = &Metrics::counter(bytes_in_name, "Octets read from the network, per session.", labels);
+    m_bytes_out = &Metrics::counter(bytes_out_name, "Octets written to the network, per session.", labels);
+    m_stanzas_in = &Metrics::counter(stanzas_in_name, "Stanzas received, per session.", labels);
+    m_stanzas_out = &Metrics::counter(stanzas_out_name, "Stanzas sent, per session.", labels);
+    if (!bev) return;
+    evbuffer_add_cb(bufferevent_get_input(bev), read_bytes_cb, m_bytes_in);
+    evbuffer_add_cb(bufferevent_get_output(bev), written_bytes_cb, m_bytes_out);
+}
+
 NetSession::~NetSession() {
     if (m_bev) bufferevent_free(m_bev);
+    // Fold this session's traffic into its domain's totals.
+    auto const &remote = m_xml_stream->remote_domain();
+    if (!remote.empty()) {
+        Metrics::Labels domain{{"domain", remote}};
+        Metrics::counter("metre_domain_received_bytes_total", "Octets read from the network, per remote domain, from closed sessions.", domain).inc(m_bytes_in->value());
+        Metrics::counter("metre_domain_sent_bytes_total", "Octets written to the network, per remote domain, from closed sessions.", domain).inc(m_bytes_out->value());
+        Metrics::counter("metre_domain_received_stanzas_total", "Stanzas received, per remote domain, from closed sessions.", domain).inc(m_stanzas_in->value());
+        Metrics::counter("metre_domain_sent_stanzas_total", "Stanzas sent, per remote domain, from closed sessions.", domain).inc(m_stanzas_out->value());
+    }
+    Metrics::Labels labels{{"session", std::to_string(m_serial)}};
+    Metrics::remove(bytes_in_name, labels);
+    Metrics::remove(bytes_out_name, labels);
+    Metrics::remove(stanzas_in_name, labels);
+    Metrics::remove(stanzas_out_name, labels);
 }
 
 namespace {
@@ -109,33 +219,51 @@ namespace {
 }
 
 bool NetSession::drain() {
-    m_logger->trace("Drain");
+    METRE_TRACE(*m_logger, "Drain");
     if (m_in_progress) return false;
     auto latch = std::make_unique<Latch>(m_in_progress);
-    // While there is data, see how much we can consume with the XMLStream.
+    /**
+     * Scan new data in place, segment by segment, and only pull up once the XMLStream
+     * has a complete token to handle. Partial stanzas are neither copied nor reparsed.
+     */
     struct evbuffer *buf = nullptr; // This gets refreshed each time through the loops.
     size_t len;
-    while ((len = evbuffer_get_contiguous_space(buf = bufferevent_get_input(m_bev))) > 0) {
-        if (!m_xml_stream->closed()) {
-            size_t used = m_xml_stream->process(evbuffer_pullup(buf, len), len);
-            if (used == 0) {
-                break;
+    auto const &config = Config::config();
+    std::size_t stanzas = 0;
+    std::size_t bytes = 0;
+    while ((len = evbuffer_get_length(buf = bufferevent_get_input(m_bev))) > 0) {
+        if (m_xml_stream->closed() || m_xml_stream->frozen() || m_throttled) break;
+        if ((config.read_budget_stanzas() && stanzas >= config.read_budget_stanzas()) ||
+            (config.read_budget_bytes() && bytes >= config.read_budget_bytes())) {
+            // Let everyone else have a turn, then carry on.
+            read_later();
+            break;
+        }
+        size_t want = m_xml_stream->pending();
+        while (want == 0 && m_xml_stream->scanned() < len) {
+            struct evbuffer_ptr pos;
+            if (evbuffer_ptr_set(buf, &pos, m_xml_stream->scanned(), EVBUFFER_PTR_SET) != 0) break;
+            struct evbuffer_iovec vec[16];
+            int n = evbuffer_peek(buf, -1, &pos, vec, 16);
+            if (n <= 0) break;
+            for (int i = 0; i != std::min(n, 16) && want == 0; ++i) {
+                want = m_xml_stream->scan(reinterpret_cast<char const *>(vec[i].iov_base), vec[i].iov_len);
             }
-            //evbuffer_drain(buf, used);
-        } else {
+        }
+        if (want == 0) {
+            m_xml_stream->skip_whitespace();
             break;
         }
-    }
-    // If we can't consume it all, try pullup(), then return.
-    if ((len = evbuffer_get_length(buf = bufferevent_get_input(m_bev))) > 0) {
-        if (!m_xml_stream->closed()) {
-            m_xml_stream->process(evbuffer_pullup(buf, -1), len);
-        } else {
-            if (len > 0)
-                m_logger->warn("Stuff left after close: {}", len);
-            return true;
+        ++stanzas;
+        bytes += want;
+        if (m_xml_stream->process(evbuffer_pullup(buf, want), want) == 0) {
+            break;
         }
     }
+    if (m_xml_stream->closed() && (len = evbuffer_get_length(buf = bufferevent_get_input(m_bev))) > 0) {
+        m_logger->warn("Stuff left after close: {}", len);
+        return true;
+    }
     return m_xml_stream->closed() && (evbuffer_get_length(buf) == 0);
 }
 
@@ -151,15 +279,29 @@ void NetSession::send(rapidxml::xml_document<> &d) {
     if (!m_bev) {
         return;
     }
-    std::string tmp;
-    rapidxml::print(std::back_inserter(tmp), d, rapidxml::print_no_indenting);
     struct evbuffer *buf = bufferevent_get_output(m_bev);
     if (!buf) {
         return;
     }
-    m_logger->debug("Send: {}", tmp);
-    evbuffer_add(buf, tmp.data(),
-                 tmp.length()); // Crappy and inefficient; we want to generate a char *, write directly to it, and dump it into an iovec.
+    if (m_logger->should_log(spdlog::level::debug)) {
+        std::string tmp;
+        rapidxml::print(std::back_inserter(tmp), d, rapidxml::print_no_indenting);
+        METRE_DEBUG(*m_logger, "Send: {}", tmp);
+    }
+    EvbufferWriter writer(buf);
+    rapidxml::print(EvbufferWriter::iterator(&writer), d, rapidxml::print_no_indenting);
+}
+
+void NetSession::send(Stanza &s) {
+    if (!m_bev) {
+        return;
+    }
+    struct evbuffer *buf = bufferevent_get_output(m_bev);
+    if (!buf) {
+        return;
+    }
+    METRE_DEBUG(*m_logger, "Send stanza: name=[{}] id=[{}]", s.name(), s.id() ? *s.id() : "");
+    s.render(buf);
 }
 
 void NetSession::send(std::string const &s) {
@@ -167,7 +309,18 @@ void NetSession::send(std::string const &s) {
         return;
     }
     struct evbuffer *buf = bufferevent_get_output(m_bev);
-    m_logger->debug("Send string {}", s);
+    METRE_DEBUG(*m_logger, "Send string {}", s);
+    if (!buf) {
+        return;
+    }
+    evbuffer_add(buf, s.data(), s.length());
+}
+
+void NetSession::send(std::string_view s) {
+    if (!m_bev) {
+        return;
+    }
+    struct evbuffer *buf = bufferevent_get_output(m_bev);
     if (!buf) {
         return;
     }
@@ -180,10 +333,36 @@ void NetSession::send(const char *p) {
     //evbuffer_add(buf, p, std::strlen(p));
 }
 
+void NetSession::send(struct evbuffer *data) {
+    if (!m_bev) {
+        return;
+    }
+    struct evbuffer *buf = bufferevent_get_output(m_bev);
+    if (!buf) {
+        return;
+    }
+    METRE_DEBUG(*m_logger, "Send buffer: length=[{}]", evbuffer_get_length(data));
+    evbuffer_add_buffer(buf, data);
+}
+
+void NetSession::read_later() {
+    if (m_read_scheduled) return;
+    m_read_scheduled = true;
+    // Deferred work runs in order once per loop iteration, after polling, so busy sessions
+    // take turns with each other and with sockets that have just become readable.
+    Router::defer([serial = m_serial]() {
+        auto session = Router::session_by_serial(serial);
+        if (!session) return;
+        session->m_read_scheduled = false;
+        session->read();
+    });
+}
+
 void NetSession::read() {
-    m_logger->trace("Read");
+    METRE_TRACE(*m_logger, "Read");
+    if (m_read_scheduled) return; // Wait for our turn.
     if (drain()) {
-        m_logger->debug("Closing during read");
+        METRE_DEBUG(*m_logger, "Closing during read");
         onClosed.emit(*this);
     }
 }
@@ -193,8 +372,56 @@ void NetSession::read_cb(struct bufferevent *, void *arg) {
     ns.read();
 }
 
+void NetSession::write_cb(struct bufferevent *, void *arg) {
+    NetSession &ns = *reinterpret_cast<NetSession *>(arg);
+    ns.onWritable.emit(ns);
+}
+
+std::size_t NetSession::output_length() {
+    if (!m_bev) return 0;
+    return evbuffer_get_length(bufferevent_get_output(m_bev));
+}
+
+void NetSession::write_low_watermark(std::size_t low) {
+    m_write_low = low;
+    if (m_bev) bufferevent_setwatermark(m_bev, EV_WRITE, m_write_low, 0);
+}
+
+void NetSession::stanzas_received(std::size_t n) {
+    m_stanzas_in->inc(n);
+}
+
+void NetSession::stanzas_sent(std::size_t n) {
+    m_stanzas_out->inc(n);
+}
+
+void NetSession::handshake_started() {
+    m_handshake_start = std::chrono::steady_clock::now();
+}
+
+void NetSession::tune(Config::SocketOptions const &options) {
+    if (!m_bev) return;
+    options.apply(bufferevent_getfd(m_bev));
+    options.watermarks(m_bev);
+}
+
+void NetSession::throttle() {
+    if (m_throttled++ == 0) {
+        METRE_DEBUG(*m_logger, "Throttled");
+        if (m_bev) bufferevent_disable(m_bev, EV_READ);
+    }
+}
+
+void NetSession::unthrottle() {
+    if (m_throttled == 0 || --m_throttled != 0) return;
+    METRE_DEBUG(*m_logger, "Unthrottled");
+    if (!m_bev) return;
+    bufferevent_enable(m_bev, EV_READ);
+    read(); // Pick up whatever was already buffered.
+}
+
 void NetSession::bev_closed() {
-    m_logger->trace("BEV closed");
+    METRE_TRACE(*m_logger, "BEV closed");
     // TODO : I had this here, but I think it's useless. It causes a nasty wait-free loop, though.
     /*if (m_xml_stream->frozen()) {
         Router::defer([this]() {
@@ -206,7 +433,12 @@ void NetSession::bev_closed() {
 }
 
 void NetSession::bev_connected() {
-    m_logger->trace("BEV connected");
+    METRE_TRACE(*m_logger, "BEV connected");
+    if (m_handshake_start != std::chrono::steady_clock::time_point{}) {
+        static auto &handshake = Metrics::histogram("metre_tls_handshake_seconds", "Time taken by TLS handshakes.");
+        handshake.observe_since(m_handshake_start);
+        m_handshake_start = {};
+    }
     onConnected.emit(*this);
     m_xml_stream->restart();
 }
@@ -216,13 +448,13 @@ void NetSession::bev_connected() {
 
 void NetSession::event_cb(struct bufferevent *b, short events, void *arg) {
     NetSession &ns = *reinterpret_cast<NetSession *>(arg);
-    ns.m_logger->trace("Event callback");
+    METRE_TRACE(*ns.m_logger, "Event callback");
     if (b != ns.m_bev) {
-        ns.m_logger->debug("No, my BEV");
+        METRE_DEBUG(*ns.m_logger, "No, my BEV");
         return;
     }
     if (events & BEV_EVENT_EOF) {
-        ns.m_logger->debug("BEV EOF");
+        METRE_DEBUG(*ns.m_logger, "BEV EOF");
         ns.bev_closed();
     } else if (events & BEV_EVENT_TIMEOUT) {
         ns.m_logger->info("Timed out, closing");
@@ -246,7 +478,7 @@ void NetSession::close() {
         });
         return;
     }*/
-    m_logger->trace("Close");
+    METRE_TRACE(*m_logger, "Close");
     if (!m_bev) {
         return;
     }
@@ -29,74 +29,221 @@ SOFTWARE.
 #include "netsession.h"
 #include "log.h"
 #include "config.h"
+#include "metrics.h"
+#include "happyeyeballs.h"
 
 #include <unordered_map>
 #include <algorithm>
+#include <event2/buffer.h>
 
 using namespace Metre;
 
+namespace {
+    // RFC 8305 "Connection Attempt Delay".
+    constexpr std::chrono::milliseconds connection_attempt_delay{250};
+
+    /**
+     * Happy Eyeballs (RFC 8305) for outbound verify sessions, paced by HappyEyeballs.
+     * The first attempt to become auth-ready wins; the rest are closed.
+     */
+    class ConnectRace : public sigslot::has_slots {
+    public:
+        struct Candidate {
+            std::string hostname;
+            unsigned short port;
+            bool tls;
+            struct sockaddr_storage addr;
+        };
+
+        sigslot::signal<NetSession *> onComplete;
+
+        ConnectRace(std::string const &local, std::string const &domain, std::shared_ptr<spdlog::logger> const &logger)
+                : m_local(local), m_domain(domain), m_logger(logger),
+                  m_pacer(connection_attempt_delay, [this](std::size_t n) { return attempt(n); },
+                          [this]() { finish(nullptr); }) {}
+
+        ~ConnectRace() {
+            m_done = true;
+            m_pacer.stop();
+            for (auto &attempt : m_attempts) {
+                auto session = attempt.second.lock();
+                if (session) session->close();
+            }
+        }
+
+        // Adds a target's addresses, alternating address families, starting with IPv6.
+        void add(DNS::SrvRR const &rr, DNS::Address const &addr) {
+            std::vector<struct sockaddr_storage const *> v6, v4;
+            for (auto const &a : addr.addr) {
+                (a.ss_family == AF_INET6 ? v6 : v4).push_back(&a);
+            }
+            auto before = m_candidates.size();
+            for (std::size_t i = 0; i != std::max(v6.size(), v4.size()); ++i) {
+                if (i < v6.size()) m_candidates.push_back({rr.hostname, rr.port, rr.tls, *v6[i]});
+                if (i < v4.size()) m_candidates.push_back({rr.hostname, rr.port, rr.tls, *v4[i]});
+            }
+            if (!m_done) m_pacer.add(m_candidates.size() - before);
+        }
+
+        // No more candidates are coming.
+        void resolved() {
+            if (!m_done) m_pacer.resolved();
+        }
+
+        bool done() const {
+            return m_done;
+        }
+
+        NetSession *winner() const {
+            return m_winner;
+        }
+
+    private:
+        bool attempt(std::size_t n) {
+            auto &candidate = m_candidates[n];
+            try {
+                METRE_TRACE(*m_logger, "Connecting to address=[{}:{}]", candidate.hostname, candidate.port);
+                auto session = Router::connect(m_local, m_domain, candidate.hostname,
+                                               reinterpret_cast<struct sockaddr *>(&candidate.addr),
+                                               candidate.port, Config::config().domain(m_domain).transport_type(),
+                                               candidate.tls ? IMMEDIATE : STARTTLS);
+                METRE_TRACE(*m_logger, "Connected verify session: address=[{}:{}] serial=[{}]", candidate.hostname, candidate.port, session->serial());
+                m_attempts.emplace(session->serial(), session);
+                session->onClosed.connect(this, &ConnectRace::closed);
+                session->xml_stream().onAuthReady.connect(this, &ConnectRace::auth_ready);
+                return true;
+            } catch (std::runtime_error &e) {
+                m_logger->error("Verify session connection failed, reloop: error=[{}]", e.what());
+                return false;
+            }
+        }
+
+        void auth_ready(XMLStream &stream) {
+            if (m_done || !stream.auth_ready()) return;
+            finish(&stream.session());
+        }
+
+        void closed(NetSession &session) {
+            if (m_done) return;
+            METRE_TRACE(*m_logger, "Verify session attempt closed: serial=[{}]", session.serial());
+            m_attempts.erase(session.serial());
+            m_pacer.failed();
+        }
+
+        void finish(NetSession *winner) {
+            m_done = true;
+            m_winner = winner;
+            m_pacer.stop();
+            auto attempts = std::move(m_attempts);
+            m_attempts.clear();
+            for (auto &attempt : attempts) {
+                if (winner && attempt.first == winner->serial()) continue;
+                auto session = attempt.second.lock();
+                if (!session) continue;
+                METRE_TRACE(*m_logger, "Closing losing verify session: serial=[{}]", session->serial());
+                session->close();
+            }
+            onComplete.emit(winner);
+        }
+
+        std::string const m_local;
+        std::string const m_domain;
+        std::shared_ptr<spdlog::logger> m_logger;
+        std::vector<Candidate> m_candidates;
+        std::map<unsigned long long, std::weak_ptr<NetSession>> m_attempts;
+        bool m_done = false;
+        NetSession *m_winner = nullptr;
+        HappyEyeballs m_pacer;
+    };
+}
+
+namespace {
+    const char *priority_names[Route::priorities] = {"iq", "message", "presence"};
+}
+
+Route::PRIORITY Route::priority(Stanza const &s) {
+    std::string_view name{s.name()};
+    if (name == "presence") return PRESENCE;
+    if (name == "iq") return IQ;
+    return MESSAGE;
+}
+
 Route::Route(Jid const &from, Jid const &to) : m_local(from), m_domain(to) {
     if (m_domain.domain().empty() || m_local.domain().empty()) throw std::runtime_error("Cannot have route to/from empty domain");
-    auto sinks = Config::config().logger().sinks();
-    m_logger = std::make_shared<spdlog::logger>("Route from=[" + m_local.domain() + "] to=[" + m_domain.domain() + "]", begin(sinks), end(sinks));
-    m_logger->flush_on(spdlog::level::trace);
-    m_logger->set_level(spdlog::level::trace);
+    for (auto &lane : m_lanes) {
+        lane.bytes = evbuffer_new();
+        if (!lane.bytes) throw std::bad_alloc();
+    }
+    m_worker = Router::worker_for(m_domain.domain());
+    m_logger = Config::config().logger("Route", {{"from", m_local.domain()}, {"to", m_domain.domain()}});
+    Metrics::Labels labels{{"local", m_local.domain()}, {"remote", m_domain.domain()}};
+    m_queue_bytes = &Metrics::gauge("metre_route_queue_bytes", "Octets queued or unsent, per route.", labels);
+    m_queue_stanzas = &Metrics::gauge("metre_route_queue_stanzas", "Stanzas queued awaiting a session, per route.", labels);
+    for (std::size_t i = 0; i != priorities; ++i) {
+        auto lane_labels = labels;
+        lane_labels.emplace_back("priority", priority_names[i]);
+        m_lanes[i].depth = &Metrics::gauge("metre_route_lane_stanzas", "Stanzas queued, per route and priority class.", lane_labels);
+    }
+    m_session_setup = &Metrics::histogram("metre_route_session_setup_seconds", "Time to establish an authenticated session, per remote domain.", {{"remote", m_domain.domain()}});
     m_logger->log(spdlog::level::info, "Route created");
 }
 
+Route::~Route() {
+    Metrics::Labels labels{{"local", m_local.domain()}, {"remote", m_domain.domain()}};
+    for (std::size_t i = 0; i != priorities; ++i) {
+        evbuffer_free(m_lanes[i].bytes);
+        auto lane_labels = labels;
+        lane_labels.emplace_back("priority", priority_names[i]);
+        Metrics::remove("metre_route_lane_stanzas", lane_labels);
+    }
+    Metrics::remove("metre_route_queue_bytes", labels);
+    Metrics::remove("metre_route_queue_stanzas", labels);
+}
+
 sigslot::tasklet<bool> Route::init_session_vrfy() {
-    m_logger->debug("Verify session spin-up: domain=[{}]", m_domain);
-    auto res = Config::config().domain(m_domain.domain()).resolver();
+    METRE_DEBUG(*m_logger, "Verify session spin-up: domain=[{}]", m_domain);
+    auto res = Config::config().domain(m_domain.domain_id()).resolver();
     auto srv = co_await res->SrvLookup(m_domain.domain());
-    m_logger->trace("Verify session completed SRV lookup: domain=[{}]", m_domain);
+    METRE_TRACE(*m_logger, "Verify session completed SRV lookup: domain=[{}]", m_domain);
 
     if (!srv.error.empty()) {
         m_logger->warn("SRV Lookup for [{}] failed: [{}]", m_domain.domain(), srv.error);
         co_return false;
     }
     for (auto &rr : srv.rrs) {
-        m_logger->trace("Should look for [{}:{}]", rr.hostname, rr.port);
+        METRE_TRACE(*m_logger, "Should look for [{}:{}]", rr.hostname, rr.port);
         auto session = Router::session_by_address(rr.hostname, rr.port);
         if (session && !session->xml_stream().auth_ready()) {
-            m_logger->trace("Awaiting auth ready on verify session serial=[{}]", session->serial());
+            METRE_TRACE(*m_logger, "Awaiting auth ready on verify session serial=[{}]", session->serial());
             (void) co_await session->xml_stream().onAuthReady;
             if (!session->xml_stream().auth_ready()) {
-                m_logger->trace("Auth was not ready on verify session serial=[{}]", session->serial());
+                METRE_TRACE(*m_logger, "Auth was not ready on verify session serial=[{}]", session->serial());
                 continue;
             }
             set_vrfy(session);
-            m_logger->trace("Reused existing outgoing verify session to [{}:{}]", rr.hostname, rr.port);
+            METRE_TRACE(*m_logger, "Reused existing outgoing verify session to [{}:{}]", rr.hostname, rr.port);
             co_return true;
         }
     }
+    ConnectRace race(m_local.domain(), m_domain.domain(), m_logger);
     for (auto &rr : srv.rrs) {
-        m_logger->trace("Awaiting address lookup for verify session: hostname=[{}]", rr.hostname);
+        METRE_TRACE(*m_logger, "Awaiting address lookup for verify session: hostname=[{}]", rr.hostname);
         auto addr = co_await res->AddressLookup(rr.hostname);
+        if (race.done()) break;
         if (!addr.error.empty()) {
             m_logger->warn("A/AAAA Lookup for [{}] failed: [{}]", rr.hostname, addr.error);
             continue;
         }
-        for (auto &arr : addr.addr) {
-            try {
-                m_logger->trace("Connecting to address=[{}:{}]", rr.hostname, rr.port);
-                auto session = Router::connect(m_local.domain(), m_domain.domain(), rr.hostname,
-                                       const_cast<struct sockaddr *>(reinterpret_cast<const struct sockaddr *>(&arr)),
-                                       rr.port, Config::config().domain(m_domain.domain()).transport_type(),
-                                       rr.tls ? IMMEDIATE : STARTTLS);
-                m_logger->trace("Connected verify session: address=[{}:{}] serial=[{}]", rr.hostname, rr.port, session->serial());
-
-                m_logger->trace("Awaiting auth ready on verify session: serial=[{}]", session->serial());
-                (void) co_await session->xml_stream().onAuthReady;
-                if (!session->xml_stream().auth_ready()) {
-                    m_logger->trace("Auth was not ready on verify session: serial=[{}]", session->serial());
-                    continue;
-                }
-                set_vrfy(session);
-                m_logger->debug("New outgoing verify session: address=[{}:{}]", rr.hostname, rr.port);
-                co_return true;
-            } catch (std::runtime_error &e) {
-                m_logger->error("Verify session connection failed, reloop: error=[{}]", e.what());
-            }
+        race.add(rr, addr);
+    }
+    race.resolved();
+    NetSession *winner = race.done() ? race.winner() : co_await race.onComplete;
+    if (winner) {
+        auto session = Router::session_by_serial(winner->serial());
+        if (session) {
+            set_vrfy(session);
+            METRE_DEBUG(*m_logger, "New outgoing verify session: serial=[{}]", session->serial());
+            co_return true;
         }
     }
     m_logger->error("New outgoing verify session failed: domain=[{}]", m_domain);
@@ -104,63 +251,65 @@ sigslot::tasklet<bool> Route::init_session_vrfy() {
 }
 
 sigslot::tasklet<bool> Route::init_session_to() {
-    m_logger->debug("Stanza session spin-up");
-    auto session = Router::session_by_domain(m_domain.domain());
+    METRE_DEBUG(*m_logger, "Stanza session spin-up");
+    auto started = std::chrono::steady_clock::now();
+    auto session = Router::session_by_domain(m_domain.domain_id());
     if (!session) {
-        m_logger->debug("No existing session for domain=[{}]", m_domain);
+        METRE_DEBUG(*m_logger, "No existing session for domain=[{}]", m_domain);
         do {
             session = m_vrfy.lock();
-            m_logger->debug("Authenticating with verify session domain=[{}]", m_domain);
+            METRE_DEBUG(*m_logger, "Authenticating with verify session domain=[{}]", m_domain);
             if (!session) {
-                m_logger->debug("No verify session found");
+                METRE_DEBUG(*m_logger, "No verify session found");
                 if (!m_verify_task.running()) {
-                    m_logger->debug("No verify session task found, starting");
+                    METRE_DEBUG(*m_logger, "No verify session task found, starting");
                     m_verify_task = init_session_vrfy();
                     m_verify_task.start();
                 }
                 if (!co_await m_verify_task) {
-                    m_logger->debug("Verify task failed");
+                    METRE_DEBUG(*m_logger, "Verify task failed");
                     co_return false;
                 }
             }
         } while (!session);
-        m_logger->trace("Got verify session domain=[{}]", m_domain);
+        METRE_TRACE(*m_logger, "Got verify session domain=[{}]", m_domain);
     }
-    switch (session->xml_stream().s2s_auth_pair(m_local.domain(), m_domain.domain(), OUTBOUND)) {
+    switch (session->xml_stream().s2s_auth_pair(m_local.domain_id(), m_domain.domain_id(), OUTBOUND)) {
         default:
             if (!session->xml_stream().auth_ready()) {
-                m_logger->trace("Awaiting authentication ready: domain=[{}]");
+                METRE_TRACE(*m_logger, "Awaiting authentication ready: domain=[{}]");
                 (void) co_await session->xml_stream().onAuthReady;
             }
             /// Send a dialback request.
             {
-                m_logger->trace("Dialing back: domain=[{}]");
+                METRE_TRACE(*m_logger, "Dialing back: domain=[{}]");
                 std::string key = Config::config().dialback_key(session->xml_stream().stream_id(),
                                                                 m_local.domain(),
                                                                 m_domain.domain());
-                rapidxml::xml_document<> d;
-                auto dbr = d.allocate_node(rapidxml::node_element, "db:result");
-                dbr->append_attribute(d.allocate_attribute("to", m_domain.domain().c_str()));
-                dbr->append_attribute(d.allocate_attribute("from", m_local.domain().c_str()));
+                auto d = XMLPool::document();
+                auto dbr = d->allocate_node(rapidxml::node_element, "db:result");
+                dbr->append_attribute(d->allocate_attribute("to", m_domain.domain().c_str()));
+                dbr->append_attribute(d->allocate_attribute("from", m_local.domain().c_str()));
                 dbr->value(key.c_str(), key.length());
-                d.append_node(dbr);
-                session->xml_stream().send(d);
-                session->xml_stream().s2s_auth_pair(m_local.domain(), m_domain.domain(), OUTBOUND,
+                d->append_node(dbr);
+                session->xml_stream().send(*d);
+                session->xml_stream().s2s_auth_pair(m_local.domain_id(), m_domain.domain_id(), OUTBOUND,
                                                     XMLStream::REQUESTED);
             }
             // Fallthrough
         case XMLStream::REQUESTED:
-            m_logger->trace("Awaiting authentication: domain=[{}]");
+            METRE_TRACE(*m_logger, "Awaiting authentication: domain=[{}]");
             (void) co_await session->xml_stream().onAuthenticated;
         case XMLStream::AUTHORIZED:
-            m_logger->trace("Authorized: domain=[{}]");
+            METRE_TRACE(*m_logger, "Authorized: domain=[{}]");
             break;
     }
-    while (session->xml_stream().s2s_auth_pair(m_local.domain(), m_domain.domain(), OUTBOUND) != XMLStream::AUTHORIZED) {
-        m_logger->debug("Authenticating with verify session");
+    while (session->xml_stream().s2s_auth_pair(m_local.domain_id(), m_domain.domain_id(), OUTBOUND) != XMLStream::AUTHORIZED) {
+        METRE_DEBUG(*m_logger, "Authenticating with verify session");
         (void) co_await session->xml_stream().onAuthenticated;
     }
-    m_logger->trace("Setting 'to' session");
+    METRE_TRACE(*m_logger, "Setting 'to' session");
+    m_session_setup->observe_since(started);
     set_to(session);
     co_return true;
 }
@@ -168,19 +317,89 @@ sigslot::tasklet<bool> Route::init_session_to() {
 void Route::set_to(std::shared_ptr<Metre::NetSession> &to) {
     m_to = to;
     to->onClosed.connect(this, &Route::SessionClosed);
-    for (auto &s : m_stanzas) {
-        to->xml_stream().send(std::move(s));
+    to->onWritable.connect(this, &Route::SessionWritable);
+    to->write_low_watermark(Config::config().domain(m_domain.domain_id()).queue_low());
+    METRE_DEBUG(*m_logger, "Flushing queued stanzas: count=[{}]", queued());
+    Router::cancel(m_stanza_timer);
+    m_stanza_timer = 0;
+    flush(*to);
+    check_congestion();
+}
+
+bool Route::idle() const {
+    for (auto const &lane : m_lanes) {
+        if (!lane.stanzas.empty()) return false;
     }
-    m_stanzas.clear();
+    return true;
+}
+
+std::size_t Route::queued() const {
+    std::size_t n = 0;
+    for (auto const &lane : m_lanes) n += lane.stanzas.size();
+    return n;
+}
+
+void Route::flush(NetSession &to) {
+    auto const &domain = Config::config().domain(m_domain.domain_id());
+    auto const &weights = domain.priority_weights();
+    bool tracking = to.xml_stream().tracking(); // Stream Management needs them one at a time.
+    struct evbuffer *out = tracking ? nullptr : evbuffer_new();
+    std::string text;
+    std::size_t sent = 0;
+    std::size_t filled = to.output_length();
+    // Always send something into an empty buffer, or nothing would wake us again.
+    while (!idle() && (filled < domain.queue_low() || sent == 0)) {
+        for (std::size_t i = 0; i != priorities; ++i) {
+            auto &lane = m_lanes[i];
+            for (unsigned n = 0; n != weights[i] && !lane.stanzas.empty(); ++n) {
+                auto queued = lane.stanzas.pop_front();
+                if (tracking) {
+                    text.resize(queued.length);
+                    evbuffer_remove(lane.bytes, text.data(), text.length());
+                    to.xml_stream().forward(text);
+                } else {
+                    evbuffer_remove_buffer(lane.bytes, out, queued.length);
+                }
+                filled += queued.length;
+                ++sent;
+            }
+        }
+    }
+    if (out) {
+        to.stanzas_sent(sent);
+        to.send(out);
+        evbuffer_free(out);
+    }
+    METRE_DEBUG(*m_logger, "Flushed stanzas: count=[{}] remaining=[{}]", sent, queued());
+}
+
+void Route::start_session_to() {
+    if (m_to_task.running()) return;
+    METRE_DEBUG(*m_logger, "No current task");
+    m_to_task = init_session_to();
+    m_to_task.start();
+}
+
+void Route::resume() {
+    // Likely called as the old session closes, so let that finish first.
+    Router::on_worker(m_worker, [self = shared_from_this()]() {
+        Router::defer([self]() {
+            auto to = self->m_to.lock();
+            if (to && !to->xml_stream().closed()) return;
+            self->m_to.reset();
+            self->start_session_to();
+        });
+    });
 }
 
 void Route::set_vrfy(std::shared_ptr<Metre::NetSession> &vrfy) {
     m_vrfy = vrfy;
     vrfy->onClosed.connect(this, &Route::SessionClosed);
-    for (auto &v : m_dialback) {
-        vrfy->xml_stream().send(std::move(v));
+    while (!m_dialback.empty()) {
+        vrfy->xml_stream().send(m_dialback.pop_front());
     }
-    m_dialback.clear();
+    Router::cancel(m_dialback_timer);
+    m_dialback_timer = 0;
 }
 
 /**
@@ -191,11 +410,15 @@ void Route::set_vrfy(std::shared_ptr<Metre::NetSession> &vrfy) {
  * @param ns - NetSession of inbound session.
  */
 void Route::outbound(NetSession *ns) {
-    m_logger->debug("Outbound NetSession: serial=[{}]", ns->serial());
-    auto to = m_to.lock();
     if (!ns) {
         return;
     }
+    METRE_DEBUG(*m_logger, "Outbound NetSession: serial=[{}]", ns->serial());
+    if (ns->worker() != m_worker) {
+        METRE_DEBUG(*m_logger, "Session belongs to another worker, not switching");
+        return;
+    }
+    auto to = m_to.lock();
     if (to && (to->serial() == ns->serial())) return;
     if (to) {
         to->close(); // Kill with fire.
@@ -205,18 +428,35 @@ void Route::outbound(NetSession *ns) {
 }
 
 void Route::queue(std::unique_ptr<DB::Verify> &&s) {
-    m_logger->trace("Queue verify: name=[{}] from=[{}] to=[{}]", s->Stanza::name(), s->from(), s->to());
+    METRE_TRACE(*m_logger, "Queue verify: name=[{}] from=[{}] to=[{}]", s->Stanza::name(), s->from(), s->to());
     s->freeze();
     if (m_dialback.empty())
-        Router::defer([this]() {
+        m_dialback_timer = Router::defer([this]() {
+            m_dialback_timer = 0;
             bounce_dialback(true);
-        }, Config::config().domain(m_domain.domain()).stanza_timeout());
+        }, std::chrono::seconds(Config::config().domain(m_domain.domain_id()).stanza_timeout()));
     m_dialback.push_back(std::move(s));
-    m_logger->debug("Route queued verify local=[{}] domain=[{}]", m_local, m_domain);
+    METRE_DEBUG(*m_logger, "Route queued verify local=[{}] domain=[{}]", m_local, m_domain);
+}
+
+/**
+ * Routes, and their sessions, belong to a single worker. Anything arriving from another
+ * worker is handed over, frozen, to be transmitted there.
+ */
+template<typename S>
+bool Route::handoff(std::unique_ptr<S> &s) {
+    if (Router::worker() == m_worker) return false;
+    s->freeze();
+    auto holder = std::make_shared<std::unique_ptr<S>>(std::move(s));
+    Router::on_worker(m_worker, [self = shared_from_this(), holder]() {
+        self->transmit(std::move(*holder));
+    });
+    return true;
 }
 
 void Route::transmit(std::unique_ptr<DB::Verify> &&v) {
-    m_logger->trace("Transmit verify: name=[{}] from=[{}] to=[{}]", v->Stanza::name(), v->from(), v->to());
+    if (handoff(v)) return;
+    METRE_TRACE(*m_logger, "Transmit verify: name=[{}] from=[{}] to=[{}]", v->Stanza::name(), v->from(), v->to());
     auto vrfy = m_vrfy.lock();
     if (vrfy) {
         vrfy->xml_stream().send(std::move(v));
@@ -230,7 +470,7 @@ void Route::transmit(std::unique_ptr<DB::Verify> &&v) {
 }
 
 void Route::bounce_dialback(bool timeout) {
-    if (m_stanzas.empty()) {
+    if (idle()) {
         return;
     }
     m_logger->warn("Timeout of verify sessions: timeout=[{}]", timeout);
@@ -242,16 +482,20 @@ void Route::bounce_dialback(bool timeout) {
 }
 
 void Route::bounce_stanzas(Stanza::Error e) {
-    if (m_stanzas.empty()) {
+    if (idle()) {
         return;
     }
     m_logger->warn("Timeout on stanzas error=[{}]", e);
-    for (auto &stanza : m_stanzas) {
-        if (stanza->type_str() && *stanza->type_str() == "error") continue;
-        auto bounce = stanza->create_bounce(e);
-        RouteTable::routeTable(bounce->from()).route(bounce->to())->transmit(std::move(bounce));
+    for (auto &lane : m_lanes) {
+        evbuffer_drain(lane.bytes, evbuffer_get_length(lane.bytes));
+        while (!lane.stanzas.empty()) {
+            auto stanza = std::move(lane.stanzas.pop_front().stanza);
+            if (stanza->type_str() && *stanza->type_str() == "error") continue;
+            auto bounce = stanza->create_bounce(e);
+            RouteTable::routeTable(bounce->from()).route(bounce->to())->transmit(std::move(bounce));
+        }
     }
-    m_stanzas.clear();
+    check_congestion();
     auto to = m_to.lock();
     if (to) {
         to->close();
@@ -260,38 +504,134 @@ void Route::bounce_stanzas(Stanza::Error e) {
 }
 
 void Route::queue(std::unique_ptr<Stanza> &&s) {
-    m_logger->trace("Queue stanza: name=[{}] from=[{}] to=[{}]", s->name(), s->from(), s->to());
-    s->freeze();
-    if (m_stanzas.empty())
-        Router::defer([this]() {
+    METRE_TRACE(*m_logger, "Queue stanza: name=[{}] from=[{}] to=[{}]", s->name(), s->from(), s->to());
+    if (!m_stanza_timer)
+        m_stanza_timer = Router::defer([this]() {
+            m_stanza_timer = 0;
             bounce_stanzas(Stanza::remote_server_timeout);
-        }, Config::config().domain(m_domain.domain()).stanza_timeout());
-    m_stanzas.push_back(std::move(s));
-    m_logger->debug("Queued stanza");
+        }, std::chrono::seconds(Config::config().domain(m_domain.domain_id()).stanza_timeout()));
+    enqueue(std::move(s));
+}
+
+void Route::enqueue(std::unique_ptr<Stanza> &&s) {
+    s->freeze();
+    auto &lane = m_lanes[priority(*s)];
+    // Serialize now, so the flush is a buffer move. Large payloads go over by
+    // reference, leaving just the headers behind for a bounce.
+    auto before = evbuffer_get_length(lane.bytes);
+    s->render(lane.bytes);
+    lane.stanzas.push_back({std::move(s), evbuffer_get_length(lane.bytes) - before});
+    METRE_DEBUG(*m_logger, "Queued stanza: count=[{}] length=[{}]", lane.stanzas.size(), evbuffer_get_length(lane.bytes));
 }
 
 void Route::transmit(std::unique_ptr<Stanza> &&s) {
-    m_logger->trace("Transmit stanza: name=[{}] from=[{}] to=[{}]", s->name(), s->from(), s->to());
+    if (handoff(s)) return;
+    METRE_TRACE(*m_logger, "Transmit stanza: name=[{}] from=[{}] to=[{}]", s->name(), s->from(), s->to());
+    auto max = Config::config().domain(m_domain.domain_id()).queue_max();
+    if (max && pending() >= max && !(s->type_str() && *s->type_str() == "error")) {
+        m_logger->warn("Queue full, bouncing stanza: pending=[{}]", pending());
+        auto bounce = s->create_bounce(Stanza::resource_constraint);
+        RouteTable::routeTable(bounce->from()).route(bounce->to())->transmit(std::move(bounce));
+        return;
+    }
     auto to = m_to.lock();
-    if (to) {
-        m_logger->debug("Existing stanza session: serial=[{}]", to->serial());
+    if (to && idle() && to->output_length() < Config::config().domain(m_domain.domain_id()).queue_low()) {
+        METRE_DEBUG(*m_logger, "Existing stanza session: serial=[{}]", to->serial());
         to->xml_stream().send(move(s));
+    } else if (to) {
+        METRE_DEBUG(*m_logger, "Stanza session backed up: serial=[{}]", to->serial());
+        enqueue(std::move(s));
     } else {
-        m_logger->debug("No stanza session");
+        METRE_DEBUG(*m_logger, "No stanza session");
         queue(std::move(s));
-        if (!m_to_task.running()) {
-            m_logger->debug("No current task");
-            m_to_task = init_session_to();
-            m_to_task.start();
-        }
+        start_session_to();
     }
-    m_logger->trace("Stanza accepted");
+    check_congestion();
+    METRE_TRACE(*m_logger, "Stanza accepted");
+}
+
+bool Route::forward(std::string_view text) {
+    if (Router::worker() != m_worker) return false;
+    auto to = m_to.lock();
+    if (!to) return false;
+    auto const &domain = Config::config().domain(m_domain.domain_id());
+    if (domain.queue_max() && pending() >= domain.queue_max()) return false; // Let transmit() bounce it.
+    if (!idle() || to->output_length() >= domain.queue_low()) return false; // Let transmit() queue it in order.
+    to->xml_stream().forward(text);
+    check_congestion();
+    return true;
+}
+
+void Route::requeue(NetSession &closed, std::list<std::unique_ptr<Stanza>> &&stanzas) {
+    if (Router::worker() == m_worker) {
+        auto to = m_to.lock();
+        if (to.get() == &closed) m_to.reset();
+    }
+    requeue(std::move(stanzas));
+}
+
+void Route::requeue(std::list<std::unique_ptr<Stanza>> &&stanzas) {
+    m_logger->info("Resending unacknowledged stanzas: count=[{}]", stanzas.size());
+    for (auto &s : stanzas) {
+        transmit(std::move(s));
+    }
+}
+
+std::size_t Route::pending() {
+    auto to = m_to.lock();
+    std::size_t bytes = to ? to->output_length() : 0;
+    for (auto const &lane : m_lanes) bytes += evbuffer_get_length(lane.bytes);
+    return bytes;
+}
+
+void Route::check_congestion() {
+    auto const &domain = Config::config().domain(m_domain.domain_id());
+    auto bytes = pending();
+    m_queue_bytes->set(static_cast<std::int64_t>(bytes));
+    m_queue_stanzas->set(static_cast<std::int64_t>(queued()));
+    for (auto &lane : m_lanes) lane.depth->set(static_cast<std::int64_t>(lane.stanzas.size()));
+    if (!m_congested) {
+        if (bytes < domain.queue_high()) return;
+        std::lock_guard<std::mutex> l(m_throttle_mutex);
+        m_congested = true;
+        m_logger->info("Congested: pending=[{}]", bytes);
+        return;
+    }
+    if (bytes > domain.queue_low()) return;
+    std::vector<std::pair<unsigned, unsigned long long>> throttled;
+    {
+        std::lock_guard<std::mutex> l(m_throttle_mutex);
+        m_congested = false;
+        throttled.swap(m_throttled);
+    }
+    m_logger->info("Drained: pending=[{}] resuming=[{}]", bytes, throttled.size());
+    for (auto const &t : throttled) {
+        auto serial = t.second;
+        Router::on_worker(t.first, [serial]() {
+            auto session = Router::session_by_serial(serial);
+            if (session) session->unthrottle();
+        });
+    }
+}
+
+void Route::throttle(NetSession &source) {
+    if (!m_congested) return;
+    std::lock_guard<std::mutex> l(m_throttle_mutex);
+    if (!m_congested) return;
+    m_throttled.emplace_back(source.worker(), source.serial());
+    source.throttle();
+}
+
+void Route::SessionWritable(NetSession &n) {
+    auto to = m_to.lock();
+    if (to.get() == &n && !idle()) flush(n);
+    check_congestion();
 }
 
 void Route::SessionClosed(NetSession &n) {
-    m_logger->debug("Net Session closed");
+    METRE_DEBUG(*m_logger, "Net Session closed");
     // One of my sessions has been closed. See what needs progressing.
-    if (!m_dialback.empty() || !m_stanzas.empty()) {
+    if (!m_dialback.empty() || !idle()) {
         auto vrfy = m_vrfy.lock();
         if (vrfy && (vrfy.get() == &n)) {
             m_vrfy.reset();
@@ -300,30 +640,62 @@ void Route::SessionClosed(NetSession &n) {
             auto to = m_to.lock();
             if (to.get() == &n) {
                 m_to.reset();
+                if (!idle()) {
+                    // Backlog held for a session that's gone; wait for a new one, or bounce.
+                    if (!m_stanza_timer)
+                        m_stanza_timer = Router::defer([this]() {
+                            m_stanza_timer = 0;
+                            bounce_stanzas(Stanza::remote_server_timeout);
+                        }, std::chrono::seconds(Config::config().domain(m_domain.domain_id()).stanza_timeout()));
+                    Router::defer([self = shared_from_this()]() {
+                        if (!self->m_to.lock() && !self->idle()) self->start_session_to();
+                    });
+                }
             }
         }
     }
+    if (m_congested) {
+        // Whatever was unsent on it is gone.
+        auto to = m_to.lock();
+        if (to.get() == &n) m_to.reset();
+        check_congestion();
+    }
 }
 
-RouteTable &RouteTable::routeTable(std::string const &d) {
-    static std::unordered_map<std::string, RouteTable> rt;
+RouteTable &RouteTable::routeTable(DomainId const &d) {
+    static std::unordered_map<DomainId, RouteTable> rt;
+    static std::mutex rt_mutex;
+    std::lock_guard<std::mutex> lock(rt_mutex);
     auto it = rt.find(d);
     if (it != rt.end()) return (*it).second;
-    auto itp = rt.emplace(d, d);
+    auto itp = rt.emplace(d, d.str());
     return (*(itp.first)).second;
 }
 
+RouteTable &RouteTable::routeTable(std::string const &d) {
+    return RouteTable::routeTable(DomainId(d));
+}
+
 RouteTable &RouteTable::routeTable(Jid const &j) {
-    return RouteTable::routeTable(j.domain());
+    return RouteTable::routeTable(j.domain_id());
 }
 
 std::shared_ptr<Route> &RouteTable::route(Jid const &to) {
     // TODO This needs to be more complex once we have clients.
-    auto it = m_routes.find(to.domain());
+    return route(to.domain_id());
+}
+
+std::shared_ptr<Route> &RouteTable::route(std::string const &domain) {
+    return route(DomainId(domain));
+}
+
+std::shared_ptr<Route> &RouteTable::route(DomainId const &domain) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_routes.find(domain);
     if (it != m_routes.end()) {
         return (*it).second;
     }
-    auto itp = m_routes.emplace(to.domain(), std::make_shared<Route>(m_local_domain, to.domain()));
+    auto itp = m_routes.emplace(domain, std::make_shared<Route>(m_local_domain, domain.str()));
     return (*(itp.first)).second;
 }
 
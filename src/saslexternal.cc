@@ -94,11 +94,11 @@ namespace {
                 authzid = Jid(base64_decode(authzid)).domain();
             }
             if (authzid.empty()) {
-                xml_document<> d;
-                auto n = d.allocate_node(node_element, "challenge");
-                n->append_attribute(d.allocate_attribute("xmlns", sasl_ns.c_str()));
-                d.append_node(n);
-                m_stream.send(d);
+                auto d = XMLPool::document();
+                auto n = d->allocate_node(node_element, "challenge");
+                n->append_attribute(d->allocate_attribute("xmlns", sasl_ns.c_str()));
+                d->append_node(n);
+                m_stream.send(*d);
                 co_return
                 true;
             }
@@ -108,11 +108,11 @@ namespace {
             std::shared_ptr<Route> &route = RouteTable::routeTable(m_stream.local_domain()).route(
                     m_stream.remote_domain());
             if (co_await *m_stream.start_task("SASL EXTERNAL response tls_auth_ok", m_stream.tls_auth_ok(*route))) {
-                xml_document<> d;
-                auto n = d.allocate_node(node_element, "success");
-                n->append_attribute(d.allocate_attribute("xmlns", sasl_ns.c_str()));
-                d.append_node(n);
-                m_stream.send(d);
+                auto d = XMLPool::document();
+                auto n = d->allocate_node(node_element, "success");
+                n->append_attribute(d->allocate_attribute("xmlns", sasl_ns.c_str()));
+                d->append_node(n);
+                m_stream.send(*d);
                 m_stream.s2s_auth_pair(m_stream.local_domain(), authzid, INBOUND, XMLStream::AUTHORIZED);
                 m_stream.set_auth_ready();
                 m_stream.restart();
@@ -124,15 +124,15 @@ namespace {
 
         void challenge(rapidxml::xml_node<> *node) {
             // Odd case - we have already told them.
-            xml_document<> d;
-            auto n = d.allocate_node(node_element, "response");
-            n->append_attribute(d.allocate_attribute("xmlns", sasl_ns.c_str()));
+            auto d = XMLPool::document();
+            auto n = d->allocate_node(node_element, "response");
+            n->append_attribute(d->allocate_attribute("xmlns", sasl_ns.c_str()));
             std::string authzid = base64_encode(
                     reinterpret_cast<unsigned const char *>(m_stream.local_domain().c_str()),
                     m_stream.local_domain().size());
             n->value(m_stream.local_domain().c_str());
-            d.append_node(n);
-            m_stream.send(d);
+            d->append_node(n);
+            m_stream.send(*d);
         }
 
         void success(rapidxml::xml_node<> *node) {
@@ -181,15 +181,15 @@ namespace {
                 }
             }
             if (!external_found) return false;
-            xml_document<> d;
-            auto n = d.allocate_node(node_element, "auth");
-            n->append_attribute(d.allocate_attribute("xmlns", sasl_ns.c_str()));
-            auto mech = d.allocate_attribute("mechanism", "EXTERNAL");
+            auto d = XMLPool::document();
+            auto n = d->allocate_node(node_element, "auth");
+            n->append_attribute(d->allocate_attribute("xmlns", sasl_ns.c_str()));
+            auto mech = d->allocate_attribute("mechanism", "EXTERNAL");
             n->append_attribute(mech);
             std::string authzid = base64_encode(m_stream.local_domain());
             n->value(authzid.c_str());
-            d.append_node(n);
-            m_stream.send(d);
+            d->append_node(n);
+            m_stream.send(*d);
             return true;
         }
     };
@@ -0,0 +1,472 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "feature.h"
+#include "router.h"
+#include "netsession.h"
+#include "stanza.h"
+#include "config.h"
+#include "log.h"
+
+#include <event2/buffer.h>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+
+using namespace Metre;
+using namespace rapidxml;
+
+namespace {
+    const std::string sm_ns = "urn:xmpp:sm:3";
+    const std::string stanza_error_ns = "urn:ietf:params:xml:ns:xmpp-stanzas";
+
+    // How long state for a dropped session is kept for it to be resumed.
+    constexpr std::chrono::seconds resume_timeout{300};
+    // Ask for an acknowledgement once this many stanzas are outstanding, or after ack_delay.
+    constexpr std::uint32_t ack_batch = 16;
+    constexpr std::chrono::milliseconds ack_delay{1000};
+
+    struct State {
+        std::string id; // Empty unless resumable.
+        std::string local;
+        std::string remote;
+        std::uint32_t h_in = 0; // Stanzas handled from the peer.
+        std::uint32_t h_out = 0; // Stanzas sent; the last unacked.size() of them are in unacked.
+        RingBuffer<std::string> unacked;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    /**
+     * State left by closed sessions, for resumption. Outbound it's found by route,
+     * inbound by the id we gave out.
+     */
+    class Resumable {
+        std::mutex m_mutex;
+        std::map<std::string, std::shared_ptr<State>> m_states;
+
+    public:
+        // Returns whatever was displaced, which can no longer be resumed.
+        std::shared_ptr<State> put(std::string const &key, std::shared_ptr<State> const &state) {
+            state->expires = std::chrono::steady_clock::now() + resume_timeout;
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto &slot = m_states[key];
+            auto old = std::move(slot);
+            slot = state;
+            return old;
+        }
+
+        // Expired state is left for drop(), so its stanzas aren't lost.
+        std::shared_ptr<State> take(std::string const &key) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_states.find(key);
+            if (it == m_states.end() || it->second->expires < std::chrono::steady_clock::now()) return nullptr;
+            auto state = it->second;
+            m_states.erase(it);
+            return state;
+        }
+
+        bool drop(std::string const &key, std::shared_ptr<State> const &state) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_states.find(key);
+            if (it == m_states.end() || it->second != state) return false;
+            m_states.erase(it);
+            return true;
+        }
+
+        static Resumable &resumable() {
+            static Resumable r;
+            return r;
+        }
+    };
+
+    std::string outbound_key(std::string const &local, std::string const &remote) {
+        return std::string("out\0", 4) + local + '\0' + remote;
+    }
+
+    std::string inbound_key(std::string const &id) {
+        return std::string("in\0", 3) + id;
+    }
+
+    std::list<std::unique_ptr<Stanza>> parse(RingBuffer<std::string> &unacked) {
+        std::list<std::unique_ptr<Stanza>> stanzas;
+        while (!unacked.empty()) {
+            auto text = unacked.pop_front();
+            try {
+                auto doc = XMLPool::document();
+                doc->parse<parse_fastest>(text.data());
+                auto node = doc->first_node();
+                if (!node) continue;
+                doc->fixup<parse_default>(node, false); // Just terminate the header.
+                std::string_view name(node->name(), node->name_size());
+                std::unique_ptr<Stanza> s;
+                if (name == Message::name) {
+                    s = std::make_unique<Message>(node);
+                } else if (name == Iq::name) {
+                    s = std::make_unique<Iq>(node);
+                } else if (name == Presence::name) {
+                    s = std::make_unique<Presence>(node);
+                } else {
+                    continue;
+                }
+                s->freeze();
+                stanzas.push_back(std::move(s));
+            } catch (std::exception &e) {
+                METRE_LOG(Metre::Log::WARNING, "Dropping unacknowledged stanza: [" << e.what() << "]");
+            }
+        }
+        return stanzas;
+    }
+
+    // Unacknowledged stanzas go back to the Route once they can't be resent on a resumed stream.
+    void requeue(State &state) {
+        auto stanzas = parse(state.unacked);
+        if (stanzas.empty()) return;
+        RouteTable::routeTable(state.local).route(state.remote)->requeue(std::move(stanzas));
+    }
+
+    void keep(std::string const &key, std::shared_ptr<State> const &state) {
+        auto old = Resumable::resumable().put(key, state);
+        if (old) requeue(*old);
+        Router::defer([key, state]() {
+            if (Resumable::resumable().drop(key, state)) {
+                METRE_LOG(Metre::Log::INFO, "Stream resumption expired: resending=[" << state->unacked.size() << "]");
+                requeue(*state);
+            }
+        }, resume_timeout);
+    }
+
+    /**
+     * XEP-0198 Stream Management. Stanzas are counted both ways; those sent are kept
+     * until acknowledged. If a resumable session drops, whatever's unacknowledged stays
+     * with its saved state and is resent, in order, once the peer says what it had on
+     * resumption. Only if that fails or times out does it go back to the Route.
+     */
+    class StreamManagement : public Feature, public StanzaTracker, public sigslot::has_slots {
+        enum class Mode {
+            OFF, ENABLING, RESUMING, ACTIVE, CLOSED
+        };
+        Mode m_mode = Mode::OFF;
+        std::shared_ptr<State> m_state;
+        std::uint32_t m_requested = 0; // h_out when we last asked for an acknowledgement.
+        Router::TimerHandle m_ack_timer = 0;
+
+    public:
+        explicit StreamManagement(XMLStream &s) : Feature(s) {}
+
+        ~StreamManagement() override {
+            Router::cancel(m_ack_timer);
+        }
+
+        class Description : public Feature::Description<StreamManagement> {
+        public:
+            Description() : Feature::Description<StreamManagement>(sm_ns, FEAT_POSTAUTH) {};
+
+            sigslot::tasklet<bool> offer(xml_node<> *node, XMLStream &s) override {
+                if (s.x2x_mode()) co_return false;
+                xml_document<> *d = node->document();
+                auto feature = d->allocate_node(node_element, "sm");
+                feature->append_attribute(d->allocate_attribute("xmlns", sm_ns.c_str()));
+                node->append_node(feature);
+                co_return true;
+            }
+
+            Feature::Type type(XMLStream &s) override {
+                return s.x2x_mode() ? FEAT_NONE : FEAT_POSTAUTH;
+            }
+        };
+
+        // Outbound; wait until we're authenticated before enabling.
+        bool negotiate(rapidxml::xml_node<> *) override {
+            m_stream.onAuthenticated.connect(this, &StreamManagement::authenticated);
+            return false;
+        }
+
+        sigslot::tasklet<bool> handle(rapidxml::xml_node<> *node) override {
+            std::string_view name(node->name(), node->name_size());
+            if (name == "r") {
+                if (m_mode != Mode::ACTIVE) throw Metre::unsupported_stanza_type("Stream Management not enabled");
+                send("a", {{"h", std::to_string(m_state->h_in)}});
+            } else if (name == "a") {
+                if (m_mode != Mode::ACTIVE) throw Metre::unsupported_stanza_type("Stream Management not enabled");
+                ack(counter(node));
+            } else if (name == "enable") {
+                enable_inbound(node);
+            } else if (name == "resume") {
+                resume_inbound(node);
+            } else if (name == "enabled") {
+                if (m_mode != Mode::ENABLING) throw Metre::unsupported_stanza_type("Unexpected enabled");
+                auto resume = node->first_attribute("resume");
+                auto id = node->first_attribute("id");
+                if (resume && id && truth(resume)) m_state->id.assign(id->value(), id->value_size());
+                m_mode = Mode::ACTIVE;
+                m_stream.logger().info("Stream Management enabled: resumable=[{}]", !m_state->id.empty());
+                if (!m_state->unacked.empty()) request_ack();
+            } else if (name == "resumed") {
+                if (m_mode != Mode::RESUMING) throw Metre::unsupported_stanza_type("Unexpected resumed");
+                ack(counter(node));
+                m_mode = Mode::ACTIVE;
+                m_stream.logger().info("Stream resumed: resending=[{}]", m_state->unacked.size());
+                resend();
+            } else if (name == "failed") {
+                failed();
+            } else {
+                throw Metre::unsupported_stanza_type("Unknown Stream Management element");
+            }
+            co_return true;
+        }
+
+        void sent(Stanza &s) override {
+            std::unique_ptr<struct evbuffer, decltype(&evbuffer_free)> buf(evbuffer_new(), evbuffer_free);
+            if (!buf) throw std::bad_alloc();
+            s.render(buf.get());
+            std::string text(evbuffer_get_length(buf.get()), '\0');
+            evbuffer_remove(buf.get(), text.data(), text.length());
+            track(std::move(text));
+        }
+
+        void sent(std::string_view s) override {
+            track(std::string(s));
+        }
+
+        void received() override {
+            if (m_mode == Mode::ACTIVE) ++m_state->h_in;
+        }
+
+        // Slots
+        void authenticated(XMLStream &) {
+            if (m_mode != Mode::OFF) return;
+            if (m_stream.s2s_auth_pair(m_stream.local_domain(), m_stream.remote_domain(), OUTBOUND) !=
+                XMLStream::AUTHORIZED) {
+                return;
+            }
+            m_state = Resumable::resumable().take(outbound_key(m_stream.local_domain(), m_stream.remote_domain()));
+            if (m_state) {
+                // Anything sent from here is held until we know what the peer already has.
+                m_mode = Mode::RESUMING;
+                send("resume", {{"previd", m_state->id}, {"h", std::to_string(m_state->h_in)}});
+            } else {
+                m_state = fresh();
+                enable();
+            }
+            install();
+        }
+
+        void closed(NetSession &session) {
+            if (m_mode == Mode::OFF || m_mode == Mode::CLOSED) return;
+            Router::cancel(m_ack_timer);
+            m_ack_timer = 0;
+            bool resumable = !m_state->id.empty() && m_mode != Mode::ENABLING;
+            if (resumable) {
+                auto key = (m_stream.direction() == OUTBOUND)
+                           ? outbound_key(m_state->local, m_state->remote)
+                           : inbound_key(m_state->id);
+                keep(key, m_state);
+                if (m_stream.direction() == OUTBOUND) {
+                    RouteTable::routeTable(m_state->local).route(m_state->remote)->resume();
+                }
+                m_state.reset();
+                m_mode = Mode::CLOSED;
+                return;
+            }
+            auto stanzas = parse(m_state->unacked);
+            m_state.reset();
+            m_mode = Mode::CLOSED;
+            requeue(session, std::move(stanzas));
+        }
+
+    private:
+        static bool truth(xml_attribute<> *attr) {
+            std::string_view v(attr->value(), attr->value_size());
+            return v == "true" || v == "1";
+        }
+
+        static std::uint32_t counter(xml_node<> *node) {
+            auto h = node->first_attribute("h");
+            if (!h) throw Metre::bad_format("Missing h attribute");
+            std::uint32_t value = 0;
+            auto end = h->value() + h->value_size();
+            auto res = std::from_chars(h->value(), end, value);
+            if (res.ec != std::errc() || res.ptr != end) throw Metre::bad_format("Bad h attribute");
+            return value;
+        }
+
+        void send(const char *name, std::initializer_list<std::pair<const char *, std::string>> attrs = {},
+                  const char *condition = nullptr) {
+            auto d = XMLPool::document();
+            auto element = d->allocate_node(node_element, name);
+            element->append_attribute(d->allocate_attribute("xmlns", sm_ns.c_str()));
+            for (auto const &attr : attrs) {
+                element->append_attribute(d->allocate_attribute(attr.first, d->allocate_string(attr.second.c_str(), attr.second.length() + 1)));
+            }
+            if (condition) {
+                auto cond = d->allocate_node(node_element, condition);
+                cond->append_attribute(d->allocate_attribute("xmlns", stanza_error_ns.c_str()));
+                element->append_node(cond);
+            }
+            d->append_node(element);
+            m_stream.send(*d);
+        }
+
+        std::shared_ptr<State> fresh() {
+            auto state = std::make_shared<State>();
+            state->local = m_stream.local_domain();
+            state->remote = m_stream.remote_domain();
+            return state;
+        }
+
+        void install() {
+            m_stream.tracker(this);
+            m_stream.session().onClosed.connect(this, &StreamManagement::closed);
+        }
+
+        void enable() {
+            m_mode = Mode::ENABLING;
+            m_requested = m_state->h_out;
+            send("enable", {{"resume", "true"}});
+        }
+
+        void enable_inbound(xml_node<> *node) {
+            if (m_state) {
+                send("failed", {}, "unexpected-request");
+                return;
+            }
+            if (m_stream.s2s_auth_pair(m_stream.local_domain(), m_stream.remote_domain(), INBOUND) !=
+                XMLStream::AUTHORIZED) {
+                send("failed", {}, "not-authorized");
+                return;
+            }
+            m_state = fresh();
+            auto resume = node->first_attribute("resume");
+            m_mode = Mode::ACTIVE;
+            install();
+            if (resume && truth(resume)) {
+                m_state->id = Config::config().random_identifier();
+                send("enabled", {{"id",     m_state->id},
+                                 {"resume", "true"},
+                                 {"max",    std::to_string(resume_timeout.count())}});
+            } else {
+                send("enabled");
+            }
+            m_stream.logger().info("Stream Management enabled: resumable=[{}]", !m_state->id.empty());
+        }
+
+        void resume_inbound(xml_node<> *node) {
+            auto previd = node->first_attribute("previd");
+            auto h = counter(node);
+            std::shared_ptr<State> state;
+            if (!m_state && previd) {
+                state = Resumable::resumable().take(inbound_key(std::string(previd->value(), previd->value_size())));
+            }
+            if (state && (state->local != m_stream.local_domain() || state->remote != m_stream.remote_domain() ||
+                          m_stream.s2s_auth_pair(state->local, state->remote, INBOUND) != XMLStream::AUTHORIZED)) {
+                state.reset();
+            }
+            if (!state) {
+                send("failed", {}, "item-not-found");
+                return;
+            }
+            m_state = state;
+            m_mode = Mode::ACTIVE;
+            install();
+            ack(h);
+            send("resumed", {{"previd", m_state->id}, {"h", std::to_string(m_state->h_in)}});
+            m_stream.logger().info("Stream resumed: resending=[{}]", m_state->unacked.size());
+            resend();
+        }
+
+        void failed() {
+            if (m_mode == Mode::RESUMING) {
+                // The peer has no idea what it had; start again and send the lot through the Route.
+                m_stream.logger().info("Stream resumption failed: resending=[{}]", m_state->unacked.size());
+                auto old = m_state;
+                m_state = fresh();
+                enable();
+                ::requeue(*old);
+            } else if (m_mode == Mode::ENABLING) {
+                // Everything was written as it went, so just stop counting.
+                m_stream.logger().info("Stream Management refused");
+                m_stream.tracker(nullptr);
+                m_state.reset();
+                m_mode = Mode::OFF;
+            }
+        }
+
+        void track(std::string &&text) {
+            if (m_mode == Mode::CLOSED) {
+                RingBuffer<std::string> late;
+                late.push_back(std::move(text));
+                requeue(m_stream.session(), parse(late));
+                return;
+            }
+            ++m_state->h_out;
+            if (m_mode != Mode::RESUMING) m_stream.session().send(std::string_view(text));
+            m_state->unacked.push_back(std::move(text));
+            if (m_mode == Mode::ACTIVE) request_ack();
+        }
+
+        void ack(std::uint32_t h) {
+            auto outstanding = static_cast<std::uint32_t>(m_state->unacked.size());
+            std::uint32_t n = h - (m_state->h_out - outstanding);
+            if (n > outstanding) {
+                m_stream.logger().warn("Peer acknowledged unsent stanzas: h=[{}] sent=[{}]", h, m_state->h_out);
+                n = outstanding;
+            }
+            while (n--) m_state->unacked.pop_front();
+        }
+
+        void request_ack() {
+            if (m_state->h_out - m_requested >= ack_batch) {
+                m_requested = m_state->h_out;
+                send("r");
+                return;
+            }
+            if (m_ack_timer) return;
+            m_ack_timer = Router::defer([this]() {
+                m_ack_timer = 0;
+                if (m_mode == Mode::ACTIVE && m_requested != m_state->h_out) {
+                    m_requested = m_state->h_out;
+                    send("r");
+                }
+            }, ack_delay);
+        }
+
+        void resend() {
+            for (std::size_t i = 0; i != m_state->unacked.size(); ++i) {
+                m_stream.session().send(std::string_view(m_state->unacked[i]));
+            }
+            if (m_mode == Mode::ACTIVE && !m_state->unacked.empty()) request_ack();
+        }
+
+        void requeue(NetSession &session, std::list<std::unique_ptr<Stanza>> &&stanzas) {
+            if (stanzas.empty()) return;
+            auto &route = RouteTable::routeTable(m_stream.local_domain()).route(m_stream.remote_domain());
+            route->requeue(session, std::move(stanzas));
+        }
+    };
+
+    DECLARE_FEATURE(StreamManagement, S2S);
+}
@@ -27,14 +27,74 @@ SOFTWARE.
 #include "xmlstream.h"
 #include "rapidxml_print.hpp"
 #include "log.h"
+#include <cstring>
+#include <string_view>
+#include <event2/buffer.h>
 
 using namespace Metre;
 
+namespace {
+    // Payloads smaller than this are cheaper to copy than to chain by reference.
+    constexpr std::size_t min_reference_payload = 512;
+
+    std::size_t escaped_length(std::string_view s) {
+        std::size_t len = s.length();
+        for (auto c : s) {
+            switch (c) {
+                case '&':
+                    len += 4;
+                    break;
+                case '<':
+                case '>':
+                    len += 3;
+                    break;
+                case '\'':
+                case '"':
+                    len += 5;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return len;
+    }
+
+    char *append(char *out, std::string_view s) {
+        std::memcpy(out, s.data(), s.length());
+        return out + s.length();
+    }
+
+    char *escape(char *out, std::string_view s) {
+        for (auto c : s) {
+            switch (c) {
+                case '&':
+                    out = append(out, "&amp;");
+                    break;
+                case '<':
+                    out = append(out, "&lt;");
+                    break;
+                case '>':
+                    out = append(out, "&gt;");
+                    break;
+                case '\'':
+                    out = append(out, "&apos;");
+                    break;
+                case '"':
+                    out = append(out, "&quot;");
+                    break;
+                default:
+                    *out++ = c;
+            }
+        }
+        return out;
+    }
+}
+
 Stanza::Stanza(const char *name, rapidxml::xml_node<> const *node) : m_name(name), m_node(node) {
     auto to = node->first_attribute("to");
-    if (to) m_to = Jid(to->value());
+    if (to) m_to = Jid(std::string_view{to->value(), to->value_size()});
     auto from = node->first_attribute("from");
-    if (from) m_from = Jid(from->value());
+    if (from) m_from = Jid(std::string_view{from->value(), from->value_size()});
     auto typestr = node->first_attribute("type");
     if (typestr) m_type_str = typestr->value();
     auto id = node->first_attribute("id");
@@ -97,16 +157,72 @@ void Stanza::render(rapidxml::xml_document<> &d) {
     d.append_node(hdr);
 }
 
+void Stanza::render(struct evbuffer *buf) {
+    std::string_view name{m_name};
+    std::pair<std::string_view, std::string const *> attrs[] = {
+            {"to",   m_to ? &m_to->full() : nullptr},
+            {"from", m_from ? &m_from->full() : nullptr},
+            {"type", m_type_str ? &*m_type_str : nullptr},
+            {"id",   m_id ? &*m_id : nullptr}
+    };
+    bool empty = !(m_payload && m_payload_l);
+    std::size_t len = 1 + name.length() + (empty ? 2 : 1);
+    for (auto const &attr : attrs) {
+        if (attr.second) len += attr.first.length() + 4 + escaped_length(*attr.second);
+    }
+    struct evbuffer_iovec vec;
+    if (evbuffer_reserve_space(buf, len, &vec, 1) != 1) throw std::bad_alloc();
+    char *out = static_cast<char *>(vec.iov_base);
+    *out++ = '<';
+    out = append(out, name);
+    for (auto const &attr : attrs) {
+        if (!attr.second) continue;
+        *out++ = ' ';
+        out = append(out, attr.first);
+        out = append(out, "='");
+        out = escape(out, *attr.second);
+        *out++ = '\'';
+    }
+    out = append(out, empty ? "/>" : ">");
+    vec.iov_len = len;
+    evbuffer_commit_space(buf, &vec, 1);
+    if (empty) return;
+    if (m_payload == m_payload_str.data() && m_payload_l >= min_reference_payload) {
+        // Frozen; the evbuffer takes ownership of the payload until it's written out.
+        auto owned = new std::string(std::move(m_payload_str));
+        m_payload = nullptr;
+        m_payload_l = 0;
+        m_node = nullptr;
+        if (0 != evbuffer_add_reference(buf, owned->data(), owned->length(),
+                                        [](const void *, size_t, void *arg) {
+                                            delete reinterpret_cast<std::string *>(arg);
+                                        }, owned)) {
+            delete owned;
+            throw std::bad_alloc();
+        }
+    } else {
+        evbuffer_add(buf, m_payload, m_payload_l);
+    }
+    len = name.length() + 3;
+    if (evbuffer_reserve_space(buf, len, &vec, 1) != 1) throw std::bad_alloc();
+    out = static_cast<char *>(vec.iov_base);
+    out = append(out, "</");
+    out = append(out, name);
+    *out = '>';
+    vec.iov_len = len;
+    evbuffer_commit_space(buf, &vec, 1);
+}
+
 rapidxml::xml_node<> const *Stanza::node() {
     if (m_node) return m_node;
-    rapidxml::xml_document<> tmp_doc;
+    auto tmp_doc = XMLPool::document();
     std::string tmp{m_payload, m_payload_l}; // Copy the buffer.
     m_payload = tmp.data();
     m_payload_l = tmp.length(); // Reset pointers to buffer.
-    render(tmp_doc);
+    render(*tmp_doc);
     m_payload_str.clear();
-    rapidxml::print(std::back_inserter(m_payload_str), *(tmp_doc.first_node()), rapidxml::print_no_indenting);
-    m_doc.reset(new rapidxml::xml_document<>);
+    rapidxml::print(std::back_inserter(m_payload_str), *(tmp_doc->first_node()), rapidxml::print_no_indenting);
+    m_doc = XMLPool::document();
     m_doc->parse<rapidxml::parse_full>(const_cast<char *>(m_payload_str.c_str()));
     m_node = m_doc->first_node();
     return m_node;
@@ -129,18 +245,18 @@ std::unique_ptr<Stanza> Stanza::create_bounce(base::stanza_exception const &ex)
 
 void Stanza::render_error(Metre::base::stanza_exception const &ex) {
     // Render the error
-    rapidxml::xml_document<> d;
-    auto error = d.allocate_node(rapidxml::node_element, "error");
-    error->append_attribute(d.allocate_attribute("type", ex.error_type()));
-    d.append_node(error);
-    auto condition = d.allocate_node(rapidxml::node_element, ex.element_name());
-    condition->append_attribute(d.allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-stanzas"));
+    auto d = XMLPool::document();
+    auto error = d->allocate_node(rapidxml::node_element, "error");
+    error->append_attribute(d->allocate_attribute("type", ex.error_type()));
+    d->append_node(error);
+    auto condition = d->allocate_node(rapidxml::node_element, ex.element_name());
+    condition->append_attribute(d->allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-stanzas"));
     error->append_node(condition);
-    auto text = d.allocate_node(rapidxml::node_element, "text");
-    text->append_attribute(d.allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-stanzas"));
+    auto text = d->allocate_node(rapidxml::node_element, "text");
+    text->append_attribute(d->allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-stanzas"));
     text->value(ex.what());
     error->append_node(text);
-    rapidxml::print(std::back_inserter(m_payload_str), d, rapidxml::print_no_indenting);
+    rapidxml::print(std::back_inserter(m_payload_str), *d, rapidxml::print_no_indenting);
 }
 
 void Stanza::render_error(Stanza::Error e) {
@@ -174,6 +290,8 @@ std::unique_ptr<Stanza> Stanza::create_bounce(Stanza::Error e) const {
             return create_bounce(stanza_remote_server_not_found());
         case service_unavailable:
             return create_bounce(stanza_service_unavailable());
+        case resource_constraint:
+            return create_bounce(stanza_resource_constraint());
         case undefined_condition:
             return create_bounce(stanza_undefined_condition());
         default:
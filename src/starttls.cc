@@ -32,6 +32,14 @@ SOFTWARE.
 #include "log.h"
 #include "tls.h"
 #include <memory>
+#include <algorithm>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <map>
 
 #include <event2/bufferevent_ssl.h>
 #include <openssl/ssl.h>
@@ -39,12 +47,23 @@ SOFTWARE.
 #include <openssl/rand.h>
 #include <dhparams.h>
 #include <openssl/x509v3.h>
+#include <openssl/hmac.h>
+#include <openssl/ocsp.h>
 #include <evdns.h>
 #include <http.h>
 
 using namespace Metre;
 using namespace rapidxml;
 namespace {
+    // The session's TLS, wherever it is in the stack of filters (XEP-0138 compression sits above it).
+    SSL *session_ssl(NetSession &session) {
+        for (struct bufferevent *bev = session.bufferevent(); bev; bev = bufferevent_get_underlying(bev)) {
+            SSL *ssl = bufferevent_openssl_get_ssl(bev);
+            if (ssl) return ssl;
+        }
+        return nullptr;
+    }
+
     DH *dh_callback(SSL *, int, int keylength) {
         if (keylength < 2048) {
             METRE_LOG(Metre::Log::DEBUG, "DH used 1024");
@@ -79,6 +98,418 @@ namespace {
             SSL_set_tmp_dh_callback(ssl, dh_callback<2048>);
         }
     }
+
+    /**
+     * Outbound sessions, for resumption on reconnect. Keyed by local domain, remote domain,
+     * and the host and port actually connected to; shared between worker threads.
+     */
+    class SessionCache {
+    public:
+        static constexpr std::size_t max_sessions = 4096;
+
+        ~SessionCache() {
+            for (auto &entry : m_lru) SSL_SESSION_free(entry.second);
+        }
+
+        // Returns a new reference, or nullptr.
+        SSL_SESSION *get(std::string const &key) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_index.find(key);
+            if (it == m_index.end()) return nullptr;
+            SSL_SESSION *sess = it->second->second;
+            if (!SSL_SESSION_is_resumable(sess)) {
+                SSL_SESSION_free(sess);
+                m_lru.erase(it->second);
+                m_index.erase(it);
+                return nullptr;
+            }
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            SSL_SESSION_up_ref(sess);
+            return sess;
+        }
+
+        // Takes ownership of the reference.
+        void put(std::string const &key, SSL_SESSION *sess) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_index.find(key);
+            if (it != m_index.end()) {
+                SSL_SESSION_free(it->second->second);
+                it->second->second = sess;
+                m_lru.splice(m_lru.begin(), m_lru, it->second);
+                return;
+            }
+            m_lru.emplace_front(key, sess);
+            m_index[key] = m_lru.begin();
+            if (m_lru.size() > max_sessions) {
+                SSL_SESSION_free(m_lru.back().second);
+                m_index.erase(m_lru.back().first);
+                m_lru.pop_back();
+            }
+        }
+
+        static SessionCache &cache() {
+            static SessionCache s_cache;
+            return s_cache;
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::list<std::pair<std::string, SSL_SESSION *>> m_lru;
+        std::unordered_map<std::string, std::list<std::pair<std::string, SSL_SESSION *>>::iterator> m_index;
+    };
+
+    // SSL ex_data slot holding the SessionCache key for outbound connections.
+    int session_key_index() {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+                                                [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+                                                    delete static_cast<std::string *>(ptr);
+                                                });
+        return index;
+    }
+
+    int new_session_cb(SSL *ssl, SSL_SESSION *sess) {
+        if (SSL_is_server(ssl)) return 0;
+        auto key = static_cast<std::string *>(SSL_get_ex_data(ssl, session_key_index()));
+        if (!key) return 0;
+        SessionCache::cache().put(*key, sess);
+        return 1; // We keep the reference.
+    }
+
+    /**
+     * Session ticket keys, shared by every SSL_CTX. A new key takes over issuing each
+     * tls_ticket_lifetime; tickets under the previous key are still accepted, but renewed.
+     */
+    class TicketKeys {
+    public:
+        struct Key {
+            unsigned char name[16];
+            unsigned char hmac[32];
+            unsigned char aes[32];
+        };
+
+        int callback(unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            rotate();
+            if (enc) {
+                if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) return -1;
+                std::memcpy(key_name, m_current.name, sizeof(m_current.name));
+                EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), nullptr, m_current.aes, iv);
+                HMAC_Init_ex(hctx, m_current.hmac, sizeof(m_current.hmac), EVP_sha256(), nullptr);
+                return 1;
+            }
+            Key const *key = nullptr;
+            int ret = 1;
+            if (0 == std::memcmp(key_name, m_current.name, sizeof(m_current.name))) {
+                key = &m_current;
+            } else if (m_have_previous && 0 == std::memcmp(key_name, m_previous.name, sizeof(m_previous.name))) {
+                key = &m_previous;
+                ret = 2; // Valid, but issue a fresh ticket.
+            }
+            if (!key) return 0;
+            HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), nullptr);
+            EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), nullptr, key->aes, iv);
+            return ret;
+        }
+
+        static TicketKeys &keys() {
+            static TicketKeys s_keys;
+            return s_keys;
+        }
+
+    private:
+        void rotate() {
+            auto now = std::chrono::steady_clock::now();
+            if (m_created != std::chrono::steady_clock::time_point{} &&
+                now - m_created < std::chrono::seconds(Config::config().tls_ticket_lifetime())) {
+                return;
+            }
+            if (m_created != std::chrono::steady_clock::time_point{}) {
+                m_previous = m_current;
+                m_have_previous = true;
+            }
+            if (RAND_bytes(reinterpret_cast<unsigned char *>(&m_current), sizeof(m_current)) != 1) {
+                throw std::runtime_error("Cannot generate session ticket key");
+            }
+            m_created = now;
+        }
+
+        std::mutex m_mutex;
+        Key m_current;
+        Key m_previous;
+        bool m_have_previous = false;
+        std::chrono::steady_clock::time_point m_created;
+    };
+
+    int ticket_key_cb(SSL *, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx,
+                      int enc) {
+        try {
+            return TicketKeys::keys().callback(key_name, iv, ectx, hctx, enc);
+        } catch (std::exception &e) {
+            Config::config().logger().error("Session ticket key failure: {}", e.what());
+            return -1;
+        }
+    }
+}
+
+namespace {
+    std::chrono::steady_clock::time_point asn1_expiry(ASN1_TIME const *t) {
+        int days = 0, secs = 0;
+        if (!t || !ASN1_TIME_diff(&days, &secs, nullptr, t)) return std::chrono::steady_clock::now();
+        return std::chrono::steady_clock::now() + std::chrono::hours(24 * days) + std::chrono::seconds(secs);
+    }
+
+    /**
+     * verify_tls verdicts, shared between worker threads. Entries last no longer than the
+     * certificate, any CRL consulted, or the DNS records (SRV and TLSA) used.
+     */
+    class VerifyCache {
+    public:
+        static constexpr std::size_t max_entries = 10000;
+        static constexpr unsigned max_lifetime = 3600;
+        static constexpr unsigned max_negative_lifetime = 60;
+
+        static std::string key(X509 *cert, std::string const &local, std::string const &remote) {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int len = 0;
+            if (!X509_digest(cert, EVP_sha256(), md, &len)) return std::string();
+            return std::string(reinterpret_cast<char *>(md), len) + local + '\0' + remote;
+        }
+
+        std::optional<bool> get(std::string const &key) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_entries.find(key);
+            if (it == m_entries.end()) return std::nullopt;
+            if (it->second.expires <= std::chrono::steady_clock::now()) {
+                m_lru.erase(it->second.lru);
+                m_entries.erase(it);
+                return std::nullopt;
+            }
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+            return it->second.valid;
+        }
+
+        void put(std::string const &key, bool valid, std::chrono::steady_clock::time_point expires) {
+            if (expires <= std::chrono::steady_clock::now()) return;
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_entries.find(key);
+            if (it != m_entries.end()) {
+                it->second.valid = valid;
+                it->second.expires = expires;
+                m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+                return;
+            }
+            m_lru.push_front(key);
+            m_entries.emplace(key, Entry{valid, expires, m_lru.begin()});
+            if (m_entries.size() > max_entries) {
+                m_entries.erase(m_lru.back());
+                m_lru.pop_back();
+            }
+        }
+
+        static VerifyCache &cache() {
+            static VerifyCache s_cache;
+            return s_cache;
+        }
+
+    private:
+        struct Entry {
+            bool valid;
+            std::chrono::steady_clock::time_point expires;
+            std::list<std::string>::iterator lru;
+        };
+
+        std::mutex m_mutex;
+        std::list<std::string> m_lru;
+        std::unordered_map<std::string, Entry> m_entries;
+    };
+
+    // Verifications running on this worker, by VerifyCache key.
+    thread_local std::map<std::string, std::shared_ptr<sigslot::signal<bool>>> s_verify_in_flight;
+
+    // Registers a running verification; waiters get false if it never completes.
+    class InFlight {
+    public:
+        explicit InFlight(std::string const &key) : m_key(key), m_done(std::make_shared<sigslot::signal<bool>>()) {
+            s_verify_in_flight[m_key] = m_done;
+        }
+
+        void complete(bool valid) {
+            if (!m_done) return;
+            s_verify_in_flight.erase(m_key);
+            auto done = std::move(m_done);
+            done->emit(valid);
+        }
+
+        ~InFlight() {
+            complete(false);
+        }
+
+    private:
+        std::string m_key;
+        std::shared_ptr<sigslot::signal<bool>> m_done;
+    };
+}
+
+namespace {
+    // The issuer of cert, from the chain if present there, otherwise the trust store.
+    X509 *find_issuer(X509 *cert, STACK_OF(X509) *chain, X509_STORE *store) {
+        for (int i = 0; chain && i != sk_X509_num(chain); ++i) {
+            X509 *candidate = sk_X509_value(chain, i);
+            if (X509_check_issued(candidate, cert) == X509_V_OK) {
+                X509_up_ref(candidate);
+                return candidate;
+            }
+        }
+        X509 *issuer = nullptr;
+        X509_STORE_CTX *st = X509_STORE_CTX_new();
+        if (X509_STORE_CTX_init(st, store, cert, chain) == 1) {
+            if (X509_STORE_CTX_get1_issuer(&issuer, st, cert) != 1) issuer = nullptr;
+        }
+        X509_STORE_CTX_free(st);
+        return issuer;
+    }
+
+    /**
+     * Checks an OCSP response for cert, which must be signed acceptably and current.
+     * Returns V_OCSP_CERTSTATUS_GOOD or _REVOKED, or -1 if the response is unusable.
+     */
+    int ocsp_status(std::string const &der, X509 *cert, STACK_OF(X509) *chain, X509_STORE *store,
+                    std::chrono::steady_clock::time_point *expires) {
+        auto p = reinterpret_cast<const unsigned char *>(der.data());
+        std::unique_ptr<OCSP_RESPONSE, decltype(&OCSP_RESPONSE_free)> resp{
+                d2i_OCSP_RESPONSE(nullptr, &p, static_cast<long>(der.size())), &OCSP_RESPONSE_free};
+        if (!resp || OCSP_response_status(resp.get()) != OCSP_RESPONSE_STATUS_SUCCESSFUL) return -1;
+        std::unique_ptr<OCSP_BASICRESP, decltype(&OCSP_BASICRESP_free)> basic{OCSP_response_get1_basic(resp.get()),
+                                                                            &OCSP_BASICRESP_free};
+        if (!basic || OCSP_basic_verify(basic.get(), chain, store, 0) != 1) return -1;
+        X509 *issuer = find_issuer(cert, chain, store);
+        if (!issuer) return -1;
+        std::unique_ptr<OCSP_CERTID, decltype(&OCSP_CERTID_free)> id{OCSP_cert_to_id(nullptr, cert, issuer),
+                                                                    &OCSP_CERTID_free};
+        X509_free(issuer);
+        int status = -1, reason = 0;
+        ASN1_GENERALIZEDTIME *revoked = nullptr, *this_update = nullptr, *next_update = nullptr;
+        if (!id || OCSP_resp_find_status(basic.get(), id.get(), &status, &reason, &revoked, &this_update,
+                                         &next_update) != 1) {
+            return -1;
+        }
+        if (OCSP_check_validity(this_update, next_update, 300, -1) != 1) return -1;
+        if (expires && next_update) *expires = std::min(*expires, asn1_expiry(next_update));
+        if (status != V_OCSP_CERTSTATUS_GOOD && status != V_OCSP_CERTSTATUS_REVOKED) return -1;
+        return status;
+    }
+
+    /**
+     * OCSP responses for our own certificates, stapled in server-side handshakes. Each
+     * context's response is refetched halfway to its nextUpdate, by the first worker.
+     */
+    class Stapler {
+    public:
+        static constexpr unsigned retry = 300;
+        static constexpr unsigned max_refresh = 86400;
+
+        void add(SSL_CTX *ctx) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            if (m_staples.find(ctx) != m_staples.end()) return;
+            SSL_CTX_up_ref(ctx);
+            m_staples[ctx];
+        }
+
+        std::string response(SSL_CTX *ctx) {
+            std::lock_guard<std::mutex> l(m_mutex);
+            auto it = m_staples.find(ctx);
+            return it == m_staples.end() ? std::string() : it->second.response;
+        }
+
+        void start() {
+            std::lock_guard<std::mutex> l(m_mutex);
+            for (auto &staple : m_staples) {
+                if (staple.second.task.running()) continue;
+                staple.second.task = refresh(staple.first);
+                staple.second.task.start();
+            }
+        }
+
+        static Stapler &stapler() {
+            static Stapler s_stapler;
+            return s_stapler;
+        }
+
+    private:
+        sigslot::tasklet<bool> refresh(SSL_CTX *ctx) {
+            unsigned next = retry;
+            X509 *cert = SSL_CTX_get0_certificate(ctx);
+            STACK_OF(X509) *chain = nullptr;
+            SSL_CTX_get0_chain_certs(ctx, &chain);
+            X509_STORE *store = SSL_CTX_get_cert_store(ctx);
+            X509 *issuer = cert ? find_issuer(cert, chain, store) : nullptr;
+            STACK_OF(OPENSSL_STRING) *uris = cert ? X509_get1_ocsp(cert) : nullptr;
+            if (!issuer || !uris || sk_OPENSSL_STRING_num(uris) == 0) {
+                Config::config().logger().info("OCSP stapling unavailable: no issuer or responder for certificate");
+                X509_free(issuer);
+                X509_email_free(uris);
+                co_return false;
+            }
+            std::string uri = sk_OPENSSL_STRING_value(uris, 0);
+            X509_email_free(uris);
+            std::string request;
+            {
+                OCSP_REQUEST *req = OCSP_REQUEST_new();
+                OCSP_request_add0_id(req, OCSP_cert_to_id(nullptr, cert, issuer));
+                unsigned char *der = nullptr;
+                int len = i2d_OCSP_REQUEST(req, &der);
+                if (len > 0) request.assign(reinterpret_cast<char *>(der), static_cast<std::size_t>(len));
+                OPENSSL_free(der);
+                OCSP_REQUEST_free(req);
+            }
+            X509_free(issuer);
+            std::string uristr, response;
+            int code;
+            std::tie(uristr, code, response) = co_await Http::ocsp(uri, request);
+            auto expires = std::chrono::steady_clock::time_point::max();
+            if ((code / 100) == 2 && ocsp_status(response, cert, chain, store, &expires) != -1) {
+                {
+                    std::lock_guard<std::mutex> l(m_mutex);
+                    m_staples[ctx].response = response;
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (expires > now) {
+                    auto half = std::chrono::duration_cast<std::chrono::seconds>(expires - now).count() / 2;
+                    next = static_cast<unsigned>(std::clamp<long long>(half, retry, max_refresh));
+                }
+                Config::config().logger().info("OCSP staple fetched from {}; refreshing in {}s", uri, next);
+            } else {
+                Config::config().logger().warn("OCSP staple fetch from {} failed: code {}", uri, code);
+            }
+            Router::defer([this, ctx]() {
+                std::lock_guard<std::mutex> l(m_mutex);
+                auto &staple = m_staples[ctx];
+                staple.task = refresh(ctx);
+                staple.task.start();
+            }, std::chrono::seconds(next));
+            co_return true;
+        }
+
+        struct Staple {
+            std::string response;
+            sigslot::tasklet<bool> task;
+        };
+
+        std::mutex m_mutex;
+        std::map<SSL_CTX *, Staple> m_staples;
+    };
+
+    // Server side: staple, if asked and we have one. Client side: accept; verify_tls checks it.
+    int status_cb(SSL *ssl, void *) {
+        if (!SSL_is_server(ssl)) return 1;
+        std::string response = Stapler::stapler().response(SSL_get_SSL_CTX(ssl));
+        if (response.empty()) return SSL_TLSEXT_ERR_NOACK;
+        auto copy = static_cast<unsigned char *>(OPENSSL_malloc(response.size()));
+        if (!copy) return SSL_TLSEXT_ERR_NOACK;
+        std::memcpy(copy, response.data(), response.size());
+        SSL_set_tlsext_status_ocsp_resp(ssl, copy, static_cast<long>(response.size())); // Takes ownership.
+        return SSL_TLSEXT_ERR_OK;
+    }
 }
 
 namespace {
@@ -116,17 +547,17 @@ namespace {
             if ((name == "starttls" && m_stream.direction() == INBOUND) ||
                 (name == "proceed" && m_stream.direction() == OUTBOUND)) {
                 if (!m_stream.remote_domain().empty()) {
-                    m_stream.logger().debug("Negotiating TLS");
+                    METRE_DEBUG(m_stream.logger(), "Negotiating TLS");
                     start_tls(m_stream, true);
                     co_return true;
                 } else if (m_stream.type() == COMP) {
                     start_tls(m_stream, true);
                     co_return true;
                 } else {
-                    xml_document<> doc;
-                    auto failure = doc.allocate_node(node_element, "failure");
-                    failure->append_attribute(doc.allocate_attribute("xmlns", tls_ns.c_str()));
-                    m_stream.send(doc);
+                    auto doc = XMLPool::document();
+                    auto failure = doc->allocate_node(node_element, "failure");
+                    failure->append_attribute(doc->allocate_attribute("xmlns", tls_ns.c_str()));
+                    m_stream.send(*doc);
                     co_return false;
                 }
             }
@@ -136,11 +567,11 @@ namespace {
         bool negotiate(rapidxml::xml_node<> *) override {
             SSL_CTX *ctx = Config::config().domain(m_stream.local_domain()).ssl_ctx();
             if (!ctx) return false;
-            xml_document<> d;
-            auto n = d.allocate_node(node_element, "starttls");
-            n->append_attribute(d.allocate_attribute("xmlns", tls_ns.c_str()));
-            d.append_node(n);
-            m_stream.send(d);
+            auto d = XMLPool::document();
+            auto n = d->allocate_node(node_element, "starttls");
+            n->append_attribute(d->allocate_attribute("xmlns", tls_ns.c_str()));
+            d->append_node(n);
+            m_stream.send(*d);
             return true;
         }
     };
@@ -185,6 +616,16 @@ namespace Metre {
         return retval;
     }
 
+    // The leaf's revocation status came from a stapled OCSP response, so it needn't have a CRL.
+    static int stapled_leaf_cb(int ok, X509_STORE_CTX *st) {
+        if (!ok && X509_STORE_CTX_get_error(st) == X509_V_ERR_UNABLE_TO_GET_CRL &&
+            X509_STORE_CTX_get_error_depth(st) == 0) {
+            X509_STORE_CTX_set_error(st, X509_V_OK);
+            return 1;
+        }
+        return ok;
+    }
+
     /**
      * This is a fairly massive coroutine, but I've kept it this way because it's
      * difficult to break apart. Indeed, I pulled it together out of two major callback
@@ -192,25 +633,46 @@ namespace Metre {
      *
      * @param stream
      * @param route
+     * @param expires Brought forward to when the verdict may change.
      * @return true if TLS verified correctly.
      */
-    sigslot::tasklet<bool> verify_tls(XMLStream &stream, Route &route) {
-        SSL *ssl = bufferevent_openssl_get_ssl(stream.session().bufferevent());
+    static sigslot::tasklet<bool> verify_tls_uncached(XMLStream &stream, Route &route,
+                                                      std::chrono::steady_clock::time_point &expires) {
+        SSL *ssl = session_ssl(stream.session());
         if (!ssl) co_return false; // No TLS.
         X509 *cert = SSL_get_peer_certificate(ssl);
         if (!cert) {
             stream.logger().info("verify_tls: No cert, so no auth");
             co_return false;
         }
+        expires = std::min(expires, asn1_expiry(X509_get0_notAfter(cert)));
         if (X509_V_OK != SSL_get_verify_result(ssl)) {
             stream.logger().info("verify_tls: Cert failed verification but rechecking anyway.");
         } // TLS failed basic verification.
-        stream.logger().debug("verify_tls: [Re]verifying TLS for {}", route.domain());
+        METRE_DEBUG(stream.logger(), "verify_tls: [Re]verifying TLS for {}", route.domain());
         STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
         SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
         X509_STORE *store = SSL_CTX_get_cert_store(ctx);
         X509_VERIFY_PARAM *vpm = X509_VERIFY_PARAM_new();
-        if (Config::config().domain(route.domain()).auth_pkix_status()) {
+        // A stapled OCSP response covers only the leaf; if it's good, that saves fetching the leaf's CRL.
+        int ocsp = -1;
+        {
+            const unsigned char *resp = nullptr;
+            long resp_len = SSL_get_tlsext_status_ocsp_resp(ssl, &resp);
+            if (resp && resp_len > 0) {
+                ocsp = ocsp_status(std::string(reinterpret_cast<const char *>(resp), static_cast<std::size_t>(resp_len)),
+                                   cert, chain, store, &expires);
+                METRE_DEBUG(stream.logger(), "verify_tls: Stapled OCSP status {}", ocsp);
+            }
+        }
+        if (ocsp == V_OCSP_CERTSTATUS_REVOKED) {
+            stream.logger().warn("verify_tls: Certificate revoked, per stapled OCSP response");
+            X509_VERIFY_PARAM_free(vpm);
+            co_return false;
+        }
+        bool stapled = (ocsp == V_OCSP_CERTSTATUS_GOOD);
+        bool pkix_status = Config::config().domain(route.domain()).auth_pkix_status();
+        if (pkix_status) {
             STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
             SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
             X509_STORE *store = SSL_CTX_get_cert_store(ctx);
@@ -219,7 +681,7 @@ namespace Metre {
             X509_verify_cert(st);
             STACK_OF(X509) *verified = X509_STORE_CTX_get1_chain(st);
             std::list<std::string> crls;
-            for (int certnum = 0; certnum != sk_X509_num(verified); ++certnum) {
+            for (int certnum = stapled ? 1 : 0; certnum < sk_X509_num(verified); ++certnum) {
                 auto cert = sk_X509_value(verified, certnum);
                 std::unique_ptr<STACK_OF(DIST_POINT), std::function<void(STACK_OF(DIST_POINT) *)>> crldp_ptr{
                         (STACK_OF(DIST_POINT) *) X509_get_ext_d2i(cert, NID_crl_distribution_points, NULL, NULL),
@@ -238,6 +700,7 @@ namespace Metre {
                                                        static_cast<std::size_t>(uri->length)};
                                     stream.logger().info("verify_tls: Fetching CRL - {}", uristr);
                                     Http::crl(uristr);
+                                    crls.push_back(uristr);
                                     // We don't await here, just get them going in parallel.
                                 }
                             }
@@ -254,6 +717,9 @@ namespace Metre {
                 X509_CRL *crl;
                 std::tie(uristr, code, crl) = co_await Http::crl(uri);
                 stream.logger().info("verify_tls: Fetched CRL - {}, with code {}", uristr, code);
+                if (crl && X509_CRL_get0_nextUpdate(crl)) {
+                    expires = std::min(expires, asn1_expiry(X509_CRL_get0_nextUpdate(crl)));
+                }
                 if (!X509_STORE_add_crl(store, crl)) {
                     // Erm. Whoops? Probably doesn't matter.
                     ERR_clear_error();
@@ -266,6 +732,7 @@ namespace Metre {
         auto res = Config::config().domain(route.domain()).resolver();
         auto srv = co_await
         res->SrvLookup(route.domain());
+        expires = std::min(expires, srv.expires);
         if (srv.error.empty()) {
             if (srv.dnssec) {
                 for (auto &rr : srv.rrs) {
@@ -276,6 +743,7 @@ namespace Metre {
         X509_STORE_CTX *st = X509_STORE_CTX_new();
         X509_STORE_CTX_set0_param(st, vpm); // Hands ownership to st.
         X509_STORE_CTX_init(st, store, cert, chain);
+        if (pkix_status && stapled) X509_STORE_CTX_set_verify_cb(st, stapled_leaf_cb);
         bool valid = (X509_verify_cert(st) == 1);
         if (!valid) {
             auto error = X509_STORE_CTX_get_error(st);
@@ -292,6 +760,7 @@ namespace Metre {
             for (auto &rr : srv.rrs) {
                 auto tlsa = co_await
                 res->TlsaLookup(rr.port, rr.hostname);
+                expires = std::min(expires, tlsa.expires);
                 if (!tlsa.dnssec) continue;
                 if (!tlsa.error.empty()) continue;
                 dane_present = true;
@@ -336,6 +805,62 @@ namespace Metre {
         co_return dane_present ? dane_ok : valid;
     }
 
+    /**
+     * Verdicts are cached per leaf certificate, local and remote domain; concurrent
+     * verifications of the same key on one worker share a single run.
+     */
+    sigslot::tasklet<bool> verify_tls(XMLStream &stream, Route &route) {
+        SSL *ssl = session_ssl(stream.session());
+        if (!ssl) co_return false; // No TLS.
+        X509 *cert = SSL_get_peer_certificate(ssl);
+        if (!cert) {
+            stream.logger().info("verify_tls: No cert, so no auth");
+            co_return false;
+        }
+        std::string key = VerifyCache::key(cert, stream.local_domain(), route.domain());
+        X509_free(cert);
+        if (key.empty()) co_return false;
+        auto cached = VerifyCache::cache().get(key);
+        if (cached) {
+            METRE_DEBUG(stream.logger(), "verify_tls: Cached verdict for {}: {}", route.domain(), *cached ? "OK" : "Not OK");
+            co_return *cached;
+        }
+        auto it = s_verify_in_flight.find(key);
+        if (it != s_verify_in_flight.end()) {
+            auto done = it->second;
+            METRE_DEBUG(stream.logger(), "verify_tls: Awaiting verification in progress for {}", route.domain());
+            co_return co_await *done;
+        }
+        InFlight in_flight(key);
+        auto expires = std::chrono::steady_clock::now() + (std::chrono::seconds(VerifyCache::max_lifetime));
+        auto task = verify_tls_uncached(stream, route, expires);
+        task.start();
+        bool valid = co_await task;
+        if (!valid) {
+            expires = std::min(expires, std::chrono::steady_clock::now() + std::chrono::seconds(VerifyCache::max_negative_lifetime));
+        }
+        VerifyCache::cache().put(key, valid, expires);
+        in_flight.complete(valid);
+        co_return valid;
+    }
+
+    void tls_context_setup(SSL_CTX *ctx, bool ocsp_staple) {
+        SSL_CTX_set_tlsext_status_cb(ctx, status_cb);
+        if (ocsp_staple) Stapler::stapler().add(ctx);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+        if (Config::config().tls_ticket_lifetime()) {
+            SSL_CTX_set_timeout(ctx, static_cast<long>(Config::config().tls_ticket_lifetime()) * 2);
+            SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+        } else {
+            SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        }
+    }
+
+    void ocsp_init() {
+        Stapler::stapler().start();
+    }
+
     bool start_tls(XMLStream &stream, bool send_proceed) {
         SSL_CTX *ctx = Config::config().domain(stream.local_domain()).ssl_ctx();
         if (!ctx) throw std::runtime_error("Failed to load certificates");
@@ -346,15 +871,28 @@ namespace Metre {
         if (stream.direction() == INBOUND) {
             SSL_set_accept_state(ssl);
             if (send_proceed) {
-                xml_document<> d;
-                auto n = d.allocate_node(node_element, "proceed");
-                n->append_attribute(d.allocate_attribute("xmlns", tls_ns.c_str()));
-                d.append_node(n);
-                stream.send(d);
+                auto d = XMLPool::document();
+                auto n = d->allocate_node(node_element, "proceed");
+                n->append_attribute(d->allocate_attribute("xmlns", tls_ns.c_str()));
+                d->append_node(n);
+                stream.send(*d);
             }
         } else { //m_stream.direction() == OUTBOUND
             SSL_set_connect_state(ssl);
             SSL_set_tlsext_host_name(ssl, stream.remote_domain().c_str());
+            SSL_set_tlsext_status_type(ssl, TLSEXT_STATUSTYPE_ocsp);
+            NetSession &session = stream.session();
+            if (!session.remote_hostname().empty()) {
+                auto key = new std::string(stream.local_domain() + '\0' + stream.remote_domain() + '\0' +
+                                           session.remote_hostname() + '\0' + std::to_string(session.remote_port()));
+                SSL_set_ex_data(ssl, session_key_index(), key);
+                SSL_SESSION *sess = SessionCache::cache().get(*key);
+                if (sess) {
+                    METRE_DEBUG(stream.logger(), "Offering cached TLS session");
+                    SSL_set_session(ssl, sess);
+                    SSL_SESSION_free(sess);
+                }
+            }
             st = BUFFEREVENT_SSL_CONNECTING;
         }
         struct bufferevent *bev = stream.session().bufferevent();
@@ -362,6 +900,7 @@ namespace Metre {
                                                                      BEV_OPT_CLOSE_ON_FREE);
         stream.session().bufferevent(bev_ssl); // Might set it to NULL - this is OK!
         if (!bev_ssl) throw std::runtime_error("Cannot create OpenSSL filter");
+        stream.session().handshake_started();
         stream.set_secured();
         return true;
     }
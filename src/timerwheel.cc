@@ -0,0 +1,167 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "timerwheel.h"
+#include <algorithm>
+#include <exception>
+
+using namespace Metre;
+
+TimerWheel::TimerWheel(std::uint64_t now) : m_now(now) {
+    m_slots.fill(nil);
+    m_counts.fill(0);
+}
+
+void TimerWheel::link(std::uint32_t index) {
+    Timer &timer = m_timers[index];
+    // Anything already due goes in the next tick.
+    std::uint64_t due = std::max(timer.expiry, m_now + 1);
+    std::uint64_t delta = due - m_now;
+    unsigned level = 0;
+    while (level != levels - 1 && delta >= (std::uint64_t(1) << (bits * (level + 1)))) ++level;
+    if (level == levels - 1 && delta >= (std::uint64_t(1) << (bits * levels))) {
+        // Too far out to place precisely; it'll be placed again when this slot cascades.
+        due = m_now + (std::uint64_t(1) << (bits * levels)) - 1;
+    }
+    std::uint32_t slot = level * slots + static_cast<std::uint32_t>((due >> (bits * level)) & (slots - 1));
+    timer.slot = slot;
+    timer.prev = nil;
+    timer.next = m_slots[slot];
+    if (timer.next != nil) m_timers[timer.next].prev = index;
+    m_slots[slot] = index;
+    ++m_counts[level];
+}
+
+void TimerWheel::unlink(std::uint32_t index) {
+    Timer &timer = m_timers[index];
+    if (timer.prev != nil) {
+        m_timers[timer.prev].next = timer.next;
+    } else {
+        m_slots[timer.slot] = timer.next;
+    }
+    if (timer.next != nil) m_timers[timer.next].prev = timer.prev;
+    --m_counts[timer.slot / slots];
+    timer.prev = timer.next = timer.slot = nil;
+}
+
+TimerWheel::Handle TimerWheel::add(std::uint64_t expiry, std::function<void()> &&fn) {
+    std::uint32_t index;
+    if (m_free.empty()) {
+        index = static_cast<std::uint32_t>(m_timers.size());
+        m_timers.emplace_back();
+    } else {
+        index = m_free.back();
+        m_free.pop_back();
+    }
+    Timer &timer = m_timers[index];
+    timer.expiry = expiry;
+    timer.fn = std::move(fn);
+    link(index);
+    ++m_size;
+    return (Handle(timer.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(Handle handle) {
+    auto index = static_cast<std::uint32_t>(handle & 0xFFFFFFFF);
+    if (index >= m_timers.size()) return false;
+    Timer &timer = m_timers[index];
+    if (timer.slot == nil || timer.generation != static_cast<std::uint32_t>(handle >> 32)) return false;
+    unlink(index);
+    timer.fn = nullptr;
+    if (++timer.generation == 0) timer.generation = 1;
+    m_free.push_back(index);
+    --m_size;
+    return true;
+}
+
+void TimerWheel::cascade(unsigned level) {
+    std::uint32_t slot = level * slots + static_cast<std::uint32_t>((m_now >> (bits * level)) & (slots - 1));
+    std::uint32_t index = m_slots[slot];
+    while (index != nil) {
+        std::uint32_t next = m_timers[index].next;
+        unlink(index);
+        link(index);
+        index = next;
+    }
+}
+
+std::uint64_t TimerWheel::next_cascade() const {
+    // Only cascades of occupied levels matter.
+    unsigned level = 1;
+    while (level != levels - 1 && m_counts[level] == 0) ++level;
+    std::uint64_t mask = (std::uint64_t(1) << (bits * level)) - 1;
+    return (m_now | mask) + 1;
+}
+
+std::size_t TimerWheel::advance(std::uint64_t now) {
+    std::size_t fired = 0;
+    while (m_now < now) {
+        if (m_size == 0) {
+            m_now = now;
+            break;
+        }
+        if (m_counts[0] == 0) {
+            // Nothing can fire before the next cascade, so skip straight to it.
+            std::uint64_t skip = std::min(now, next_cascade() - 1);
+            if (skip != m_now) {
+                m_now = skip;
+                continue;
+            }
+        }
+        ++m_now;
+        // Cascade from the top down, so timers falling several levels land in time.
+        unsigned top = 0;
+        while (top != levels - 1 && ((m_now >> (bits * (top + 1))) << (bits * (top + 1))) == m_now) ++top;
+        for (unsigned level = top; level != 0; --level) cascade(level);
+        std::uint32_t slot = static_cast<std::uint32_t>(m_now & (slots - 1));
+        // A throwing timer mustn't strand the rest of its slot; finish it, then pass the exception on.
+        std::exception_ptr error;
+        while (m_slots[slot] != nil) {
+            std::uint32_t index = m_slots[slot];
+            auto fn = std::move(m_timers[index].fn);
+            cancel((Handle(m_timers[index].generation) << 32) | index);
+            ++fired;
+            try {
+                fn();
+            } catch (...) {
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+    }
+    return fired;
+}
+
+std::optional<std::uint64_t> TimerWheel::next_wakeup() const {
+    if (m_size == 0) return std::nullopt;
+    // The next cascade might bring something down that's due immediately.
+    std::uint64_t wakeup = next_cascade();
+    if (m_counts[0] != 0) {
+        for (std::uint64_t t = m_now + 1; t < wakeup; ++t) {
+            if (m_slots[t & (slots - 1)] != nil) return t;
+        }
+    }
+    return wakeup;
+}
@@ -0,0 +1,162 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "xmlpool.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <set>
+#include <vector>
+
+using namespace Metre;
+
+namespace {
+    constexpr std::size_t max_idle_documents = 64;
+    constexpr std::size_t max_idle_blocks = 256;
+    // Anything much bigger than a standard block is a one-off; don't hang on to it.
+    constexpr std::size_t max_block_size = 4 * RAPIDXML_DYNAMIC_POOL_SIZE;
+
+    struct alignas(std::max_align_t) Block {
+        std::size_t size;
+    };
+
+    struct Counters {
+        std::atomic<unsigned long long> hits{0};
+        std::atomic<unsigned long long> misses{0};
+    };
+
+    std::mutex s_counters_mutex;
+    std::set<Counters *> s_counters;
+    XMLPool::Stats s_retired; // Counts from threads which have exited.
+
+    void *allocate(std::size_t size);
+
+    void release(void *ptr);
+
+    class ThreadPool {
+    public:
+        Counters counters;
+        std::vector<rapidxml::xml_document<> *> documents;
+        std::vector<Block *> blocks;
+        static thread_local bool t_finished;
+
+        ThreadPool() {
+            std::lock_guard<std::mutex> l(s_counters_mutex);
+            s_counters.insert(&counters);
+        }
+
+        ~ThreadPool() {
+            t_finished = true;
+            for (auto doc : documents) delete doc;
+            for (auto block : blocks) std::free(block);
+            std::lock_guard<std::mutex> l(s_counters_mutex);
+            s_retired.hits += counters.hits;
+            s_retired.misses += counters.misses;
+            s_counters.erase(&counters);
+        }
+
+        void hit() {
+            counters.hits.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void miss() {
+            counters.misses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Null during thread teardown, when everything goes straight back to the heap.
+        static ThreadPool *pool() {
+            if (t_finished) return nullptr;
+            static thread_local ThreadPool s_pool;
+            return &s_pool;
+        }
+    };
+
+    thread_local bool ThreadPool::t_finished = false;
+
+    void *allocate(std::size_t size) {
+        auto pool = ThreadPool::pool();
+        if (pool && !pool->blocks.empty() && pool->blocks.back()->size >= size) {
+            pool->hit();
+            Block *block = pool->blocks.back();
+            pool->blocks.pop_back();
+            return block + 1;
+        }
+        if (pool) pool->miss();
+        auto block = static_cast<Block *>(std::malloc(sizeof(Block) + size));
+        if (!block) throw std::bad_alloc();
+        block->size = size;
+        return block + 1;
+    }
+
+    void release(void *ptr) {
+        Block *block = static_cast<Block *>(ptr) - 1;
+        auto pool = ThreadPool::pool();
+        if (pool && pool->blocks.size() < max_idle_blocks && block->size <= max_block_size) {
+            pool->blocks.push_back(block);
+            return;
+        }
+        std::free(block);
+    }
+}
+
+void XMLPool::Release::operator()(rapidxml::xml_document<> *doc) const {
+    doc->clear();
+    auto pool = ThreadPool::pool();
+    if (pool && pool->documents.size() < max_idle_documents) {
+        pool->documents.push_back(doc);
+        return;
+    }
+    delete doc;
+}
+
+XMLPool::Document XMLPool::document() {
+    auto pool = ThreadPool::pool();
+    if (pool && !pool->documents.empty()) {
+        pool->hit();
+        Document doc(pool->documents.back());
+        pool->documents.pop_back();
+        return doc;
+    }
+    if (pool) pool->miss();
+    Document doc(new rapidxml::xml_document<>);
+    attach(*doc);
+    return doc;
+}
+
+void XMLPool::attach(rapidxml::xml_document<> &doc) {
+    doc.set_allocator(allocate, release);
+}
+
+XMLPool::Stats XMLPool::stats() {
+    std::lock_guard<std::mutex> l(s_counters_mutex);
+    Stats stats = s_retired;
+    for (auto counters : s_counters) {
+        stats.hits += counters->hits.load(std::memory_order_relaxed);
+        stats.misses += counters->misses.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
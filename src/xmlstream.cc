@@ -36,6 +36,7 @@ SOFTWARE.
 #include "config.h"
 #include "log.h"
 #include "tls.h"
+#include "metrics.h"
 
 #ifdef VALGRIND
 #include <valgrind/memcheck.h>
@@ -45,27 +46,35 @@ SOFTWARE.
 
 using namespace Metre;
 
+namespace {
+    const std::string tasks_gauge_name = "metre_stream_tasks";
+
+    Metrics::Labels tasks_gauge_labels(NetSession &session) {
+        return {{"session", std::to_string(session.serial())}};
+    }
+
+    const char *type_name(SESSION_TYPE t) {
+        switch (t) {
+            case S2S:
+                return "S2S";
+            case COMP:
+                return "COMP";
+            case X2X:
+                return "X2X";
+            default:
+                throw std::logic_error("Unknown type: " + std::to_string(t));
+        }
+    }
+}
+
 XMLStream::XMLStream(NetSession *n, SESSION_DIRECTION dir, SESSION_TYPE t)
         : has_slots(), m_session(n), m_dir(dir), m_type(t) {
-    std::ostringstream ss;
-    ss << "XmlStream serial=[" << m_session->serial() << "]";
-    ss << (dir == INBOUND ? " IN" : " OUT");
-    ss << " type=[";
-    switch (t) {
-        case S2S:
-            ss << "S2S";
-            break;
-        case COMP:
-            ss << "COMP";
-            break;
-        case X2X:
-            ss << "X2X";
-            break;
-        default:
-            throw std::logic_error("Unknown type: " + std::to_string(t));
-    }
-    ss << "]";
-    m_logger = Config::config().logger(ss.str());
+    XMLPool::attach(m_stream);
+    XMLPool::attach(m_stanza);
+    m_logger = Config::config().logger("XMLStream", {{"serial", std::to_string(m_session->serial())},
+                                                     {"dir", dir == INBOUND ? "IN" : "OUT"},
+                                                     {"type", type_name(t)}});
+    m_tasks_gauge = &Metrics::gauge(tasks_gauge_name, "Tasks in flight, per stream.", tasks_gauge_labels(*m_session));
     if (t == X2X) {
         m_type = S2S;
         m_x2x_mode = true;
@@ -77,25 +86,12 @@ XMLStream::XMLStream(NetSession *n, SESSION_DIRECTION dir, SESSION_TYPE t, std::
                      std::string const &stream_remote)
         : has_slots(), m_session(n), m_dir(dir), m_type(t), m_stream_local(stream_local),
           m_stream_remote(stream_remote) {
-    std::ostringstream ss;
-    ss << "XmlStream serial=[" << m_session->serial() << "]";
-    ss << (dir == INBOUND ? " IN" : " OUT");
-    ss << " type=[";
-    switch (t) {
-        case S2S:
-            ss << "S2S";
-            break;
-        case COMP:
-            ss << "COMP";
-            break;
-        case X2X:
-            ss << "X2X";
-            break;
-        default:
-            throw std::logic_error("Unknown type: " + std::to_string(t));
-    }
-    ss << "]";
-    m_logger = Config::config().logger(ss.str());
+    XMLPool::attach(m_stream);
+    XMLPool::attach(m_stanza);
+    m_logger = Config::config().logger("XMLStream", {{"serial", std::to_string(m_session->serial())},
+                                                     {"dir", dir == INBOUND ? "IN" : "OUT"},
+                                                     {"type", type_name(t)}});
+    m_tasks_gauge = &Metrics::gauge(tasks_gauge_name, "Tasks in flight, per stream.", tasks_gauge_labels(*m_session));
     if (t == X2X) {
         m_type = S2S;
         m_x2x_mode = true;
@@ -107,116 +103,148 @@ void XMLStream::thaw() {
     if (m_in_flight <= 0) return;
     --m_in_flight;
     if (m_in_flight > 0) return;
-    logger().debug("thaw");
+    METRE_DEBUG(logger(), "thaw");
     m_session->read();
-    logger().debug("thaw done");
+    METRE_DEBUG(logger(), "thaw done");
+}
+
+size_t XMLStream::scan(char const *p, size_t len) {
+    (void) VALGRIND_MAKE_MEM_DEFINED_IF_ADDRESSABLE(p, len);
+    m_tokenizer.feed(p, len);
+    return pending();
+}
+
+void XMLStream::skip_whitespace() {
+    if (m_tokenizer.complete()) return;
+    size_t spaces = m_tokenizer.leading();
+    if (spaces == 0) return;
+    m_tokenizer.consume(spaces);
+    m_session->used(spaces);
 }
 
 size_t XMLStream::process(unsigned char *p, size_t len) {
     using namespace rapidxml;
     if (len == 0) return 0;
     if (frozen()) {
-        logger().debug("Data arrived when frozen");
+        METRE_DEBUG(logger(), "Data arrived when frozen");
         return 0;
     }
     (void) VALGRIND_MAKE_MEM_DEFINED_IF_ADDRESSABLE(p, len);
-    size_t spaces = 0;
-    for (unsigned char *sp{p}; len != 0; ++sp, --len, ++spaces) {
-        switch (*sp) {
-            default:
-                break;
-            case ' ':
-            case '\r':
-            case '\n':
-                continue;
-        }
-        break;
-    }
-    if (spaces) m_session->used(spaces);
-    if (len == 0) return spaces;
-    std::string buf{reinterpret_cast<char *>(p + spaces), len};
-    logger().debug("Got [{}]: {}", len, buf);
+    char *data = reinterpret_cast<char *>(p);
+    size_t consumed = 0;
     try {
         try {
-            if (m_stream_buf.empty()) {
+            while (consumed < len && !m_closed) {
+                if (!m_tokenizer.complete() && m_tokenizer.scanned() < len - consumed) {
+                    m_tokenizer.feed(data + consumed + m_tokenizer.scanned(), len - consumed - m_tokenizer.scanned());
+                }
+                if (!m_tokenizer.complete()) {
+                    size_t spaces = m_tokenizer.leading();
+                    if (spaces) {
+                        m_tokenizer.consume(spaces);
+                        m_session->used(spaces);
+                        consumed += spaces;
+                    }
+                    break;
+                }
                 /**
-                 * We need to grab the stream open. Do so by parsing the main buffer to find where the open
-                 * finishes, and copy that segment over to another buffer. Then reparse, this time properly.
+                 * We have a whole token. Copy it once, since rapidxml parses in-place and the
+                 * input buffer is about to be drained.
                  */
-                logger().debug("Parsing stream open");
-                char *end = m_stream.parse<parse_open_only | parse_fastest>(const_cast<char *>(buf.c_str()));
-                auto test = m_stream.first_node();
-                if (test && test->name()) {
-                    m_stream_buf.assign(buf.data(), end - buf.data());
-                    m_session->used(end - buf.data());
-                    buf.erase(0, end - buf.data());
-                    m_stream.parse<parse_open_only>(const_cast<char *>(m_stream_buf.c_str()));
-                    stream_open();
-                } else {
-                    m_stream_buf.clear();
+                char const *start = data + consumed + m_tokenizer.leading();
+                size_t length = m_tokenizer.length() - m_tokenizer.leading();
+                size_t n = m_tokenizer.length();
+                auto token = m_tokenizer.token();
+                METRE_DEBUG(logger(), "Got [{}]: {}", length, std::string_view(start, length));
+                switch (token) {
+                    case XMLTokenizer::STREAM_OPEN:
+                        METRE_DEBUG(logger(), "Parsing stream open");
+                        m_stream_buf.assign(start, length);
+                        break;
+                    case XMLTokenizer::ELEMENT:
+                        m_stanza_buf.assign(start, length);
+                        break;
+                    default:
+                        break;
                 }
-            }
-            while (!buf.empty()) {
-                char *end = m_stanza.parse<parse_fastest | parse_parse_one>(const_cast<char *>(buf.c_str()), m_stream);
-                auto element = m_stanza.first_node();
-                if (!element || !element->name()) return len - buf.length();
-                //std::cout << "TLE {" << element->xmlns() << "}" << element->name() << std::endl;
-                m_session->used(end - buf.data());
-                handle(element);
-                buf.erase(0, end - buf.data());
-                m_stanza.clear();
-                if (frozen()) return spaces + len - buf.length();
+                m_tokenizer.consume(n);
+                m_session->used(n);
+                consumed += n;
+                switch (token) {
+                    case XMLTokenizer::STREAM_OPEN: {
+                        m_stream.parse<parse_open_only>(m_stream_buf.data());
+                        auto test = m_stream.first_node();
+                        if (!test || !test->name()) throw Metre::not_well_formed("Expected stream open");
+                        stream_open();
+                    }
+                        break;
+                    case XMLTokenizer::ELEMENT: {
+                        m_stanza.parse<parse_fastest | parse_parse_one>(m_stanza_buf.data(), m_stream);
+                        auto element = m_stanza.first_node();
+                        if (!element || !element->name()) throw Metre::not_well_formed("Expected element");
+                        handle(element);
+                        m_stanza.clear();
+                    }
+                        break;
+                    case XMLTokenizer::STREAM_CLOSE:
+                        m_session->send("</stream:stream>");
+                        m_closed = true;
+                        break;
+                    default:
+                        break;
+                }
+                if (frozen()) break;
             }
         } catch (Metre::base::xmpp_exception &) {
             throw;
-        } catch (rapidxml::eof_error &e) {
-            return spaces + len - buf.length();
         } catch (rapidxml::parse_error &e) {
-            if (buf == "</stream:stream>") {
-                m_session->send("</stream:stream>");
-                m_closed = true;
-                m_session->used(buf.size());
-                buf.clear();
-            } else {
-                throw Metre::not_well_formed(e.what());
-            }
+            throw Metre::not_well_formed(e.what());
         } catch (std::runtime_error &e) {
             throw Metre::undefined_condition(e.what());
         }
     } catch (Metre::base::xmpp_exception &e) {
         handle_exception(e);
     }
-    return spaces + len - buf.length();
+    return consumed;
+}
+
+void XMLStream::synthesize_stream_open(std::string const &header) {
+    in_context([this, &header]() {
+        m_stream_buf = header;
+        m_stream.parse<rapidxml::parse_open_only>(m_stream_buf.data());
+        m_tokenizer.reset(1);
+        stream_open();
+    });
 }
 
 void XMLStream::handle_exception(Metre::base::xmpp_exception &e) {
     using namespace rapidxml;
     logger().error("Raising error: [{}]", e.what());
-    xml_document<> d;
-    auto error = d.allocate_node(node_element, "stream:error");
-    auto specific = d.allocate_node(node_element, e.element_name());
-    specific->append_attribute(d.allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-streams"));
-    auto text = d.allocate_node(node_element, "text", e.what());
+    auto d = XMLPool::document();
+    auto error = d->allocate_node(node_element, "stream:error");
+    auto specific = d->allocate_node(node_element, e.element_name());
+    specific->append_attribute(d->allocate_attribute("xmlns", "urn:ietf:params:xml:ns:xmpp-streams"));
+    auto text = d->allocate_node(node_element, "text", e.what());
     specific->append_node(text);
     if (dynamic_cast<Metre::undefined_condition *>(&e)) {
-        auto other = d.allocate_node(node_element, "unhandled-exception");
-        other->append_attribute(d.allocate_attribute("xmlns", "http://cridland.im/xmlns/metre"));
+        auto other = d->allocate_node(node_element, "unhandled-exception");
+        other->append_attribute(d->allocate_attribute("xmlns", "http://cridland.im/xmlns/metre"));
         specific->append_node(other);
     }
     error->append_node(specific);
     if (m_opened) {
-        d.append_node(error);
-        m_session->send(d);
+        d->append_node(error);
+        m_session->send(*d);
         m_session->send("</stream:stream>");
     } else {
-        auto node = d.allocate_node(node_element, "stream:stream");
-        node->append_attribute(d.allocate_attribute("xmlns:stream", "http://etherx.jabber.org/streams"));
-        node->append_attribute(d.allocate_attribute("version", "1.0"));
-        node->append_attribute(d.allocate_attribute("xmlns", content_namespace()));
+        auto node = d->allocate_node(node_element, "stream:stream");
+        node->append_attribute(d->allocate_attribute("xmlns:stream", "http://etherx.jabber.org/streams"));
+        node->append_attribute(d->allocate_attribute("version", "1.0"));
+        node->append_attribute(d->allocate_attribute("xmlns", content_namespace()));
         node->append_node(error);
-        d.append_node(node);
+        d->append_node(node);
         m_session->send("<?xml version='1.0'?>");
-        m_session->send(d);
+        m_session->send(*d);
     }
     m_closed = true;
 }
@@ -308,13 +336,13 @@ void XMLStream::stream_open() {
     if (xmlns && xmlns->value()) {
         std::string default_xmlns(xmlns->value(), xmlns->value_size());
         if (default_xmlns == "jabber:client") {
-            logger().debug("C2S stream detected.");
+            METRE_DEBUG(logger(), "C2S stream detected.");
             m_type = C2S;
         } else if (default_xmlns == "jabber:server") {
-            logger().debug("S2S stream detected.");
+            METRE_DEBUG(logger(), "S2S stream detected.");
             m_type = S2S;
         } else if (default_xmlns == "jabber:component:accept") {
-            logger().debug("114 (component) stream detected.");
+            METRE_DEBUG(logger(), "114 (component) stream detected.");
             m_type = COMP;
         } else {
             logger().warn("Unidentified connection.");
@@ -324,7 +352,7 @@ void XMLStream::stream_open() {
     std::string domainname;
     if (domainat && domainat->value()) {
         domainname.assign(domainat->value(), domainat->value_size());
-        logger().debug("Requested contact domain [{}]", domainname);
+        METRE_DEBUG(logger(), "Requested contact domain [{}]", domainname);
     } else if (m_dir == OUTBOUND) {
         domainname = Jid(m_stream_local).domain();
     } else {
@@ -340,7 +368,7 @@ void XMLStream::stream_open() {
                 from = m_stream_remote;
             }
         }
-        logger().debug("Requesting domain is {}", from);
+        METRE_DEBUG(logger(), "Requesting domain is {}", from);
         check_domain_pair(from, domainname);
     }
     if (!stream->xmlns()) {
@@ -403,7 +431,7 @@ sigslot::tasklet<bool> XMLStream::send_stream_open(bool with_version) {
         stream_buf += "' from='";
         stream_buf += m_stream_remote;
         stream_buf += "'>";
-        process(reinterpret_cast<unsigned char *>(const_cast<char *>(stream_buf.data())), stream_buf.size());
+        if (m_stream_buf.empty()) synthesize_stream_open(stream_buf);
         set_auth_ready();
     } else {
         /*
@@ -433,13 +461,13 @@ sigslot::tasklet<bool> XMLStream::send_stream_open(bool with_version) {
         }
         m_session->send(open);
         if (with_version && m_dir == INBOUND) {
-            rapidxml::xml_document<> doc;
-            auto features = doc.allocate_node(rapidxml::node_element, "stream:features");
-            doc.append_node(features);
+            auto doc = XMLPool::document();
+            auto features = doc->allocate_node(rapidxml::node_element, "stream:features");
+            doc->append_node(features);
             for (auto f : Feature::features(m_type)) {
                 co_await *start_task("Feature offer", f->offer(features, *this));
             }
-            m_session->send(doc);
+            m_session->send(*doc);
         }
     }
     m_opened = true;
@@ -451,16 +479,29 @@ void XMLStream::send(rapidxml::xml_document<> &d) {
 }
 
 void XMLStream::send(std::unique_ptr<Stanza> s) {
-    rapidxml::xml_document<> d;
-    s->render(d);
-    m_session->send(d);
+    bool stanza = !dynamic_cast<DB *>(s.get());
+    if (stanza) m_session->stanzas_sent();
+    if (m_tracker && stanza) {
+        m_tracker->sent(*s);
+        return;
+    }
+    m_session->send(*s);
+}
+
+void XMLStream::forward(std::string_view stanza) {
+    m_session->stanzas_sent();
+    if (m_tracker) {
+        m_tracker->sent(stanza);
+        return;
+    }
+    m_session->send(stanza);
 }
 
 void XMLStream::handle(rapidxml::xml_node<> *element) {
     std::string xmlns(element->xmlns(), element->xmlns_size());
     if (xmlns == "http://etherx.jabber.org/streams") {
         std::string elname(element->name(), element->name_size());
-        m_logger->trace("handle element=[{}]", elname);
+        METRE_TRACE(*m_logger, "handle element=[{}]", elname);
         if (elname == "features") {
             for (;;) {
                 rapidxml::xml_node<> *feature_offer = nullptr;
@@ -469,10 +510,10 @@ void XMLStream::handle(rapidxml::xml_node<> *element) {
                 for (auto feat_ad = element->first_node(); feat_ad; feat_ad = feat_ad->next_sibling()) {
                     std::string offer_name(feat_ad->name(), feat_ad->name_size());
                     std::string offer_ns(feat_ad->xmlns(), feat_ad->xmlns_size());
-                    logger().debug("Got feature offer: [{}:{}]", offer_ns, offer_name);
+                    METRE_DEBUG(logger(), "Got feature offer: [{}:{}]", offer_ns, offer_name);
                     if (m_features.find(offer_ns) != m_features.end()) continue; // Already negotiated.
                     Feature::Type offer_type = Feature::type(offer_ns, *this);
-                    logger().debug("Offer type seems to be [{}]", offer_type);
+                    METRE_DEBUG(logger(), "Offer type seems to be [{}]", offer_type);
                     switch (offer_type) {
                         case Feature::Type::FEAT_NONE:
                             continue;
@@ -486,13 +527,13 @@ void XMLStream::handle(rapidxml::xml_node<> *element) {
                             /* pass */;
                     }
                     if (feature_type < offer_type) {
-                        logger().debug("Feature [{}:{}] supersedes [{}]", offer_ns, offer_name, feature_xmlns);
+                        METRE_DEBUG(logger(), "Feature [{}:{}] supersedes [{}]", offer_ns, offer_name, feature_xmlns);
                         feature_offer = feat_ad;
                         feature_xmlns = offer_ns;
                         feature_type = offer_type;
                     }
                 }
-                m_logger->debug("Processing feature [{}]", feature_xmlns);
+                METRE_DEBUG(*m_logger, "Processing feature [{}]", feature_xmlns);
                 if (feature_type == Feature::Type::FEAT_NONE) {
                     if (m_features.find("urn:xmpp:features:dialback") == m_features.end()) {
                         auto so = m_stream.first_node();
@@ -512,7 +553,7 @@ void XMLStream::handle(rapidxml::xml_node<> *element) {
                 assert(f.get());
                 bool escape = f->negotiate(feature_offer);
                 m_features.emplace(feature_xmlns, std::move(f));
-                m_logger->debug("Feature negotiated, stream restart is [{}]", escape);
+                METRE_DEBUG(*m_logger, "Feature negotiated, stream restart is [{}]", escape);
                 if (escape) return; // We've done a stream restart or something.
             }
         } else if (elname == "error") {
@@ -521,16 +562,23 @@ void XMLStream::handle(rapidxml::xml_node<> *element) {
             throw Metre::unsupported_stanza_type("Unknown stream element");
         }
     } else {
+        if (xmlns == content_namespace()) {
+            std::string_view elname(element->name(), element->name_size());
+            if (elname == "message" || elname == "presence" || elname == "iq") {
+                m_session->stanzas_received();
+                if (m_tracker) m_tracker->received();
+            }
+        }
         auto fit = m_features.find(xmlns);
         Feature *f = nullptr;
-        m_logger->debug("Hunting handling feature for [{}]", xmlns);
+        METRE_DEBUG(*m_logger, "Hunting handling feature for [{}]", xmlns);
         if (fit != m_features.end()) {
             f = (*fit).second.get();
         } else {
             std::unique_ptr<Feature> feat(Feature::feature(xmlns, *this));
             f = feat.get();
             if (f) m_features.emplace(xmlns, std::move(feat));
-            m_logger->debug("Created new feature [{}]", xmlns);
+            METRE_DEBUG(*m_logger, "Created new feature [{}]", xmlns);
         }
 
         bool handled = false;
@@ -542,7 +590,7 @@ void XMLStream::handle(rapidxml::xml_node<> *element) {
                 handled = task->get();
             }
         }
-        m_logger->debug("Handled: [{}]", handled);
+        METRE_DEBUG(*m_logger, "Handled: [{}]", handled);
         if (!handled) {
             throw Metre::unsupported_stanza_type();
         }
@@ -566,10 +614,12 @@ void XMLStream::do_restart() {
         Router::unregister_stream_id(m_stream_id);
         m_stream_id.clear();
     }
+    m_tracker = nullptr;
     m_features.clear();
     m_stream.clear();
     m_stanza.clear();
     m_stream_buf.clear();
+    m_tokenizer.reset();
     if (m_dir == OUTBOUND) {
         start_task("Restart outbound send_stream_open", send_stream_open(true));
     }
@@ -577,6 +627,7 @@ void XMLStream::do_restart() {
 }
 
 XMLStream::~XMLStream() {
+    Metrics::remove(tasks_gauge_name, tasks_gauge_labels(*m_session));
 }
 
 void XMLStream::generate_stream_id() {
@@ -589,11 +640,22 @@ void XMLStream::generate_stream_id() {
 
 XMLStream::AUTH_STATE
 XMLStream::s2s_auth_pair(std::string const &local, std::string const &remote, SESSION_DIRECTION dir) const {
+    return s2s_auth_pair(DomainId(local), DomainId(remote), dir);
+}
+
+XMLStream::AUTH_STATE
+XMLStream::s2s_auth_pair(std::string const &local, std::string const &remote, SESSION_DIRECTION dir,
+                         XMLStream::AUTH_STATE state) {
+    return s2s_auth_pair(DomainId(local), DomainId(remote), dir, state);
+}
+
+XMLStream::AUTH_STATE
+XMLStream::s2s_auth_pair(DomainId const &local, DomainId const &remote, SESSION_DIRECTION dir) const {
     if (m_type == COMP) {
         if (m_user) {
-            if (dir == OUTBOUND && *m_user == remote) {
+            if (dir == OUTBOUND && *m_user == remote.str()) {
                 return AUTHORIZED;
-            } else if (dir == INBOUND && *m_user == remote) {
+            } else if (dir == INBOUND && *m_user == remote.str()) {
                 return AUTHORIZED;
             }
         }
@@ -623,25 +685,29 @@ XMLStream::s2s_auth_pair(std::string const &local, std::string const &remote, SE
 }
 
 XMLStream::AUTH_STATE
-XMLStream::s2s_auth_pair(std::string const &local, std::string const &remote, SESSION_DIRECTION dir,
+XMLStream::s2s_auth_pair(DomainId const &local, DomainId const &remote, SESSION_DIRECTION dir,
                          XMLStream::AUTH_STATE state) {
     if (state == AUTHORIZED && !m_secured && Config::config().domain(remote).require_tls()) {
         throw Metre::not_authorized("Authorization attempt without TLS");
     }
     if (m_bidi) dir = m_dir; // For XEP-0288, only consider the primary direction.
     auto &m = (dir == INBOUND ? m_auth_pairs_rx : m_auth_pairs_tx);
-    auto key = std::make_pair(local, remote);
-    AUTH_STATE current = m[key];
+    auto &current = m[std::make_pair(local, remote)];
     if (current < state) {
-        m[key] = state;
+        current = state;
         if (state == XMLStream::AUTHORIZED) {
             logger().info("Authorized {} session local: {} remote: {}", (dir == INBOUND ? "INBOUND" : "OUTBOUND"),
-                          local, remote);
+                          local.str(), remote.str());
             if (m_bidi && dir == INBOUND) RouteTable::routeTable(local).route(remote)->outbound(m_session);
+            if (dir == INBOUND && m_dir == INBOUND && !m_tuned) {
+                // Until now, the listener's settings; the stream's from is only a claim.
+                m_tuned = true;
+                m_session->tune(Config::config().domain(remote).socket());
+            }
             onAuthenticated.emit(*this);
         }
     }
-    return m[key];
+    return current;
 }
 
 bool XMLStream::bidi(bool b) {
@@ -666,7 +732,7 @@ sigslot::tasklet<bool> XMLStream::tls_auth_ok(Route &route) {
 }
 
 void XMLStream::task_completed() {
-    logger().debug("Task completed, currently [{}] running.", m_tasks.size());
+    METRE_DEBUG(logger(), "Task completed, currently [{}] running.", m_tasks.size());
     Router::defer([this]() {
         m_tasks.remove_if([this](auto & task) {
             if(!task->running()) {
@@ -677,6 +743,7 @@ void XMLStream::task_completed() {
             }
             return false;
         });
+        m_tasks_gauge->set(static_cast<std::int64_t>(m_tasks.size()));
     });
     thaw();
 }
@@ -684,15 +751,16 @@ void XMLStream::task_completed() {
 std::shared_ptr<sigslot::tasklet<bool>> XMLStream::start_task(std::string const & s, sigslot::tasklet<bool> &&otask) {
     auto task = std::make_shared<sigslot::tasklet<bool>>(std::move(otask));
     task->set_name(s);
-    logger().debug("Task [{}] starting, currently [{}] running.", s, m_tasks.size());
+    METRE_DEBUG(logger(), "Task [{}] starting, currently [{}] running.", s, m_tasks.size());
     task->start();
     if (!task->running()) {
-        logger().debug("Task [{}] immediate stop, currently [{}] running.", s, m_tasks.size());
+        METRE_DEBUG(logger(), "Task [{}] immediate stop, currently [{}] running.", s, m_tasks.size());
     } else {
         freeze();
         task->complete().connect(this, &XMLStream::task_completed);
         m_tasks.emplace_back(task);
-        logger().debug("Task [{}] paused, currently [{}] running.", s, m_tasks.size());
+        m_tasks_gauge->set(static_cast<std::int64_t>(m_tasks.size()));
+        METRE_DEBUG(logger(), "Task [{}] paused, currently [{}] running.", s, m_tasks.size());
     }
     return task;
 }
@@ -0,0 +1,330 @@
+/***
+
+Copyright 2013-2016 Dave Cridland
+Copyright 2014-2016 Surevine Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include "xmltokenizer.h"
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace Metre;
+
+namespace {
+    bool whitespace(char c) {
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    template<char... Needles>
+    bool any_of(char c) {
+        return ((c == Needles) || ...);
+    }
+
+    /*
+     * Vector scans used to skip the octets that can't change tokenizer state.
+     * Each returns the index of the first interesting octet at or after i, or len.
+     * AVX2 is used when the build targets it; SSE2 is always there on x86-64.
+     */
+#if defined(__AVX2__)
+    template<char... Needles>
+    std::size_t find_any(char const *data, std::size_t i, std::size_t len) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+            __m256i hit = _mm256_setzero_si256();
+            ((hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Needles)))), ...);
+            auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        for (; i != len; ++i) {
+            if (any_of<Needles...>(data[i])) return i;
+        }
+        return len;
+    }
+
+    std::size_t skip_whitespace(char const *data, std::size_t i, std::size_t len) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+            __m256i ws = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+            auto mask = ~static_cast<unsigned>(_mm256_movemask_epi8(ws));
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        for (; i != len; ++i) {
+            if (!whitespace(data[i])) return i;
+        }
+        return len;
+    }
+#elif defined(__SSE2__)
+    template<char... Needles>
+    std::size_t find_any(char const *data, std::size_t i, std::size_t len) {
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+            __m128i hit = _mm_setzero_si128();
+            ((hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(Needles)))), ...);
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        for (; i != len; ++i) {
+            if (any_of<Needles...>(data[i])) return i;
+        }
+        return len;
+    }
+
+    std::size_t skip_whitespace(char const *data, std::size_t i, std::size_t len) {
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+            __m128i ws = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+            auto mask = ~static_cast<unsigned>(_mm_movemask_epi8(ws)) & 0xFFFFu;
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        for (; i != len; ++i) {
+            if (!whitespace(data[i])) return i;
+        }
+        return len;
+    }
+#else
+    template<char... Needles>
+    std::size_t find_any(char const *data, std::size_t i, std::size_t len) {
+        if constexpr (sizeof...(Needles) == 1) {
+            auto p = static_cast<char const *>(std::memchr(data + i, Needles..., len - i));
+            return p ? static_cast<std::size_t>(p - data) : len;
+        }
+        for (; i != len; ++i) {
+            if (any_of<Needles...>(data[i])) return i;
+        }
+        return len;
+    }
+
+    std::size_t skip_whitespace(char const *data, std::size_t i, std::size_t len) {
+        for (; i != len; ++i) {
+            if (!whitespace(data[i])) return i;
+        }
+        return len;
+    }
+#endif
+}
+
+std::size_t XMLTokenizer::finish(TOKEN token, std::size_t pos) {
+    m_token = token;
+    m_state = CONTENT;
+    m_end = m_scanned + pos + 1;
+    m_scanned = m_end;
+    return pos + 1;
+}
+
+std::size_t XMLTokenizer::skip(char const *data, std::size_t i, std::size_t len) {
+    switch (m_state) {
+        case CONTENT:
+            if (m_start == npos) return skip_whitespace(data, i, len);
+            return find_any<'<'>(data, i, len);
+        case START_TAG: {
+            auto next = find_any<'"', '\'', '/', '>'>(data, i, len);
+            if (next != i) m_empty = false;
+            return next;
+        }
+        case QUOTED:
+            if (m_quote == '"') return find_any<'"'>(data, i, len);
+            return find_any<'\''>(data, i, len);
+        case END_TAG:
+        case DECL:
+            return find_any<'>'>(data, i, len);
+        // Anything skipped would reset the run, so only skip when there isn't one.
+        case PI:
+            return m_match ? i : find_any<'?'>(data, i, len);
+        case COMMENT:
+            return m_match ? i : find_any<'-'>(data, i, len);
+        case CDATA:
+            return m_match ? i : find_any<']'>(data, i, len);
+        default:
+            return i;
+    }
+}
+
+std::size_t XMLTokenizer::feed(char const *data, std::size_t len) {
+    if (complete()) return 0;
+    for (std::size_t i = 0; i < len; ++i) {
+        i = skip(data, i, len);
+        if (i == len) break;
+        char c = data[i];
+        switch (m_state) {
+            case CONTENT:
+                if (c == '<') {
+                    if (m_start == npos) m_start = m_scanned + i;
+                    m_state = TAG_OPEN;
+                } else if (m_start == npos && !whitespace(c)) {
+                    // Stray text; let the parser complain about it.
+                    m_start = m_scanned + i;
+                }
+                break;
+
+            case TAG_OPEN:
+                switch (c) {
+                    case '/':
+                        m_state = END_TAG;
+                        break;
+                    case '?':
+                        m_match = 0;
+                        m_state = PI;
+                        break;
+                    case '!':
+                        m_state = BANG;
+                        break;
+                    default:
+                        m_empty = false;
+                        m_state = START_TAG;
+                }
+                break;
+
+            case START_TAG:
+                switch (c) {
+                    case '"':
+                    case '\'':
+                        m_quote = c;
+                        m_empty = false;
+                        m_state = QUOTED;
+                        break;
+                    case '/':
+                        m_empty = true;
+                        break;
+                    case '>':
+                        if (m_empty) {
+                            if (m_depth == m_top) return finish(ELEMENT, i);
+                        } else if (++m_depth == 1) {
+                            m_top = 1;
+                            return finish(STREAM_OPEN, i);
+                        }
+                        m_state = CONTENT;
+                        break;
+                    default:
+                        m_empty = false;
+                }
+                break;
+
+            case QUOTED:
+                if (c == m_quote) m_state = START_TAG;
+                break;
+
+            case END_TAG:
+                if (c == '>') {
+                    if (m_depth == m_top) {
+                        if (m_top == 0) return finish(ELEMENT, i); // Unbalanced; the parser will reject it.
+                        m_depth = m_top = 0;
+                        return finish(STREAM_CLOSE, i);
+                    }
+                    if (--m_depth == m_top) return finish(ELEMENT, i);
+                    m_state = CONTENT;
+                }
+                break;
+
+            case PI:
+                if (c == '>' && m_match) {
+                    m_state = CONTENT;
+                } else {
+                    m_match = (c == '?') ? 1 : 0;
+                }
+                break;
+
+            case BANG:
+                switch (c) {
+                    case '-':
+                        m_state = COMMENT_OPEN;
+                        break;
+                    case '[':
+                        m_match = 0;
+                        m_state = CDATA;
+                        break;
+                    default:
+                        m_state = DECL;
+                }
+                break;
+
+            case COMMENT_OPEN:
+                m_match = 0;
+                m_state = (c == '-') ? COMMENT : DECL;
+                break;
+
+            case COMMENT:
+                if (c == '-') {
+                    ++m_match;
+                } else if (c == '>' && m_match >= 2) {
+                    m_state = CONTENT;
+                } else {
+                    m_match = 0;
+                }
+                break;
+
+            case CDATA:
+                if (c == ']') {
+                    ++m_match;
+                } else if (c == '>' && m_match >= 2) {
+                    m_state = CONTENT;
+                } else {
+                    m_match = 0;
+                }
+                break;
+
+            case DECL:
+                if (c == '>') m_state = CONTENT;
+                break;
+        }
+    }
+    m_scanned += len;
+    return len;
+}
+
+void XMLTokenizer::consume(std::size_t n) {
+    if (complete() && n >= m_end) {
+        m_scanned -= n;
+        m_token = NONE;
+        m_start = npos;
+        m_end = 0;
+        return;
+    }
+    m_scanned -= n;
+    if (m_start != npos) m_start -= n;
+}
+
+void XMLTokenizer::reset(unsigned depth) {
+    m_state = CONTENT;
+    m_token = NONE;
+    m_depth = m_top = depth;
+    m_quote = 0;
+    m_match = 0;
+    m_empty = false;
+    m_scanned = 0;
+    m_start = npos;
+    m_end = 0;
+}
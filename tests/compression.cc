@@ -0,0 +1,154 @@
+#include "compression.h"
+#include "gtest/gtest.h"
+#include <event2/buffer.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+
+using namespace Metre;
+
+namespace {
+    std::string contents(struct evbuffer *buf) {
+        std::string s(evbuffer_get_length(buf), '\0');
+        evbuffer_remove(buf, s.data(), s.size());
+        return s;
+    }
+
+    // Stanzas much like the dictionary's, each in its own segment of the buffer.
+    std::list<std::string> traffic() {
+        std::list<std::string> stanzas;
+        for (int i = 0; i != 200; ++i) {
+            stanzas.push_back("<message type='chat' id='m" + std::to_string(i) +
+                              "' from='alice@example.com' to='bob@example.net'><body>Message " +
+                              std::to_string(i) + "</body><active xmlns='http://jabber.org/protocol/chatstates'/>"
+                              "<request xmlns='urn:xmpp:receipts'/></message>");
+        }
+        return stanzas;
+    }
+
+    // As the filter does: keep going until the input's used and nothing is held.
+    std::size_t decode(Codec &codec, struct evbuffer *src, struct evbuffer *dst, std::size_t limit,
+                       std::size_t *held = nullptr) {
+        std::size_t calls = 0;
+        while (evbuffer_get_length(src) || codec.pending()) {
+            if (held && !evbuffer_get_length(src)) ++*held;
+            EXPECT_TRUE(codec.transform(src, dst, limit));
+            if (++calls > 10000) break;
+        }
+        return calls;
+    }
+
+    std::size_t round_trip(std::string const &method, std::shared_ptr<std::string const> const &dictionary) {
+        auto stanzas = traffic();
+        std::string expected;
+        auto plain = evbuffer_new();
+        for (auto const &stanza : stanzas) {
+            evbuffer_add_reference(plain, stanza.data(), stanza.size(), nullptr, nullptr);
+            expected += stanza;
+        }
+        EXPECT_GT(evbuffer_peek(plain, -1, nullptr, nullptr, 0), 1);
+        auto wire = evbuffer_new();
+        auto out = evbuffer_new();
+        auto compress = compressor(method, 12, dictionary.get());
+        auto decompress = decompressor(method, 12, dictionary);
+        EXPECT_TRUE(compress->transform(plain, wire, 64 * 1024));
+        EXPECT_EQ(evbuffer_get_length(plain), 0U);
+        auto size = evbuffer_get_length(wire);
+        EXPECT_LT(size, expected.size());
+        decode(*decompress, wire, out, 64 * 1024);
+        EXPECT_EQ(contents(out), expected);
+        // And again, on the same streams.
+        evbuffer_add(plain, stanzas.front().data(), stanzas.front().size());
+        EXPECT_TRUE(compress->transform(plain, wire, 64 * 1024));
+        decode(*decompress, wire, out, 64 * 1024);
+        EXPECT_EQ(contents(out), stanzas.front());
+        evbuffer_free(plain);
+        evbuffer_free(wire);
+        evbuffer_free(out);
+        return size;
+    }
+
+    /**
+     * Far more out than in, arriving in pieces of every size, so that sooner or later a
+     * piece is used up while the decompressor is still holding output.
+     */
+    void held_output(std::string const &method) {
+        std::string expected(256 * 1024, 'a');
+        auto plain = evbuffer_new();
+        auto wire = evbuffer_new();
+        auto compress = compressor(method, 15, nullptr);
+        evbuffer_add(plain, expected.data(), expected.size());
+        ASSERT_TRUE(compress->transform(plain, wire, 64 * 1024));
+        auto compressed = contents(wire);
+        ASSERT_LT(compressed.size(), Codec::chunk_size);
+        std::size_t held = 0;
+        for (std::size_t piece = 1; piece <= 64; ++piece) {
+            auto src = evbuffer_new();
+            auto out = evbuffer_new();
+            auto decompress = decompressor(method, 15, nullptr);
+            for (std::size_t pos = 0; pos < compressed.size(); pos += piece) {
+                evbuffer_add(src, compressed.data() + pos, std::min(piece, compressed.size() - pos));
+                decode(*decompress, src, out, Codec::chunk_size, &held);
+            }
+            EXPECT_FALSE(decompress->pending());
+            EXPECT_EQ(contents(out), expected) << "piece=" << piece;
+            evbuffer_free(src);
+            evbuffer_free(out);
+        }
+        EXPECT_GT(held, 0U);
+        evbuffer_free(plain);
+        evbuffer_free(wire);
+    }
+}
+
+TEST(CompressionTest, Supported) {
+    EXPECT_TRUE(compression_supported("zlib"));
+    EXPECT_FALSE(compression_supported("lzw"));
+    EXPECT_THROW(compressor("lzw", 12, nullptr), std::runtime_error);
+    EXPECT_THROW(decompressor("lzw", 12, nullptr), std::runtime_error);
+}
+
+TEST(CompressionTest, Zlib) {
+    round_trip("zlib", nullptr);
+}
+
+TEST(CompressionTest, ZlibDictionary) {
+    auto dictionary = std::make_shared<std::string const>(compression_dictionary());
+    EXPECT_LT(round_trip("zlib", dictionary), round_trip("zlib", nullptr));
+}
+
+TEST(CompressionTest, ZlibMissingDictionary) {
+    std::string stanza = "<presence/>";
+    auto plain = evbuffer_new();
+    auto wire = evbuffer_new();
+    auto out = evbuffer_new();
+    auto compress = compressor("zlib", 12, &compression_dictionary());
+    auto decompress = decompressor("zlib", 12, nullptr);
+    evbuffer_add(plain, stanza.data(), stanza.size());
+    ASSERT_TRUE(compress->transform(plain, wire, 64 * 1024));
+    EXPECT_FALSE(decompress->transform(wire, out, 64 * 1024));
+    evbuffer_free(plain);
+    evbuffer_free(wire);
+    evbuffer_free(out);
+}
+
+TEST(CompressionTest, ZlibHeldOutput) {
+    held_output("zlib");
+}
+
+#ifdef HAVE_ZSTD
+TEST(CompressionTest, Zstd) {
+    EXPECT_TRUE(compression_supported("zstd"));
+    round_trip("zstd", nullptr);
+}
+
+TEST(CompressionTest, ZstdDictionary) {
+    auto dictionary = std::make_shared<std::string const>(compression_dictionary());
+    EXPECT_LT(round_trip("zstd", dictionary), round_trip("zstd", nullptr));
+}
+
+TEST(CompressionTest, ZstdHeldOutput) {
+    held_output("zstd");
+}
+#endif
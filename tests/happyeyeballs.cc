@@ -0,0 +1,101 @@
+#include "happyeyeballs.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace Metre;
+
+namespace {
+    std::map<Router::TimerHandle, std::function<void()>> timers;
+    Router::TimerHandle last_timer = 0;
+
+    // Fires whatever's armed, as if connection_attempt_delay had passed.
+    void fire() {
+        auto pending = std::move(timers);
+        timers.clear();
+        for (auto &timer : pending) timer.second();
+    }
+}
+
+namespace Metre {
+    namespace Router {
+        TimerHandle defer(std::function<void()> &&fn, std::chrono::milliseconds) {
+            timers.emplace(++last_timer, std::move(fn));
+            return last_timer;
+        }
+
+        bool cancel(TimerHandle timer) {
+            return timers.erase(timer) != 0;
+        }
+    }
+}
+
+class HappyEyeballsTest : public ::testing::Test {
+public:
+    std::vector<std::size_t> started;
+    std::vector<std::size_t> refused; // Candidates which fail at once.
+    bool exhausted = false;
+    HappyEyeballs pacer{std::chrono::milliseconds(250), [this](std::size_t n) {
+        started.push_back(n);
+        return std::find(refused.begin(), refused.end(), n) == refused.end();
+    }, [this]() { exhausted = true; }};
+
+    void SetUp() override {
+        timers.clear();
+    }
+};
+
+TEST_F(HappyEyeballsTest, Staggered) {
+    pacer.add(3);
+    ASSERT_EQ(started, (std::vector<std::size_t>{0}));
+    fire();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1}));
+    // A failure moves on without waiting.
+    pacer.failed();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1}));
+    pacer.failed();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1, 2}));
+    ASSERT_TRUE(timers.empty());
+    pacer.resolved();
+    ASSERT_FALSE(exhausted);
+    pacer.failed();
+    ASSERT_TRUE(exhausted);
+}
+
+TEST_F(HappyEyeballsTest, Refused) {
+    refused = {0, 1};
+    pacer.add(3);
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1, 2}));
+    ASSERT_EQ(pacer.in_flight(), 1U);
+}
+
+TEST_F(HappyEyeballsTest, LateCandidates) {
+    pacer.add(2);
+    fire();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1}));
+    ASSERT_TRUE(timers.empty());
+    // Both attempts hang; the next target's addresses mustn't wait for them to time out.
+    pacer.add(2);
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1}));
+    ASSERT_EQ(timers.size(), 1U);
+    fire();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1, 2}));
+    fire();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0, 1, 2, 3}));
+    ASSERT_TRUE(timers.empty());
+    pacer.resolved();
+    ASSERT_TRUE(timers.empty());
+    ASSERT_FALSE(exhausted);
+}
+
+TEST_F(HappyEyeballsTest, Stop) {
+    pacer.add(2);
+    ASSERT_EQ(timers.size(), 1U);
+    pacer.stop();
+    ASSERT_TRUE(timers.empty());
+    pacer.failed();
+    pacer.resolved();
+    ASSERT_EQ(started, (std::vector<std::size_t>{0}));
+    ASSERT_FALSE(exhausted);
+}
@@ -17,3 +17,22 @@ TEST(JidTest, Tests) {
     ASSERT_EQ(three.full().length(), std::string("dwd@dave.cridland.net/Resource").length());
     ASSERT_EQ(three.full(), "dwd@dave.cridland.net/Resource");
 }
+
+TEST(JidTest, DomainId) {
+    Jid one("dwd@DAVE.CRIDLAND.NET/Resource");
+    Jid two("dwd", "dave.cridland.net");
+    ASSERT_EQ(one.domain_id(), two.domain_id());
+    ASSERT_EQ(&one.domain(), &two.domain());
+    ASSERT_NE(one.domain_id(), DomainId("cridland.net"));
+    ASSERT_TRUE(DomainId().empty());
+}
+
+TEST(JidTest, CaseFold) {
+    ASSERT_EQ(Jid("example.org").domain(), "example.org");
+    ASSERT_EQ(Jid("a@b/c@d").domain(), "b");
+    ASSERT_EQ(Jid("a@b/c@d").full(), "a@b/c@d");
+    ASSERT_EQ(Jid("conference.Example.ORG/room").domain(), "conference.example.org");
+    ASSERT_EQ(Jid("x@[example]@.Z`").domain(), "[example]@.z`");
+    std::string long_domain(300, 'Q');
+    ASSERT_EQ(Jid(long_domain).domain(), std::string(300, 'q'));
+}
@@ -27,6 +27,10 @@ SOFTWARE.
 #include <fstream>
 #include <iostream>
 
+bool Metre::Log::enabled(Log::LEVEL) {
+    return true;
+}
+
 void Metre::Log::log(Log::LEVEL lvlm, std::string const &filename, int line, std::string const &stuff) {
     const char *lvl = "UNKNOWN";
     switch (lvlm) {
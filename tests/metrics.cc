@@ -0,0 +1,33 @@
+#include "metrics.h"
+#include "gtest/gtest.h"
+#include <string>
+
+using namespace Metre;
+
+TEST(MetricsTest, Render) {
+    auto &c = Metrics::counter("test_stanzas_total", "Stanzas.", {{"domain", "example.org"}, {"direction", "in"}});
+    c.inc();
+    c.inc(2);
+    ASSERT_EQ(&c, &Metrics::counter("test_stanzas_total", "Stanzas.", {{"domain", "example.org"}, {"direction", "in"}}));
+    Metrics::gauge("test_depth", "Depth.", {{"name", "a\"b"}}).set(-4);
+    auto text = Metrics::render();
+    ASSERT_NE(text.find("# TYPE test_stanzas_total counter\n"), std::string::npos);
+    ASSERT_NE(text.find("test_stanzas_total{domain=\"example.org\",direction=\"in\"} 3\n"), std::string::npos);
+    ASSERT_NE(text.find("test_depth{name=\"a\\\"b\"} -4\n"), std::string::npos);
+    ASSERT_THROW(Metrics::gauge("test_stanzas_total", "Stanzas."), std::runtime_error);
+    Metrics::remove("test_depth", {{"name", "a\"b"}});
+    ASSERT_EQ(Metrics::render().find("test_depth"), std::string::npos);
+}
+
+TEST(MetricsTest, Histogram) {
+    auto &h = Metrics::histogram("test_latency_seconds", "Latency.");
+    h.observe(std::chrono::milliseconds(3));
+    h.observe(std::chrono::seconds(60));
+    auto text = Metrics::render();
+    ASSERT_NE(text.find("test_latency_seconds_bucket{le=\"0.0025\"} 0\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_bucket{le=\"0.005\"} 1\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_bucket{le=\"30\"} 1\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_bucket{le=\"+Inf\"} 2\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_sum 60.003\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_count 2\n"), std::string::npos);
+}
@@ -0,0 +1,40 @@
+#include "mpsc.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <vector>
+
+using namespace Metre;
+
+TEST(MPSCQueueTest, Order) {
+    MPSCQueue<int> queue;
+    ASSERT_FALSE(queue.pop());
+    queue.push(1);
+    queue.push(2);
+    ASSERT_EQ(*queue.pop(), 1);
+    ASSERT_EQ(*queue.pop(), 2);
+    ASSERT_FALSE(queue.pop());
+}
+
+TEST(MPSCQueueTest, Producers) {
+    MPSCQueue<int> queue;
+    const int per_thread = 10000;
+    std::vector<std::thread> producers;
+    for (int t = 0; t != 4; ++t) {
+        producers.emplace_back([&queue, t]() {
+            for (int i = 0; i != per_thread; ++i) queue.push(t * per_thread + i);
+        });
+    }
+    std::vector<int> last(4, -1);
+    int count = 0;
+    while (count != 4 * per_thread) {
+        auto v = queue.pop();
+        if (!v) continue;
+        // Each producer's items arrive in the order pushed.
+        int t = *v / per_thread;
+        ASSERT_GT(*v, last[t]);
+        last[t] = *v;
+        ++count;
+    }
+    for (auto &p : producers) p.join();
+    ASSERT_FALSE(queue.pop());
+}
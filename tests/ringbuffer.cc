@@ -0,0 +1,35 @@
+#include "ringbuffer.h"
+#include "gtest/gtest.h"
+#include <memory>
+
+using namespace Metre;
+
+TEST(RingBufferTest, Order) {
+    RingBuffer<int> ring;
+    ASSERT_TRUE(ring.empty());
+    ring.push_back(1);
+    ring.push_back(2);
+    ASSERT_EQ(ring.size(), 2U);
+    ASSERT_EQ(ring.front(), 1);
+    ASSERT_EQ(ring[1], 2);
+    ASSERT_EQ(ring.pop_front(), 1);
+    ASSERT_EQ(ring.pop_front(), 2);
+    ASSERT_TRUE(ring.empty());
+}
+
+TEST(RingBufferTest, WrapAndGrow) {
+    RingBuffer<std::unique_ptr<int>> ring;
+    int next = 0, expect = 0;
+    // Keep the head moving so growth happens with the contents wrapped.
+    for (int round = 0; round != 8; ++round) {
+        for (int i = 0; i != 10; ++i) ring.push_back(std::make_unique<int>(next++));
+        for (int i = 0; i != 7; ++i) ASSERT_EQ(*ring.pop_front(), expect++);
+    }
+    ASSERT_EQ(ring.size(), 24U);
+    ASSERT_EQ(ring.capacity(), 32U);
+    for (std::size_t i = 0; i != ring.size(); ++i) ASSERT_EQ(*ring[i], expect + static_cast<int>(i));
+    auto capacity = ring.capacity();
+    ring.clear();
+    ASSERT_TRUE(ring.empty());
+    ASSERT_EQ(ring.capacity(), capacity);
+}
@@ -2,6 +2,7 @@
 #include "gtest/gtest.h"
 #include <iostream>
 #include "rapidxml_print.hpp"
+#include <event2/buffer.h>
 
 using namespace Metre;
 
@@ -37,6 +38,16 @@ TEST_F(MessageTest, MessageBody) {
     ASSERT_EQ(msg->node()->first_node("body")->value(), std::string("This is the body"));
 }
 
+TEST_F(MessageTest, RenderEvbuffer) {
+    msg->freeze();
+    auto buf = evbuffer_new();
+    msg->render(buf);
+    std::string out(evbuffer_get_length(buf), '\0');
+    evbuffer_remove(buf, out.data(), out.size());
+    evbuffer_free(buf);
+    ASSERT_EQ(out, "<message to='bar@example.net/laks' from='foo@example.org/lmas' type='chat' id='1234'><body>This is the body</body></message>");
+}
+
 class IqTest : public ::testing::Test {
 public:
     std::unique_ptr<Iq> iq;
@@ -0,0 +1,82 @@
+#include "timerwheel.h"
+#include "gtest/gtest.h"
+#include <stdexcept>
+#include <vector>
+
+using namespace Metre;
+
+TEST(TimerWheelTest, Order) {
+    TimerWheel wheel(1000);
+    std::vector<int> fired;
+    wheel.add(1300, [&fired]() { fired.push_back(3); });
+    wheel.add(1001, [&fired]() { fired.push_back(1); });
+    wheel.add(1100, [&fired]() { fired.push_back(2); });
+    ASSERT_EQ(wheel.next_wakeup(), 1001U);
+    ASSERT_EQ(wheel.advance(1099), 1U);
+    ASSERT_EQ(wheel.advance(1100), 1U);
+    ASSERT_EQ(wheel.advance(1299), 0U);
+    ASSERT_EQ(wheel.advance(1300), 1U);
+    ASSERT_EQ(fired, (std::vector<int>{1, 2, 3}));
+    ASSERT_TRUE(wheel.empty());
+    ASSERT_FALSE(wheel.next_wakeup());
+}
+
+TEST(TimerWheelTest, Cancel) {
+    TimerWheel wheel;
+    int fired = 0;
+    auto a = wheel.add(50, [&fired]() { ++fired; });
+    auto b = wheel.add(50, [&fired]() { fired += 10; });
+    ASSERT_TRUE(wheel.cancel(a));
+    ASSERT_FALSE(wheel.cancel(a));
+    wheel.advance(100);
+    ASSERT_EQ(fired, 10);
+    ASSERT_FALSE(wheel.cancel(b));
+    // Reused slots don't honour stale handles.
+    auto c = wheel.add(150, [&fired]() { ++fired; });
+    ASSERT_NE(a, c);
+    ASSERT_FALSE(wheel.cancel(a));
+    ASSERT_TRUE(wheel.cancel(c));
+}
+
+TEST(TimerWheelTest, Cascade) {
+    TimerWheel wheel(12345);
+    std::vector<std::uint64_t> fired;
+    std::vector<std::uint64_t> expiries{12345 + 255, 12345 + 256, 12345 + 70000, 12345 + 20000000,
+                                        12345 + 5000000000ULL};
+    for (auto expiry : expiries) {
+        wheel.add(expiry, [&fired, &wheel]() { fired.push_back(wheel.now()); });
+    }
+    // Advance in uneven steps, never past the next wakeup, to check each fires exactly on time.
+    while (!wheel.empty()) {
+        wheel.advance(*wheel.next_wakeup());
+    }
+    ASSERT_EQ(fired, expiries);
+}
+
+TEST(TimerWheelTest, Reentrant) {
+    TimerWheel wheel;
+    int fired = 0;
+    std::function<void()> again = [&]() {
+        if (++fired < 3) wheel.add(wheel.now(), std::function<void()>(again));
+    };
+    wheel.add(10, std::function<void()>(again));
+    ASSERT_EQ(wheel.advance(10), 1U);
+    ASSERT_EQ(wheel.advance(12), 2U);
+    ASSERT_EQ(fired, 3);
+}
+
+TEST(TimerWheelTest, Throwing) {
+    TimerWheel wheel;
+    std::vector<int> fired;
+    wheel.add(10, [&fired]() { fired.push_back(1); });
+    wheel.add(10, []() { throw std::runtime_error("boom"); });
+    wheel.add(10, [&fired]() { fired.push_back(2); });
+    wheel.add(20, [&fired]() { fired.push_back(3); });
+    ASSERT_THROW(wheel.advance(30), std::runtime_error);
+    ASSERT_EQ(fired.size(), 2U);
+    ASSERT_EQ(wheel.size(), 1U);
+    ASSERT_EQ(wheel.next_wakeup(), 20U);
+    ASSERT_EQ(wheel.advance(30), 1U);
+    ASSERT_EQ(fired.back(), 3);
+    ASSERT_TRUE(wheel.empty());
+}
@@ -0,0 +1,37 @@
+#include "xmlpool.h"
+#include "gtest/gtest.h"
+#include <thread>
+
+using namespace Metre;
+
+TEST(XMLPoolTest, Reuse) {
+    auto before = XMLPool::stats();
+    rapidxml::xml_document<> *raw;
+    {
+        auto doc = XMLPool::document();
+        raw = doc.get();
+        // Enough to outgrow the inline pool.
+        for (int i = 0; i != 10000; ++i) doc->append_node(doc->allocate_node(rapidxml::node_element, "x"));
+    }
+    auto grown = XMLPool::stats();
+    ASSERT_GT(grown.misses, before.misses);
+    {
+        auto doc = XMLPool::document();
+        ASSERT_EQ(doc.get(), raw);
+        ASSERT_EQ(doc->first_node(), nullptr);
+        for (int i = 0; i != 10000; ++i) doc->append_node(doc->allocate_node(rapidxml::node_element, "x"));
+    }
+    auto reused = XMLPool::stats();
+    ASSERT_EQ(reused.misses, grown.misses);
+    ASSERT_GT(reused.hits, grown.hits);
+}
+
+TEST(XMLPoolTest, Threads) {
+    auto before = XMLPool::stats();
+    std::thread([]() {
+        auto doc = XMLPool::document();
+        doc->append_node(doc->allocate_node(rapidxml::node_element, "x"));
+    }).join();
+    // Each thread has its own pool, but the counts survive it.
+    ASSERT_GT(XMLPool::stats().misses, before.misses);
+}
@@ -0,0 +1,94 @@
+#include "xmltokenizer.h"
+#include "gtest/gtest.h"
+#include <string>
+
+using namespace Metre;
+
+class XMLTokenizerTest : public ::testing::Test {
+public:
+    XMLTokenizer tokenizer;
+    std::string buf;
+
+    // Feed the buffer one octet at a time, as a worst case for resumption.
+    XMLTokenizer::TOKEN trickle() {
+        while (!tokenizer.complete() && tokenizer.scanned() < buf.size()) {
+            tokenizer.feed(buf.data() + tokenizer.scanned(), 1);
+        }
+        return tokenizer.token();
+    }
+
+    XMLTokenizer::TOKEN gulp() {
+        tokenizer.feed(buf.data() + tokenizer.scanned(), buf.size() - tokenizer.scanned());
+        return tokenizer.token();
+    }
+
+    std::string take() {
+        std::string token = buf.substr(tokenizer.leading(), tokenizer.length() - tokenizer.leading());
+        buf.erase(0, tokenizer.length());
+        tokenizer.consume(tokenizer.length());
+        return token;
+    }
+};
+
+TEST_F(XMLTokenizerTest, StreamOpen) {
+    buf = "<?xml version='1.0'?>\n<stream:stream xmlns:stream='http://etherx.jabber.org/streams' to='example.org'><message/>";
+    ASSERT_EQ(trickle(), XMLTokenizer::STREAM_OPEN);
+    ASSERT_EQ(take(), "<?xml version='1.0'?>\n<stream:stream xmlns:stream='http://etherx.jabber.org/streams' to='example.org'>");
+    ASSERT_EQ(tokenizer.depth(), 1U);
+    ASSERT_EQ(gulp(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(take(), "<message/>");
+    ASSERT_TRUE(buf.empty());
+}
+
+TEST_F(XMLTokenizerTest, Stanzas) {
+    tokenizer.reset(1);
+    buf = " \r\n<message to='a/>b' from=\"c>d\"><body>Hi <![CDATA[</message>]]> <!-- </message> --></body></message>"
+          "<iq type='get'><query/></iq>\n</stream:stream>";
+    ASSERT_EQ(trickle(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(tokenizer.leading(), 3U);
+    ASSERT_EQ(take(), "<message to='a/>b' from=\"c>d\"><body>Hi <![CDATA[</message>]]> <!-- </message> --></body></message>");
+    ASSERT_EQ(gulp(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(take(), "<iq type='get'><query/></iq>");
+    ASSERT_EQ(gulp(), XMLTokenizer::STREAM_CLOSE);
+    ASSERT_EQ(take(), "</stream:stream>");
+    ASSERT_EQ(tokenizer.depth(), 0U);
+}
+
+TEST_F(XMLTokenizerTest, Partial) {
+    tokenizer.reset(1);
+    buf = "  <presence><status>Away";
+    ASSERT_EQ(gulp(), XMLTokenizer::NONE);
+    ASSERT_EQ(tokenizer.scanned(), buf.size());
+    ASSERT_EQ(tokenizer.leading(), 2U);
+    // Drop the whitespace, keep the partial element.
+    tokenizer.consume(2);
+    buf.erase(0, 2);
+    ASSERT_EQ(tokenizer.scanned(), buf.size());
+    buf += "</status></presence>";
+    ASSERT_EQ(gulp(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(take(), "<presence><status>Away</status></presence>");
+}
+
+TEST_F(XMLTokenizerTest, Whitespace) {
+    tokenizer.reset(1);
+    buf = " \n \n";
+    ASSERT_EQ(gulp(), XMLTokenizer::NONE);
+    ASSERT_EQ(tokenizer.leading(), buf.size());
+}
+
+TEST_F(XMLTokenizerTest, LongRuns) {
+    tokenizer.reset(1);
+    std::string ws(100, ' ');
+    std::string body(100, 'x');
+    std::string attr(70, 'y');
+    std::string element = "<message to='" + attr + "/>" + attr + "' id=\"" + attr + "\"><body>" + body +
+                          "<![CDATA[" + body + "]]]>" + body + "<!--" + body + "-->" + "<?pi " + body + "?>" +
+                          "</body><x" + ws + "/></message>";
+    buf = ws + "\n\t\r" + ws + element + ws + "<presence/>";
+    ASSERT_EQ(gulp(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(tokenizer.leading(), 2 * ws.size() + 3);
+    ASSERT_EQ(take(), element);
+    ASSERT_EQ(gulp(), XMLTokenizer::ELEMENT);
+    ASSERT_EQ(take(), "<presence/>");
+    ASSERT_TRUE(buf.empty());
+}